@@ -0,0 +1,38 @@
+#pragma once
+
+// Content cache of impfi --cache, built into impfilib, not part of the reader's API
+
+#include "peimage.h"
+
+#include <memory>
+#include <mutex>
+
+// Parsed images shared between identical files, for --cache
+// Files are identified by their size, their first page and their import directory, the page holds the headers,
+// whose timestamp and checksum differ between builds, so a match is taken to be the same binary
+// The bytes are kept with each image, a file with the same hash is only given the image when its bytes are equal too
+struct CachedImage
+{
+	ULONGLONG Size;
+	std::vector<uint8_t> Content;		// The first page, then the import directory
+	std::shared_ptr<const PeImage> Image;	// A copy allocated from the default memory resource
+};
+
+struct ImageCache
+{
+	std::mutex Lock;
+	std::unordered_map<ULONGLONG, CachedImage> Images;		// By hash of the size and content
+};
+
+// As OpenImage, pImage is set to Image, or to the cached image of an identical file
+// Without a cache this is OpenImage
+FILE *
+OpenCachedImage(
+	const std::string& Path,
+	bool bExports,
+	ImageCache *Cache,
+	PeImage& Image,
+	const PeImage *& pImage,
+	PeError *Error,
+	long long *pSize = NULL
+);
@@ -1,376 +1,3734 @@
 #include <Windows.h>
+#include <sddl.h>
+#include <io.h>
+#include <fcntl.h>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
 #include <vector>
 #include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <array>
+#include <algorithm>
+#include <unordered_map>
+#include <charconv>
+#include <set>
+#include <shared_mutex>
+#include <condition_variable>
+#include <deque>
+#include <climits>
 
+#include "md5.h"
+#include "peimage.h"
+#include "scanstats.h"
+#include "imagecache.h"
+#include "resultstream.h"
+#include "ziparchive.h"
+
+// The parser prints nothing, its failures are reported here
+static void
+ReportImageError(
+	const std::string& Path,
+	const PeError& Error
+)
+{
+	if ( const char *pszMessage = PeErrorMessage( Error ) )
+		fprintf( stderr, "%s - %s\n", Path.c_str(), pszMessage );
+}
+
+// A file whose delay imports or exports could not be read is still matched on the rest, the failures are reported on their own
+static void
+ReportDirectoryErrors(
+	const std::string& Path,
+	const PeImage& Image
+)
+{
+	const char *pszMessage;
+
+	if ( Image.DelayImportError.Step && ( pszMessage = PeErrorMessage( Image.DelayImportError ) ) )
+		fprintf( stderr, "%s - %s, delay imports not read\n", Path.c_str(), pszMessage );
+
+	if ( Image.ExportError.Step && ( pszMessage = PeErrorMessage( Image.ExportError ) ) )
+		fprintf( stderr, "%s - %s, exports not read\n", Path.c_str(), pszMessage );
+}
+
+// Imphash as pefile computes it, the md5 of "dll.function,dll.function..." in import order
+// Names are lower case, dll names lose a .dll/.sys/.ocx extension, ordinals are "ord123"
+static void
+ComputeImphash(
+	const PeImage& Image,
+	uint8_t Digest[16]
+)
+{
+	Md5Context Context;
+	std::string Entry;
+	bool First = true;
+
+	Md5Init( &Context );
+
+	for ( size_t i = 0; i < Image.ImportDllNames.size(); i++ )
+	{
+		std::string Dll( Image.ImportDllNames[i] );
+		std::transform( Dll.begin(), Dll.end(), Dll.begin(), []( unsigned char c ) { return (char)tolower( c ); } );
+
+		size_t Dot = Dll.rfind( '.' );
+
+		if ( Dot != std::string::npos && ( 0 == Dll.compare( Dot, std::string::npos, ".dll" ) || 0 == Dll.compare( Dot, std::string::npos, ".sys" ) || 0 == Dll.compare( Dot, std::string::npos, ".ocx" ) ) )
+			Dll.resize( Dot );
+
+		for ( const PeName& Thunk : Image.ImportThunkNames[i] )
+		{
+			Entry.assign( First ? "" : "," );
+			Entry += Dll;
+			Entry += '.';
+
+			if ( Thunk[0] == '#' )
+				Entry.append( "ord" ).append( Thunk, 1, std::string::npos );
+			else
+				Entry += Thunk;
+
+			std::transform( Entry.begin(), Entry.end(), Entry.begin(), []( unsigned char c ) { return (char)tolower( c ); } );
+			Md5Update( &Context, Entry.data(), Entry.size() );
+			First = false;
+		}
+	}
+
+	Md5Final( &Context, Digest );
+}
+
+// MinHash signatures of import sets, banded for locality sensitive hashing
+// 16 bands of 4 rows puts sets that are ~50% similar into a shared bucket, candidates are then checked against the threshold
+const int MinHashSize = 64;
+const int LshBands = 16;
+const int LshRows = MinHashSize / LshBands;
+
+typedef std::array<DWORD, MinHashSize> MinHashSignature;
+
+static ULONGLONG
+MixHash(
+	ULONGLONG x
+)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+// Id of an import, fnv-1a of "dll!function" with the dll in lower case, so every worker agrees without a shared table
+static ULONGLONG
+ImportId(
+	std::string_view Dll,
+	std::string_view Function
+)
+{
+	ULONGLONG Hash = 0xcbf29ce484222325ull;
+
+	for ( unsigned char c : Dll )
+		Hash = ( Hash ^ (unsigned char)tolower( c ) ) * 0x100000001b3ull;
+
+	Hash = ( Hash ^ '!' ) * 0x100000001b3ull;
+
+	for ( unsigned char c : Function )
+		Hash = ( Hash ^ c ) * 0x100000001b3ull;
+
+	return Hash;
+}
+
+// Returns the number of imports hashed, regular and delay loaded imports form one set
+static size_t
+ComputeMinHash(
+	const PeImage& Image,
+	MinHashSignature& Signature
+)
+{
+	size_t numImports = 0;
+
+	Signature.fill( 0xffffffff );
+
+	auto Add = [&]( const PeNames& DllNames, const PeNamesByDll& ThunkNames )
+	{
+		for ( size_t i = 0; i < DllNames.size(); i++ )
+		{
+			for ( const PeName& Thunk : ThunkNames[i] )
+			{
+				ULONGLONG Id = ImportId( DllNames[i], Thunk );
+
+				// Each slot is a different permutation of the ids
+				for ( int k = 0; k < MinHashSize; k++ )
+					Signature[k] = std::min( Signature[k], (DWORD)( MixHash( Id + k * 0x9e3779b97f4a7c15ull ) >> 32 ) );
+
+				numImports++;
+			}
+		}
+	};
+
+	Add( Image.ImportDllNames, Image.ImportThunkNames );
+	Add( Image.DelayImportDllNames, Image.DelayImportThunkNames );
+
+	return numImports;
+}
+
+// Estimated jaccard similarity of two import sets
+static double
+MinHashSimilarity(
+	const MinHashSignature& a,
+	const MinHashSignature& b
+)
+{
+	int Equal = 0;
+
+	for ( int k = 0; k < MinHashSize; k++ )
+		Equal += a[k] == b[k];
+
+	return Equal / (double)MinHashSize;
+}
+
+static size_t
+FindCluster(
+	std::vector<size_t>& Parent,
+	size_t i
+)
+{
+	while ( Parent[i] != i )
+		i = Parent[i] = Parent[Parent[i]];
+
+	return i;
+}
+
+// Cluster files whose import sets are at least Threshold similar, printing each cluster with each file's nearest neighbour
+// Only files sharing an lsh bucket are compared, and each only with the few before it in the bucket, so the work stays linear
+static void
+ClusterSimilarImages(
+	const std::vector<std::string>& Paths,
+	const std::vector<MinHashSignature>& Signatures,
+	const std::vector<char>& Valid,
+	double Threshold
+)
+{
+	const size_t MaxCompares = 8;
+	const size_t None = (size_t)-1;
+
+	std::vector<std::pair<ULONGLONG, size_t>> Buckets;
+	Buckets.reserve( Paths.size() * LshBands );
+
+	for ( size_t i = 0; i < Paths.size(); i++ )
+	{
+		if ( !Valid[i] )
+			continue;
+
+		for ( int b = 0; b < LshBands; b++ )
+		{
+			ULONGLONG Key = MixHash( b + 1 );
+
+			for ( int r = 0; r < LshRows; r++ )
+				Key = MixHash( Key ^ Signatures[i][b * LshRows + r] );
+
+			Buckets.push_back( { Key, i } );
+		}
+	}
+
+	std::sort( Buckets.begin(), Buckets.end() );
+
+	std::vector<size_t> Parent( Paths.size() );
+	std::vector<std::pair<size_t, double>> Nearest( Paths.size(), { None, 0.0 } );
+
+	for ( size_t i = 0; i < Parent.size(); i++ )
+		Parent[i] = i;
+
+	for ( size_t Start = 0, End; Start < Buckets.size(); Start = End )
+	{
+		for ( End = Start + 1; End < Buckets.size() && Buckets[End].first == Buckets[Start].first; End++ )
+			;
+
+		for ( size_t j = Start + 1; j < End; j++ )
+		{
+			size_t a = Buckets[j].second;
+
+			for ( size_t i = j - 1; i + 1 > Start && j - i <= MaxCompares; i-- )
+			{
+				size_t b = Buckets[i].second;
+				double Similarity = MinHashSimilarity( Signatures[a], Signatures[b] );
+
+				if ( Similarity > Nearest[a].second )
+					Nearest[a] = { b, Similarity };
+
+				if ( Similarity > Nearest[b].second )
+					Nearest[b] = { a, Similarity };
+
+				if ( Similarity >= Threshold )
+					Parent[FindCluster( Parent, a )] = FindCluster( Parent, b );
+			}
+		}
+	}
+
+	// Group by root, biggest clusters first
+	std::vector<std::pair<size_t, size_t>> Members;
+
+	for ( size_t i = 0; i < Paths.size(); i++ )
+	{
+		if ( Valid[i] )
+			Members.push_back( { FindCluster( Parent, i ), i } );
+	}
+
+	std::vector<size_t> Size( Paths.size(), 0 );
+
+	for ( auto& Member : Members )
+		Size[Member.first]++;
+
+	std::sort( Members.begin(), Members.end(), [&]( const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b )
+	{
+		return Size[a.first] != Size[b.first] ? Size[a.first] > Size[b.first] : a < b;
+	} );
+
+	int numClusters = 0;
+
+	for ( size_t m = 0; m < Members.size(); m++ )
+	{
+		size_t Root = Members[m].first;
+		size_t i = Members[m].second;
+
+		if ( Size[Root] < 2 )
+			break;
+
+		if ( m == 0 || Members[m - 1].first != Root )
+			std::cout << numClusters++ << " - " << Size[Root] << " file(s)\n";
+
+		std::cout << '\t' << Paths[i];
+
+		if ( Nearest[i].first != None )
+			std::cout << " - nearest " << Paths[Nearest[i].first] << " (" << Nearest[i].second << ')';
+
+		std::cout << '\n';
+	}
+}
+
+enum OutputFormat
+{
+	FormatText,
+	FormatNdjson,
+	FormatCsv,
+	FormatTsv,
+	FormatBinary
+};
+
+// Each worker appends whole records to its own buffer, which is written out in large blocks
+// Records never span two writes, so the output of workers does not interleave
+const size_t OutputBufferSize = 1 << 20;
+
+struct OutputBuffer
+{
+	std::string Data;
+
+	// Binary format string table, ids come from a counter shared by the workers, so every id below the last is used
+	// and a reader can reject ids past the number of records that fit in the stream
+	// Every worker defines its own strings in its own buffer, so a definition is always written before its references
+	std::unordered_map<std::string, DWORD> StringIds;
+	std::atomic<DWORD> *pNextString = NULL;
+	DWORD NextString = 0;		// When there is no shared counter
+};
+
+static void
+FlushOutput(
+	OutputBuffer& Buffer,
+	std::mutex& OutputLock
+)
+{
+	if ( Buffer.Data.empty() )
+		return;
+
+	std::lock_guard<std::mutex> Lock( OutputLock );
+
+	fwrite( Buffer.Data.data(), 1, Buffer.Data.size(), stdout );
+	Buffer.Data.clear();
+}
+
+// Append a binary string record with a new id
+static DWORD
+AppendStringRecord(
+	OutputBuffer& Buffer,
+	std::string_view Value
+)
+{
+	DWORD Id = Buffer.pNextString ? ( *Buffer.pNextString )++ : Buffer.NextString++;
+
+	ResultStringRecord Record = {};
+	Record.Header.Size = ResultRecordSize( sizeof( Record ) + Value.size() + 1 );
+	Record.Header.Type = ResultRecordString;
+	Record.Id = Id;
+	Record.Length = (uint32_t)Value.size();
+
+	size_t Start = Buffer.Data.size();
+	Buffer.Data.append( (const char *)&Record, sizeof( Record ) ).append( Value );
+	Buffer.Data.resize( Start + Record.Header.Size, 0 );
+
+	return Id;
+}
+
+// Id of a repeated name, written once per worker
+static DWORD
+InternString(
+	OutputBuffer& Buffer,
+	std::string_view Value
+)
+{
+	auto Found = Buffer.StringIds.emplace( Value, 0 );
+
+	if ( Found.second )
+		Found.first->second = AppendStringRecord( Buffer, Value );
+
+	return Found.first->second;
+}
+
+template <typename T>
+static void
+AppendNumber(
+	std::string& Buffer,
+	T Value
+)
+{
+	char Digits[32];
+	std::to_chars_result Result = std::to_chars( Digits, Digits + sizeof( Digits ), Value );
+	Buffer.append( Digits, Result.ptr );
+}
+
+// Six significant digits, as the stream formatting of the text output always had
+static void
+AppendKilobytes(
+	std::string& Buffer,
+	long long SizeInBytes
+)
+{
+	char Digits[32];
+	std::to_chars_result Result = std::to_chars( Digits, Digits + sizeof( Digits ), SizeInBytes / 1024.f, std::chars_format::general, 6 );
+	Buffer.append( Digits, Result.ptr );
+}
+
+// Quote or escape a field for the output format, text is written as is
+static void
+AppendField(
+	std::string& Buffer,
+	const char *Value,
+	size_t Length,
+	OutputFormat Format
+)
+{
+	switch ( Format )
+	{
+	case FormatNdjson:
+		Buffer += '"';
+
+		for ( size_t i = 0; i < Length; i++ )
+		{
+			unsigned char c = (unsigned char)Value[i];
+
+			if ( c == '"' || c == '\\' )
+			{
+				Buffer += '\\';
+				Buffer += (char)c;
+			}
+			else if ( c < 0x20 )
+			{
+				static const char Digits[] = "0123456789abcdef";
+				Buffer.append( "\\u00" );
+				Buffer += Digits[c >> 4];
+				Buffer += Digits[c & 15];
+			}
+			else
+				Buffer += (char)c;
+		}
+
+		Buffer += '"';
+		break;
+
+	case FormatCsv:
+		// Only quote fields that need it, paths and names rarely do
+		if ( std::find_if( Value, Value + Length, []( char c ) { return c == ',' || c == '"' || c == '\n' || c == '\r'; } ) == Value + Length )
+		{
+			Buffer.append( Value, Length );
+			break;
+		}
+
+		Buffer += '"';
+
+		for ( size_t i = 0; i < Length; i++ )
+		{
+			if ( Value[i] == '"' )
+				Buffer += '"';
+
+			Buffer += Value[i];
+		}
+
+		Buffer += '"';
+		break;
+
+	case FormatTsv:
+		for ( size_t i = 0; i < Length; i++ )
+		{
+			switch ( Value[i] )
+			{
+			case '\t': Buffer.append( "\\t" ); break;
+			case '\n': Buffer.append( "\\n" ); break;
+			case '\r': Buffer.append( "\\r" ); break;
+			case '\\': Buffer.append( "\\\\" ); break;
+			default: Buffer += Value[i]; break;
+			}
+		}
+		break;
+
+	default:
+		Buffer.append( Value, Length );
+		break;
+	}
+}
+
+static void
+AppendField(
+	std::string& Buffer,
+	std::string_view Value,
+	OutputFormat Format
+)
+{
+	AppendField( Buffer, Value.data(), Value.size(), Format );
+}
+
+static void
+AppendField(
+	std::string& Buffer,
+	const char *Value,
+	OutputFormat Format
+)
+{
+	AppendField( Buffer, Value, strlen( Value ), Format );
+}
+
+static const char *const HitKindNames[] = { "import", "delay", "export" };
+
+// Written before any worker output, the header row of the csv and tsv formats (one row is written per hit) or the binary stream header
+// With --queries the rows end with the name of the query
+static void
+WriteHeader(
+	OutputFormat Format,
+	bool bQueries
+)
+{
+	if ( Format == FormatCsv )
+		fputs( bQueries ? "path,size,kind,dll,name,export,forwarder,imphash,query\n" : "path,size,kind,dll,name,export,forwarder,imphash\n", stdout );
+	else if ( Format == FormatTsv )
+		fputs( bQueries ? "path\tsize\tkind\tdll\tname\texport\tforwarder\timphash\tquery\n" : "path\tsize\tkind\tdll\tname\texport\tforwarder\timphash\n", stdout );
+	else if ( Format == FormatBinary )
+	{
+		ResultStreamHeader Header = {};
+		memcpy( Header.Magic, RESULT_STREAM_MAGIC, sizeof( Header.Magic ) );
+		Header.Version = RESULT_STREAM_VERSION;
+
+		// No newline translation of binary records
+		_setmode( _fileno( stdout ), _O_BINARY );
+		fwrite( &Header, sizeof( Header ), 1, stdout );
+	}
+}
+
+// One file record followed by its hits, see resultstream.h
+static void
+AppendBinaryResult(
+	OutputBuffer& Buffer,
+	const std::string& Path,
+	long long SizeInBytes,
+	const PeImage& Image,
+	const std::vector<ImportHit>& Hits,
+	const char *const *const ppszImports,
+	const uint8_t *Imphash,
+	const char *pszQuery
+)
+{
+	static const uint32_t Kinds[] = { ResultHitImport, ResultHitDelayLoad, ResultHitExport };
+
+	std::vector<ResultHitRecord> HitRecords( Hits.size() );
+
+	// Strings are written before the file record that references them
+	for ( size_t i = 0; i < Hits.size(); i++ )
+	{
+		const ImportHit& Hit = Hits[i];
+		ResultHitRecord& Record = HitRecords[i];
+
+		Record.Kind = Kinds[Hit.Kind];
+		Record.DllId = RESULT_STRING_NONE;
+		Record.NameId = InternString( Buffer, ppszImports[Hit.Import] );
+		Record.ExportId = RESULT_STRING_NONE;
+		Record.ForwarderId = RESULT_STRING_NONE;
+
+		if ( Hit.Kind == HitImport )
+			Record.DllId = InternString( Buffer, Image.ImportDllNames[Hit.Dll] );
+		else if ( Hit.Kind == HitDelayLoad )
+			Record.DllId = InternString( Buffer, Image.DelayImportDllNames[Hit.Dll] );
+		else
+		{
+			Record.ExportId = InternString( Buffer, Image.ExportNames[Hit.Index] );
+
+			if ( !Image.ExportForwarders[Hit.Index].empty() )
+				Record.ForwarderId = InternString( Buffer, Image.ExportForwarders[Hit.Index] );
+		}
+	}
+
+	uint32_t QueryId = pszQuery ? InternString( Buffer, pszQuery ) : 0;
+
+	// Paths are unique, so they are not interned
+	ResultFileRecord File = {};
+	File.Header.Size = ResultRecordSize( sizeof( File ) + HitRecords.size() * sizeof( ResultHitRecord ) );
+	File.Header.Type = ResultRecordFile;
+	File.PathId = AppendStringRecord( Buffer, Path );
+	File.NumHits = (uint32_t)HitRecords.size();
+	File.Size = (uint64_t)SizeInBytes;
+
+	if ( Imphash )
+	{
+		memcpy( File.Imphash, Imphash, sizeof( File.Imphash ) );
+		File.Flags |= ResultFileHasImphash;
+	}
+
+	if ( pszQuery )
+	{
+		File.QueryId = QueryId;
+		File.Flags |= ResultFileHasQuery;
+	}
+
+	size_t Start = Buffer.Data.size();
+	Buffer.Data.append( (const char *)&File, sizeof( File ) );
+	Buffer.Data.append( (const char *)HitRecords.data(), HitRecords.size() * sizeof( ResultHitRecord ) );
+	Buffer.Data.resize( Start + File.Header.Size, 0 );
+}
+
+// Append the record(s) of one file with hits
+// Text is the listing impfi always printed, ndjson is one object per file, csv and tsv are one row per hit
+// pszQuery is the query the hits are for with --queries, and NULL otherwise
+static void
+AppendResult(
+	OutputBuffer& Output,
+	OutputFormat Format,
+	int numResult,
+	const std::string& Path,
+	long long SizeInBytes,
+	const PeImage& Image,
+	const std::vector<ImportHit>& Hits,
+	int numImports,
+	const char *const *const ppszImports,
+	const uint8_t *ImphashDigest,
+	const char *pszQuery
+)
+{
+	if ( Format == FormatBinary )
+	{
+		AppendBinaryResult( Output, Path, SizeInBytes, Image, Hits, ppszImports, ImphashDigest, pszQuery );
+		return;
+	}
+
+	std::string& Buffer = Output.Data;
+	char ImphashHex[33];
+	const char *Imphash = NULL;
+
+	if ( ImphashDigest )
+	{
+		Md5Hex( ImphashDigest, ImphashHex );
+		Imphash = ImphashHex;
+	}
+
+	int importCount = 0;
+	int exportCount = 0;
+
+	for ( const ImportHit& Hit : Hits )
+		( Hit.Kind == HitExport ? exportCount : importCount )++;
+
+	if ( Format == FormatText )
+	{
+		AppendNumber( Buffer, numResult );
+		Buffer.append( " - " ).append( Path ).append( " (" );
+		AppendKilobytes( Buffer, SizeInBytes );
+		Buffer.append( " kb), " );
+		AppendNumber( Buffer, importCount );
+		Buffer.append( " import(s) found" );
+
+		if ( exportCount )
+		{
+			Buffer.append( ", " );
+			AppendNumber( Buffer, exportCount );
+			Buffer.append( " export(s) found" );
+		}
+
+		if ( Imphash )
+			Buffer.append( ", imphash " ).append( Imphash );
+
+		if ( pszQuery )
+			Buffer.append( ", query " ).append( pszQuery );
+
+		Buffer += '\n';
+
+		for ( const ImportHit& Hit : Hits )
+		{
+			if ( Hit.Kind == HitImport && numImports > 1 )
+				Buffer.append( "\t" ).append( ppszImports[Hit.Import] ).append( "\n" );
+			else if ( Hit.Kind == HitDelayLoad )
+				Buffer.append( "\t" ).append( ppszImports[Hit.Import] ).append( " (delay load)\n" );
+			else if ( Hit.Kind == HitExport && Image.ExportForwarders[Hit.Index].empty() )
+				Buffer.append( "\t" ).append( Image.ExportNames[Hit.Index] ).append( " (export)\n" );
+			else if ( Hit.Kind == HitExport )
+				Buffer.append( "\t" ).append( Image.ExportNames[Hit.Index] ).append( " (export forwarded to " ).append( Image.ExportForwarders[Hit.Index] ).append( ")\n" );
+		}
+
+		return;
+	}
+
+	if ( Format == FormatNdjson )
+	{
+		Buffer.append( "{\"path\":" );
+		AppendField( Buffer, Path, Format );
+
+		if ( pszQuery )
+		{
+			Buffer.append( ",\"query\":" );
+			AppendField( Buffer, pszQuery, Format );
+		}
+		Buffer.append( ",\"size\":" );
+		AppendNumber( Buffer, SizeInBytes );
+
+		if ( Imphash )
+			Buffer.append( ",\"imphash\":\"" ).append( Imphash ).append( "\"" );
+
+		Buffer.append( ",\"hits\":[" );
+
+		for ( size_t i = 0; i < Hits.size(); i++ )
+		{
+			const ImportHit& Hit = Hits[i];
+
+			Buffer.append( i ? ",{\"kind\":\"" : "{\"kind\":\"" ).append( HitKindNames[Hit.Kind] ).append( "\",\"name\":" );
+			AppendField( Buffer, ppszImports[Hit.Import], Format );
+
+			if ( Hit.Kind != HitExport )
+			{
+				Buffer.append( ",\"dll\":" );
+				AppendField( Buffer, Hit.Kind == HitImport ? Image.ImportDllNames[Hit.Dll] : Image.DelayImportDllNames[Hit.Dll], Format );
+			}
+			else
+			{
+				Buffer.append( ",\"export\":" );
+				AppendField( Buffer, Image.ExportNames[Hit.Index], Format );
+
+				if ( !Image.ExportForwarders[Hit.Index].empty() )
+				{
+					Buffer.append( ",\"forwarder\":" );
+					AppendField( Buffer, Image.ExportForwarders[Hit.Index], Format );
+				}
+			}
+
+			Buffer += '}';
+		}
+
+		Buffer.append( "]}\n" );
+		return;
+	}
+
+	const char Separator = Format == FormatCsv ? ',' : '\t';
+	static const PeName Empty;
+
+	// Files listed for their imphash alone still get a row
+	for ( size_t i = 0; i < Hits.size() || ( i == 0 && Hits.empty() ); i++ )
+	{
+		const ImportHit *Hit = Hits.empty() ? NULL : &Hits[i];
+
+		AppendField( Buffer, Path, Format );
+		Buffer += Separator;
+		AppendNumber( Buffer, SizeInBytes );
+		Buffer += Separator;
+		AppendField( Buffer, Hit ? HitKindNames[Hit->Kind] : "", Format );
+		Buffer += Separator;
+		AppendField( Buffer, !Hit || Hit->Kind == HitExport ? Empty : Hit->Kind == HitImport ? Image.ImportDllNames[Hit->Dll] : Image.DelayImportDllNames[Hit->Dll], Format );
+		Buffer += Separator;
+		AppendField( Buffer, Hit ? ppszImports[Hit->Import] : "", Format );
+		Buffer += Separator;
+		AppendField( Buffer, Hit && Hit->Kind == HitExport ? Image.ExportNames[Hit->Index] : Empty, Format );
+		Buffer += Separator;
+		AppendField( Buffer, Hit && Hit->Kind == HitExport ? Image.ExportForwarders[Hit->Index] : Empty, Format );
+		Buffer += Separator;
+		AppendField( Buffer, Imphash ? Imphash : "", Format );
+
+		if ( pszQuery )
+		{
+			Buffer += Separator;
+			AppendField( Buffer, pszQuery, Format );
+		}
+
+		Buffer += '\n';
+	}
+}
+
+// Import frequencies for --frequency, how many files import each dll!function pair, delay loads included
+// Each worker counts into its own shard keyed by ImportId, the shards are merged once the scan is done
+// With --sketch the counts go into a count-min sketch of a fixed size instead, and only the likely top pairs keep their names
+const int SketchDepth = 4;
+
+// The pairs of one file, once each
+struct FileImport
+{
+	ULONGLONG Id;
+	const PeName *Dll;
+	const PeName *Function;
+};
+
+struct FrequencyShard
+{
+	std::unordered_map<ULONGLONG, size_t> Entries;	// ImportId to the index of its name
+	std::vector<ULONGLONG> Ids;
+	std::vector<size_t> Names;						// Offsets of "dll<tab>function" in Pool, the dll in lower case
+	std::string Pool;								// The names, each NUL terminated, so a pair costs no allocation of its own
+	std::vector<ULONGLONG> Counts;					// Without a sketch
+	std::vector<ULONGLONG> Sketch;					// SketchDepth rows of Width counters
+	std::vector<FileImport> File;
+};
+
+static size_t
+SketchSlot(
+	ULONGLONG Id,
+	int Row,
+	size_t Width
+)
+{
+	return Row * Width + MixHash( Id + Row * 0x9e3779b97f4a7c15ull ) % Width;
+}
+
+// The smallest counter of the pair, never below its true count
+static ULONGLONG
+SketchEstimate(
+	const std::vector<ULONGLONG>& Sketch,
+	size_t Width,
+	ULONGLONG Id
+)
+{
+	ULONGLONG Estimate = ULLONG_MAX;
+
+	for ( int Row = 0; Row < SketchDepth; Row++ )
+		Estimate = std::min( Estimate, Sketch[SketchSlot( Id, Row, Width )] );
+
+	return Estimate;
+}
+
+static void
+AddFrequencyName(
+	FrequencyShard& Shard,
+	const FileImport& Import
+)
+{
+	Shard.Entries.emplace( Import.Id, Shard.Names.size() );
+	Shard.Ids.push_back( Import.Id );
+	Shard.Names.push_back( Shard.Pool.size() );
+
+	for ( unsigned char c : *Import.Dll )
+		Shard.Pool += (char)tolower( c );
+
+	Shard.Pool.append( "\t" ).append( *Import.Function ).append( 1, '\0' );
+}
+
+// Keep the half of the sketch's candidates with the largest estimates, a pair dropped here comes back the next time it is seen
+static void
+PruneFrequencyCandidates(
+	FrequencyShard& Shard,
+	size_t Width,
+	size_t Keep
+)
+{
+	std::vector<std::pair<ULONGLONG, size_t>> Ranked( Shard.Ids.size() );
+
+	for ( size_t i = 0; i < Shard.Ids.size(); i++ )
+		Ranked[i] = { SketchEstimate( Shard.Sketch, Width, Shard.Ids[i] ), i };
+
+	std::nth_element( Ranked.begin(), Ranked.begin() + Keep, Ranked.end(), std::greater<std::pair<ULONGLONG, size_t>>() );
+	Ranked.resize( Keep );
+
+	std::vector<ULONGLONG> Ids;
+	std::vector<size_t> Names;
+	std::string Pool;
+
+	Shard.Entries.clear();
+
+	for ( const auto& Candidate : Ranked )
+	{
+		Shard.Entries.emplace( Shard.Ids[Candidate.second], Names.size() );
+		Ids.push_back( Shard.Ids[Candidate.second] );
+		Names.push_back( Pool.size() );
+		Pool.append( &Shard.Pool[Shard.Names[Candidate.second]] ).append( 1, '\0' );
+	}
+
+	Shard.Ids.swap( Ids );
+	Shard.Names.swap( Names );
+	Shard.Pool.swap( Pool );
+}
+
+// Count each pair of an image once, Weight times, for the paths of the file
+// Width is 0 for exact counts, or the width of the sketch, which then keeps at most MaxCandidates names
+static void
+CountImportFrequencies(
+	FrequencyShard& Shard,
+	const PeImage& Image,
+	ULONGLONG Weight,
+	size_t Width,
+	size_t MaxCandidates
+)
+{
+	Shard.File.clear();
+
+	auto Add = [&]( const PeNames& DllNames, const PeNamesByDll& ThunkNames )
+	{
+		for ( size_t i = 0; i < DllNames.size(); i++ )
+			for ( const PeName& Thunk : ThunkNames[i] )
+				Shard.File.push_back( { ImportId( DllNames[i], Thunk ), &DllNames[i], &Thunk } );
+	};
+
+	Add( Image.ImportDllNames, Image.ImportThunkNames );
+	Add( Image.DelayImportDllNames, Image.DelayImportThunkNames );
+
+	std::sort( Shard.File.begin(), Shard.File.end(), []( const FileImport& a, const FileImport& b ) { return a.Id < b.Id; } );
+	Shard.File.erase( std::unique( Shard.File.begin(), Shard.File.end(), []( const FileImport& a, const FileImport& b ) { return a.Id == b.Id; } ), Shard.File.end() );
+
+	for ( const FileImport& Import : Shard.File )
+	{
+		if ( !Width )
+		{
+			auto Found = Shard.Entries.find( Import.Id );
+
+			if ( Found == Shard.Entries.end() )
+			{
+				AddFrequencyName( Shard, Import );
+				Shard.Counts.push_back( Weight );
+			}
+			else
+				Shard.Counts[Found->second] += Weight;
+
+			continue;
+		}
+
+		if ( Shard.Sketch.empty() )
+			Shard.Sketch.assign( SketchDepth * Width, 0 );
+
+		for ( int Row = 0; Row < SketchDepth; Row++ )
+			Shard.Sketch[SketchSlot( Import.Id, Row, Width )] += Weight;
+
+		if ( Shard.Entries.find( Import.Id ) == Shard.Entries.end() )
+			AddFrequencyName( Shard, Import );
+	}
+
+	if ( Width && Shard.Names.size() > MaxCandidates )
+		PruneFrequencyCandidates( Shard, Width, MaxCandidates / 2 );
+}
+
+// Merge the shards and print the TopK pairs (all of them when TopK is 0) by the number of files importing them, "count<tab>dll<tab>function"
+// With a sketch the shards' sketches are summed, and the candidates of every shard are ranked by their estimate in the sum
+static void
+PrintImportFrequencies(
+	const std::vector<FrequencyShard>& Shards,
+	size_t Width,
+	size_t TopK,
+	ULONGLONG numFiles
+)
+{
+	std::unordered_map<ULONGLONG, size_t> Entries;
+	std::vector<std::pair<ULONGLONG, const char *>> Ranked;
+	std::vector<ULONGLONG> Sketch( Width ? SketchDepth * Width : 0, 0 );
+
+	for ( const FrequencyShard& Shard : Shards )
+	{
+		for ( size_t i = 0; i < Shard.Sketch.size(); i++ )
+			Sketch[i] += Shard.Sketch[i];
+	}
+
+	for ( const FrequencyShard& Shard : Shards )
+	{
+		for ( size_t i = 0; i < Shard.Ids.size(); i++ )
+		{
+			auto Inserted = Entries.emplace( Shard.Ids[i], Ranked.size() );
+
+			if ( Inserted.second )
+				Ranked.push_back( { Width ? SketchEstimate( Sketch, Width, Shard.Ids[i] ) : 0, &Shard.Pool[Shard.Names[i]] } );
+
+			if ( !Width )
+				Ranked[Inserted.first->second].first += Shard.Counts[i];
+		}
+	}
+
+	// Most imported first, ties by name so the order does not depend on the number of threads
+	auto Before = []( const std::pair<ULONGLONG, const char *>& a, const std::pair<ULONGLONG, const char *>& b )
+	{
+		return a.first != b.first ? a.first > b.first : strcmp( a.second, b.second ) < 0;
+	};
+
+	size_t numListed = TopK ? std::min( TopK, Ranked.size() ) : Ranked.size();
+
+	if ( numListed < Ranked.size() )
+		std::partial_sort( Ranked.begin(), Ranked.begin() + numListed, Ranked.end(), Before );
+	else
+		std::sort( Ranked.begin(), Ranked.end(), Before );
+
+	if ( Width )
+		fprintf( stderr, "Import frequency - %llu file(s), %zu candidate(s), counts estimated by a %i x %zu count-min sketch\n", numFiles, Ranked.size(), SketchDepth, Width );
+	else
+		fprintf( stderr, "Import frequency - %llu file(s), %zu distinct import(s)\n", numFiles, Ranked.size() );
+
+	std::string Buffer;
+
+	for ( size_t i = 0; i < numListed; i++ )
+	{
+		AppendNumber( Buffer, (long long)Ranked[i].first );
+		Buffer.append( "\t" ).append( Ranked[i].second ).append( "\n" );
+
+		if ( Buffer.size() >= OutputBufferSize )
+		{
+			fwrite( Buffer.data(), 1, Buffer.size(), stdout );
+			Buffer.clear();
+		}
+	}
+
+	fwrite( Buffer.data(), 1, Buffer.size(), stdout );
+}
+
+// Named queries of a --queries file, all matched in the one scan
+// Every import of every query is hashed once, so a file costs a lookup per name however many queries there are
+struct ImportQuery
+{
+	std::string Name;
+	std::vector<std::vector<int>> Terms;	// The query matches when every import of any one term is found
+	int numImports;							// Distinct imports of the query
+};
+
+struct QuerySet
+{
+	std::vector<ImportQuery> Queries;
+	std::vector<std::string> Names;					// Every import of any query, once
+	std::vector<const char *> Imports;				// The names as the matchers and results take them
+	std::vector<std::vector<int>> QueriesOfImport;	// The queries that name each import
+	ImportNameSet Set;
+};
+
+// Kept per worker, the hits of the last file split by query
+struct QueryMatch
+{
+	std::vector<char> Found;					// By import
+	std::vector<std::vector<ImportHit>> Hits;	// By query
+	std::vector<int> Matched;					// The queries that matched, in the order of the file
+};
+
+// Read a --queries file, a query per line, "<name> <term> [term ...]", where a term is an import, or imports joined by & that must all be found
+// Empty lines and lines starting with # are skipped
+static bool
+ReadQueryFile(
+	const char *pszPath,
+	QuerySet& Queries
+)
+{
+	std::ifstream File( pszPath );
+
+	if ( !File )
+	{
+		fprintf( stderr, "%s - Could not open the query file\n", pszPath );
+		return false;
+	}
+
+	std::unordered_map<std::string, int> ImportIds;
+	std::vector<int> Distinct;
+	std::string Line;
+	std::string Token;
+
+	for ( size_t numLine = 1; std::getline( File, Line ); numLine++ )
+	{
+		std::istringstream Tokens( Line );
+
+		if ( !( Tokens >> Token ) || Token[0] == '#' )
+			continue;
+
+		ImportQuery Query;
+		Query.Name = Token.size() > 1 && Token.back() == ':' ? Token.substr( 0, Token.size() - 1 ) : Token;
+		Distinct.clear();
+
+		while ( Tokens >> Token )
+		{
+			std::vector<int> Term;
+
+			for ( size_t Start = 0, End; Start < Token.size(); Start = End + 1 )
+			{
+				End = std::min( Token.find( '&', Start ), Token.size() );
+
+				if ( End == Start )
+					continue;
+
+				auto Inserted = ImportIds.emplace( Token.substr( Start, End - Start ), (int)Queries.Names.size() );
+
+				if ( Inserted.second )
+					Queries.Names.push_back( Inserted.first->first );
+
+				Term.push_back( Inserted.first->second );
+				Distinct.push_back( Inserted.first->second );
+			}
+
+			if ( !Term.empty() )
+				Query.Terms.push_back( std::move( Term ) );
+		}
+
+		if ( Query.Terms.empty() )
+		{
+			fprintf( stderr, "%s - Line %zu, query %s has no imports\n", pszPath, numLine, Query.Name.c_str() );
+			return false;
+		}
+
+		std::sort( Distinct.begin(), Distinct.end() );
+		Distinct.erase( std::unique( Distinct.begin(), Distinct.end() ), Distinct.end() );
+		Query.numImports = (int)Distinct.size();
+
+		Queries.QueriesOfImport.resize( Queries.Names.size() );
+
+		for ( int Import : Distinct )
+			Queries.QueriesOfImport[Import].push_back( (int)Queries.Queries.size() );
+
+		Queries.Queries.push_back( std::move( Query ) );
+	}
+
+	if ( Queries.Queries.empty() )
+	{
+		fprintf( stderr, "%s - No queries\n", pszPath );
+		return false;
+	}
+
+	// The names no longer move, so they can be pointed at
+	for ( const std::string& Name : Queries.Names )
+		Queries.Imports.push_back( Name.c_str() );
+
+	BuildImportNameSet( (int)Queries.Imports.size(), Queries.Imports.data(), Queries.Set );
+
+	return true;
+}
+
+// Split the hits of a file by query, and keep the queries that match
+// Only the queries naming an import that was found are looked at
+static void
+MatchQueries(
+	const QuerySet& Queries,
+	const std::vector<ImportHit>& FileHits,
+	QueryMatch& Match
+)
+{
+	Match.Found.resize( Queries.Names.size(), 0 );
+	Match.Hits.resize( Queries.Queries.size() );
+
+	for ( int Query : Match.Matched )
+		Match.Hits[Query].clear();
+
+	Match.Matched.clear();
+
+	for ( const ImportHit& Hit : FileHits )
+	{
+		Match.Found[Hit.Import] = 1;
+
+		for ( int Query : Queries.QueriesOfImport[Hit.Import] )
+		{
+			if ( Match.Hits[Query].empty() )
+				Match.Matched.push_back( Query );
+
+			Match.Hits[Query].push_back( Hit );
+		}
+	}
+
+	size_t numMatched = 0;
+
+	for ( int Query : Match.Matched )
+	{
+		bool bMatch = std::any_of( Queries.Queries[Query].Terms.begin(), Queries.Queries[Query].Terms.end(), [&]( const std::vector<int>& Term )
+		{
+			return std::all_of( Term.begin(), Term.end(), [&]( int Import ) { return Match.Found[Import] != 0; } );
+		} );
+
+		if ( bMatch )
+			Match.Matched[numMatched++] = Query;
+		else
+			Match.Hits[Query].clear();
+	}
+
+	Match.Matched.resize( numMatched );
+
+	for ( const ImportHit& Hit : FileHits )
+		Match.Found[Hit.Import] = 0;
+}
+
+// Call Scan( Worker, Index ) for each index handed out by Claim( Worker, Index ), until it returns false, spread over numThreads workers
+// With --stats each worker counts into Stats[Worker], and the latency of each call is recorded
+// With --trace each worker records spans into Traces[Worker]
+template <typename ClaimFn, typename ScanFn>
+static void
+ParallelClaim(
+	unsigned numThreads,
+	ScanStats *Stats,
+	TraceRing *Traces,
+	ClaimFn Claim,
+	ScanFn Scan
+)
+{
+	std::vector<std::thread> Workers;
+
+	auto Work = [&]( unsigned Worker )
+	{
+		t_pStats = Stats ? &Stats[Worker] : NULL;
+		t_pTrace = Traces ? &Traces[Worker] : NULL;
+
+		for ( size_t Index; Claim( Worker, Index ); )
+		{
+			if ( !t_pStats && !t_pTrace )
+			{
+				Scan( Worker, Index );
+				continue;
+			}
+
+			t_TraceFile = Index;
+
+			ULONGLONG Start = StatClock();
+			Scan( Worker, Index );
+			ULONGLONG Duration = StatClock() - Start;
+
+			if ( t_pTrace )
+				TraceRecord( NumScanStages, Start, Duration );
+
+			if ( t_pStats )
+			{
+				ULONGLONG Microseconds = Duration / 1000;
+
+				int Bucket = 0;
+				while ( Microseconds >>= 1 )
+					Bucket++;
+
+				t_pStats->FilesSeen++;
+				t_pStats->Latency[Bucket]++;
+			}
+		}
+
+		t_pStats = NULL;
+		t_pTrace = NULL;
+		t_TraceFile = TraceNoFile;
+	};
+
+	for ( unsigned i = 1; i < numThreads; i++ )
+		Workers.emplace_back( Work, i );
+
+	Work( 0 );
+
+	for ( auto& Worker : Workers )
+		Worker.join();
+}
+
+// Call Scan( Worker, Index ) for each index in [0, Count)
+template <typename ScanFn>
+static void
+ParallelFor(
+	size_t Count,
+	unsigned numThreads,
+	ScanStats *Stats,
+	TraceRing *Traces,
+	ScanFn Scan
+)
+{
+	std::atomic<size_t> Next( 0 );
+
+	ParallelClaim( numThreads, Stats, Traces, [&]( unsigned, size_t& Index )
+	{
+		return ( Index = Next.fetch_add( 1, std::memory_order_relaxed ) ) < Count;
+	}, Scan );
+}
+
+// A listed path, with its index in the list and its size, -1 when it was not stat'ed
+struct QueuedPath
+{
+	size_t Index;
+	std::string Path;
+	long long Size;
+};
+
+// Paths handed from the --files-from reader to the workers as they arrive
+struct PathQueue
+{
+	std::mutex Lock;
+	std::condition_variable Ready;
+	std::deque<QueuedPath> Pending;
+	bool bDone = false;
+};
+
+// Wait for the next path of the queue, false once the list has ended and every path was taken
+static bool
+ClaimQueuedPath(
+	PathQueue& Queue,
+	size_t& Index,
+	std::string& Path,
+	long long& Size
+)
+{
+	std::unique_lock<std::mutex> Guard( Queue.Lock );
+	Queue.Ready.wait( Guard, [&]() { return !Queue.Pending.empty() || Queue.bDone; } );
+
+	if ( Queue.Pending.empty() )
+		return false;
+
+	Index = Queue.Pending.front().Index;
+	Path = std::move( Queue.Pending.front().Path );
+	Size = Queue.Pending.front().Size;
+	Queue.Pending.pop_front();
+	return true;
+}
+
+// Modules are keyed by their lower case file name without the extension, which is how forwarders name them
+static std::string
+ModuleKey(
+	std::string_view Name
+)
+{
+	std::string Key( Name.substr( 0, Name.rfind( '.' ) ) );
+	std::transform( Key.begin(), Key.end(), Key.begin(), []( unsigned char c ) { return (char)tolower( c ); } );
+	return Key;
+}
+
+// The part of the import graph built by one worker, with names interned locally so workers never share a lock
+struct ImportGraphShard
+{
+	std::unordered_map<std::string, DWORD> NameIds;
+	std::vector<std::string> Names;
+	std::vector<std::pair<size_t, DWORD>> Binaries;		// Path index, module
+	std::vector<std::array<DWORD, 3>> Imports;			// Module, dll, function
+	std::vector<std::array<DWORD, 3>> Forwarders;		// Module, function, forwarded function
+};
+
+static DWORD
+InternName(
+	ImportGraphShard& Shard,
+	std::string_view Name
+)
+{
+	auto Result = Shard.NameIds.emplace( Name, (DWORD)Shard.Names.size() );
+
+	if ( Result.second )
+		Shard.Names.emplace_back( Name );
+
+	return Result.first->second;
+}
+
+static void
+AddToImportGraph(
+	ImportGraphShard& Shard,
+	size_t PathIndex,
+	const std::string& Path,
+	const PeImage& Image
+)
+{
+	DWORD Module = InternName( Shard, ModuleKey( std::filesystem::path( Path ).filename().string() ) );
+
+	Shard.Binaries.push_back( { PathIndex, Module } );
+
+	for ( size_t i = 0; i < Image.ImportDllNames.size(); i++ )
+	{
+		DWORD Dll = InternName( Shard, ModuleKey( Image.ImportDllNames[i] ) );
+
+		for ( const PeName& Thunk : Image.ImportThunkNames[i] )
+			Shard.Imports.push_back( { Module, Dll, InternName( Shard, Thunk ) } );
+	}
+
+	for ( size_t i = 0; i < Image.DelayImportDllNames.size(); i++ )
+	{
+		DWORD Dll = InternName( Shard, ModuleKey( Image.DelayImportDllNames[i] ) );
+
+		for ( const PeName& Thunk : Image.DelayImportThunkNames[i] )
+			Shard.Imports.push_back( { Module, Dll, InternName( Shard, Thunk ) } );
+	}
+
+	for ( size_t i = 0; i < Image.ExportNames.size(); i++ )
+	{
+		size_t Dot = Image.ExportForwarders[i].find( '.' );
+
+		if ( Dot == std::string::npos )
+			continue;
+
+		Shard.Forwarders.push_back( { Module, InternName( Shard, Image.ExportNames[i] ), InternName( Shard, std::string_view( Image.ExportForwarders[i] ).substr( Dot + 1 ) ) } );
+	}
+}
+
+// Merged import graph with compressed adjacency lists, all indexed by name id
+struct ImportGraph
+{
+	ImportGraphShard Merged;
+
+	// Importers[ImporterStart[m] .. ImporterStart[m + 1]) are the modules importing anything from module m
+	std::vector<size_t> ImporterStart;
+	std::vector<DWORD> Importers;
+
+	// FunctionImports[FunctionImportStart[f] .. FunctionImportStart[f + 1]) are the (module, dll) pairs importing function f
+	std::vector<size_t> FunctionImportStart;
+	std::vector<std::pair<DWORD, DWORD>> FunctionImports;
+
+	// ForwardedBy[ForwardedByStart[f] .. ForwardedByStart[f + 1]) are the (module, export) pairs forwarded to function f
+	std::vector<size_t> ForwardedByStart;
+	std::vector<std::pair<DWORD, DWORD>> ForwardedBy;
+};
+
+// Bucket Edges by Key( Edge ) into a compressed list
+template <typename Edge, typename Value, typename KeyFn, typename ValueFn>
+static void
+BuildAdjacency(
+	size_t NumKeys,
+	const std::vector<Edge>& Edges,
+	KeyFn Key,
+	ValueFn ValueOf,
+	std::vector<size_t>& Start,
+	std::vector<Value>& Values
+)
+{
+	Start.assign( NumKeys + 1, 0 );
+
+	for ( const Edge& e : Edges )
+		Start[Key( e ) + 1]++;
+
+	for ( size_t i = 0; i < NumKeys; i++ )
+		Start[i + 1] += Start[i];
+
+	std::vector<size_t> Fill( Start.begin(), Start.end() - 1 );
+	Values.resize( Edges.size() );
+
+	for ( const Edge& e : Edges )
+		Values[Fill[Key( e )]++] = ValueOf( e );
+}
+
+static void
+BuildImportGraph(
+	std::vector<ImportGraphShard>& Shards,
+	ImportGraph& Graph
+)
+{
+	ImportGraphShard& Merged = Graph.Merged;
+	std::vector<DWORD> Remap;
+
+	// Remap every worker's local name ids onto one table
+	for ( ImportGraphShard& Shard : Shards )
+	{
+		Remap.resize( Shard.Names.size() );
+
+		for ( size_t i = 0; i < Shard.Names.size(); i++ )
+			Remap[i] = InternName( Merged, Shard.Names[i] );
+
+		for ( auto& Binary : Shard.Binaries )
+			Merged.Binaries.push_back( { Binary.first, Remap[Binary.second] } );
+
+		for ( auto& Import : Shard.Imports )
+			Merged.Imports.push_back( { Remap[Import[0]], Remap[Import[1]], Remap[Import[2]] } );
+
+		for ( auto& Forwarder : Shard.Forwarders )
+			Merged.Forwarders.push_back( { Remap[Forwarder[0]], Remap[Forwarder[1]], Remap[Forwarder[2]] } );
+
+		Shard = {};
+	}
+
+	// Module level edges only need to be listed once
+	std::vector<std::pair<DWORD, DWORD>> Dependencies;
+	Dependencies.reserve( Merged.Imports.size() );
+
+	for ( auto& Import : Merged.Imports )
+		Dependencies.push_back( { Import[1], Import[0] } );
+
+	std::sort( Dependencies.begin(), Dependencies.end() );
+	Dependencies.erase( std::unique( Dependencies.begin(), Dependencies.end() ), Dependencies.end() );
+
+	size_t NumNames = Merged.Names.size();
+
+	BuildAdjacency( NumNames, Dependencies, []( const std::pair<DWORD, DWORD>& e ) { return e.first; },
+		[]( const std::pair<DWORD, DWORD>& e ) { return e.second; }, Graph.ImporterStart, Graph.Importers );
+	BuildAdjacency( NumNames, Merged.Imports, []( const std::array<DWORD, 3>& e ) { return e[2]; },
+		[]( const std::array<DWORD, 3>& e ) { return std::make_pair( e[0], e[1] ); }, Graph.FunctionImportStart, Graph.FunctionImports );
+	BuildAdjacency( NumNames, Merged.Forwarders, []( const std::array<DWORD, 3>& e ) { return e[2]; },
+		[]( const std::array<DWORD, 3>& e ) { return std::make_pair( e[0], e[1] ); }, Graph.ForwardedByStart, Graph.ForwardedBy );
+}
+
+// Find every scanned binary that reaches Function, directly, through a forwarded export, or through the dlls it imports
+static int
+QueryImportGraph(
+	const ImportGraph& Graph,
+	const std::vector<std::string>& Paths,
+	const char *const Function
+)
+{
+	const ImportGraphShard& Merged = Graph.Merged;
+	const DWORD None = (DWORD)-1;
+
+	auto Found = Merged.NameIds.find( Function );
+
+	if ( Found == Merged.NameIds.end() )
+		return 0;
+
+	// Parent[m] is the module m reaches the function through, Parent[m] == m for direct importers
+	std::vector<DWORD> Parent( Merged.Names.size(), None );
+	std::vector<std::pair<DWORD, DWORD>> Via( Merged.Names.size() );
+	std::vector<DWORD> Queue;
+
+	// Functions that resolve to the target, (dll, function), dll is None for the target itself
+	std::vector<std::pair<DWORD, DWORD>> Resolved = { { None, Found->second } };
+
+	for ( size_t r = 0; r < Resolved.size() && r < 0x10000; r++ )
+	{
+		DWORD Dll = Resolved[r].first;
+		DWORD Target = Resolved[r].second;
+
+		for ( size_t i = Graph.FunctionImportStart[Target]; i < Graph.FunctionImportStart[Target + 1]; i++ )
+		{
+			DWORD Module = Graph.FunctionImports[i].first;
+
+			if ( Dll != None && Graph.FunctionImports[i].second != Dll )
+				continue;
+
+			if ( Parent[Module] == None )
+			{
+				Parent[Module] = Module;
+				Via[Module] = { Graph.FunctionImports[i].second, Target };
+				Queue.push_back( Module );
+			}
+		}
+
+		// Exports forwarded to the target resolve to it as well, so do exports forwarded to those
+		for ( size_t i = Graph.ForwardedByStart[Target]; i < Graph.ForwardedByStart[Target + 1]; i++ )
+		{
+			if ( std::find( Resolved.begin(), Resolved.end(), Graph.ForwardedBy[i] ) == Resolved.end() )
+				Resolved.push_back( Graph.ForwardedBy[i] );
+		}
+	}
+
+	// Walk importers breadth first, so every binary gets its shortest chain
+	for ( size_t q = 0; q < Queue.size(); q++ )
+	{
+		DWORD Module = Queue[q];
+
+		for ( size_t i = Graph.ImporterStart[Module]; i < Graph.ImporterStart[Module + 1]; i++ )
+		{
+			DWORD Importer = Graph.Importers[i];
+
+			if ( Parent[Importer] == None )
+			{
+				Parent[Importer] = Module;
+				Queue.push_back( Importer );
+			}
+		}
+	}
+
+	int numResults = 0;
+
+	for ( auto& Binary : Merged.Binaries )
+	{
+		DWORD Module = Binary.second;
+
+		if ( Parent[Module] == None )
+			continue;
+
+		std::cout << '\t' << Paths[Binary.first] << " - " << Merged.Names[Module];
+
+		for ( ; Parent[Module] != Module; Module = Parent[Module] )
+			std::cout << " -> " << Merged.Names[Parent[Module]];
+
+		std::cout << " -> " << Merged.Names[Via[Module].first] << '!' << Merged.Names[Via[Module].second];
+
+		if ( Via[Module].second != Found->second )
+			std::cout << " (forwarded to " << Function << ')';
+
+		std::cout << '\n';
+		numResults++;
+	}
+
+	return numResults;
+}
+
+// In memory index of a scanned tree for --serve, from each import (and export) name to the files that have it
+struct IndexEntry
+{
+	DWORD File;
+	DWORD Dll;		// The dll imported from, or the forwarder of a forwarded export, IndexNoDll otherwise
+	HitKind Kind;
+};
+
+const DWORD IndexNoDll = (DWORD)-1;
+
+// Built by one worker, with dll names interned locally, then merged
+struct ImportIndexShard
+{
+	std::unordered_map<std::string, std::vector<IndexEntry>> Names;
+	std::unordered_map<std::string, DWORD> DllIds;
+	std::vector<std::string> Dlls;
+};
+
+// Files changed under --watch are parsed again under a new file id, the old id is marked removed
+// Once the removed ids are more than a quarter of the live ones (IndexCompactRatio), the index is compacted
+struct ImportIndex
+{
+	std::unordered_map<std::string, std::vector<IndexEntry>> Names;
+	std::vector<std::string> Dlls;
+	std::unordered_map<std::string, DWORD> DllIds;
+	std::vector<std::string> Paths;						// By file id
+	std::vector<char> bRemoved;							// By file id
+	size_t numRemoved = 0;
+	std::unordered_map<std::string, DWORD> PathIds;		// Current id of each path, only kept for --watch
+
+	// Queries share the index, updates from --watch are exclusive
+	std::shared_mutex Lock;
+};
+
+static DWORD
+InternDll(
+	ImportIndexShard& Shard,
+	std::string_view Dll
+)
+{
+	auto Result = Shard.DllIds.emplace( Dll, (DWORD)Shard.Dlls.size() );
+
+	if ( Result.second )
+		Shard.Dlls.emplace_back( Dll );
+
+	return Result.first->second;
+}
+
+// Index the names of one file, exports are found by the same names MatchExportNames matches them on
+static void
+AddToImportIndex(
+	ImportIndexShard& Shard,
+	DWORD File,
+	const PeImage& Image
+)
+{
+	// Names are looked up through one key, so a name already in the shard costs no allocation
+	std::string Key;
+
+	auto Add = [&]( std::string_view Name, const IndexEntry& Entry )
+	{
+		Key.assign( Name );
+		Shard.Names[Key].push_back( Entry );
+	};
+
+	for ( size_t i = 0; i < Image.ImportDllNames.size(); i++ )
+	{
+		DWORD Dll = InternDll( Shard, Image.ImportDllNames[i] );
+
+		for ( const PeName& Thunk : Image.ImportThunkNames[i] )
+			Add( Thunk, { File, Dll, HitImport } );
+	}
+
+	for ( size_t i = 0; i < Image.DelayImportDllNames.size(); i++ )
+	{
+		DWORD Dll = InternDll( Shard, Image.DelayImportDllNames[i] );
+
+		for ( const PeName& Thunk : Image.DelayImportThunkNames[i] )
+			Add( Thunk, { File, Dll, HitDelayLoad } );
+	}
+
+	for ( size_t i = 0; i < Image.ExportNames.size(); i++ )
+	{
+		std::string_view Forwarder = Image.ExportForwarders[i];
+		size_t Dot = Forwarder.find( '.' );
+		IndexEntry Entry = { File, IndexNoDll, HitExport };
+
+		Add( Image.ExportNames[i], Entry );
+
+		if ( Dot == std::string::npos )
+			continue;
+
+		Entry.Dll = InternDll( Shard, Forwarder );
+
+		// Found by its own name, the function it is forwarded to, and the full forwarder
+		std::string_view Function = Forwarder.substr( Dot + 1 );
+
+		if ( Function != Image.ExportNames[i] )
+			Add( Function, Entry );
+
+		Add( Forwarder, Entry );
+	}
+}
+
+// Append the entries of a shard to the index, with its dll ids mapped to the index's
+static void
+MergeImportIndexShard(
+	ImportIndexShard& Shard,
+	ImportIndex& Index
+)
+{
+	std::vector<DWORD> Remap( Shard.Dlls.size() );
+
+	for ( size_t i = 0; i < Shard.Dlls.size(); i++ )
+	{
+		auto Result = Index.DllIds.emplace( Shard.Dlls[i], (DWORD)Index.Dlls.size() );
+
+		if ( Result.second )
+			Index.Dlls.push_back( Shard.Dlls[i] );
+
+		Remap[i] = Result.first->second;
+	}
+
+	for ( auto& Name : Shard.Names )
+	{
+		std::vector<IndexEntry>& Entries = Index.Names[Name.first];
+
+		for ( IndexEntry Entry : Name.second )
+		{
+			if ( Entry.Dll != IndexNoDll )
+				Entry.Dll = Remap[Entry.Dll];
+
+			Entries.push_back( Entry );
+		}
+	}
+
+	Shard = ImportIndexShard();
+}
+
+// Merge the shards, each name's entries are ordered by file so answers do not depend on the number of threads
+// Ids given out later by --watch are larger than every id here, so appending keeps the order
+static void
+BuildImportIndex(
+	std::vector<ImportIndexShard>& Shards,
+	ImportIndex& Index
+)
+{
+	for ( ImportIndexShard& Shard : Shards )
+		MergeImportIndexShard( Shard, Index );
+
+	for ( auto& Name : Index.Names )
+		std::stable_sort( Name.second.begin(), Name.second.end(), []( const IndexEntry& a, const IndexEntry& b ) { return a.File < b.File; } );
+
+	Index.bRemoved.assign( Index.Paths.size(), 0 );
+}
+
+// Answer one query, a line of names separated by spaces, with a line per hit, "path<tab>kind<tab>dll<tab>name", and an empty line
+static void
+AnswerQuery(
+	ImportIndex& Index,
+	const std::string& Query,
+	std::string& Response
+)
+{
+	std::shared_lock<std::shared_mutex> Lock( Index.Lock );
+
+	for ( size_t Start = 0, End; Start < Query.size(); Start = End + 1 )
+	{
+		End = std::min( Query.find_first_of( " \t\r", Start ), Query.size() );
+
+		if ( End == Start )
+			continue;
+
+		auto Found = Index.Names.find( Query.substr( Start, End - Start ) );
+
+		if ( Found == Index.Names.end() )
+			continue;
+
+		for ( const IndexEntry& Entry : Found->second )
+		{
+			if ( Index.bRemoved[Entry.File] )
+				continue;
+
+			Response.append( Index.Paths[Entry.File] ).append( "\t" ).append( HitKindNames[Entry.Kind] ).append( "\t" );
+
+			if ( Entry.Dll != IndexNoDll )
+				Response.append( Index.Dlls[Entry.Dll] );
+
+			Response.append( "\t" ).append( Found->first ).append( "\n" );
+		}
+	}
+
+	Response.append( "\n" );
+}
+
+// A connected client, a named pipe instance
+typedef HANDLE QueryConnection;
+
+static size_t
+QueryRead(
+	QueryConnection Connection,
+	char *Buffer,
+	size_t Size
+)
+{
+	DWORD Read = 0;
+	return ReadFile( Connection, Buffer, (DWORD)Size, &Read, NULL ) ? Read : 0;
+}
+
+static bool
+QueryWrite(
+	QueryConnection Connection,
+	const std::string& Data
+)
+{
+	for ( size_t Offset = 0; Offset < Data.size(); )
+	{
+		DWORD Written = 0;
+		if ( !WriteFile( Connection, Data.data() + Offset, (DWORD)std::min<size_t>( Data.size() - Offset, 1 << 20 ), &Written, NULL ) || !Written )
+			return false;
+		Offset += (size_t)Written;
+	}
+
+	return true;
+}
+
+static void
+QueryClose(
+	QueryConnection Connection
+)
+{
+	FlushFileBuffers( Connection );
+	DisconnectNamedPipe( Connection );
+	CloseHandle( Connection );
+}
+
+// Longest query line a client may send, a client that goes past it without a newline is dropped
+const size_t MaxQueryLength = 1 << 16;
+
+// Answer a client's queries, one per line, until it disconnects
+static void
+ServeClient(
+	QueryConnection Connection,
+	ImportIndex& Index
+)
+{
+	std::string Request;
+	std::string Response;
+	char Buffer[4096];
+
+	for ( size_t Read; ( Read = QueryRead( Connection, Buffer, sizeof( Buffer ) ) ); )
+	{
+		Request.append( Buffer, Read );
+		Response.clear();
+
+		size_t Line;
+
+		while ( ( Line = Request.find( '\n' ) ) != std::string::npos )
+		{
+			AnswerQuery( Index, Request.substr( 0, Line ), Response );
+			Request.erase( 0, Line + 1 );
+		}
+
+		if ( !Response.empty() && !QueryWrite( Connection, Response ) )
+			break;
+
+		if ( Request.size() > MaxQueryLength )
+		{
+			fprintf( stderr, "Query longer than %zu bytes, client dropped\n", MaxQueryLength );
+			break;
+		}
+	}
+
+	QueryClose( Connection );
+}
+
+// An acl granting access to the user the process runs as and to the system, nobody else
+// The user is taken from the token, the owner (OW) of an elevated process is the Administrators group
+static bool
+CurrentUserPipeSddl(
+	std::string& Sddl
+)
+{
+	HANDLE Token;
+	if ( !OpenProcessToken( GetCurrentProcess(), TOKEN_QUERY, &Token ) )
+		return false;
+
+	DWORD Length = 0;
+	GetTokenInformation( Token, TokenUser, NULL, 0, &Length );
+
+	std::vector<BYTE> User( Length );
+	char *pszSid = NULL;
+
+	bool bResult = Length && GetTokenInformation( Token, TokenUser, User.data(), Length, &Length )
+		&& ConvertSidToStringSidA( ( (TOKEN_USER *)User.data() )->User.Sid, &pszSid );
+
+	CloseHandle( Token );
+
+	if ( !bResult )
+		return false;
+
+	Sddl = std::string( "D:P(A;;GA;;;" ) + pszSid + ")(A;;GA;;;SY)";
+	LocalFree( pszSid );
+
+	return true;
+}
+
+// Serve the index until the process is ended, each client gets its own thread
+static int
+ServeImportIndex(
+	const char *const pszName,
+	ImportIndex& Index
+)
+{
+	std::string PipeName = std::string( "\\\\.\\pipe\\" ) + pszName;
+
+	// The default pipe acl lets everyone read, so only the user running the server and the system get access, and remote clients are refused
+	SECURITY_ATTRIBUTES Security = { sizeof( Security ), NULL, FALSE };
+	std::string Sddl;
+
+	if ( !CurrentUserPipeSddl( Sddl ) || !ConvertStringSecurityDescriptorToSecurityDescriptorA( Sddl.c_str(), SDDL_REVISION_1, &Security.lpSecurityDescriptor, NULL ) )
+	{
+		fprintf( stderr, "%s - Could not create pipe security (%lu)\n", PipeName.c_str(), GetLastError() );
+		return 1;
+	}
+
+	fprintf( stderr, "Serving %zu file(s), %zu name(s) on %s\n", Index.Paths.size(), Index.Names.size(), PipeName.c_str() );
+
+	// The first instance fails if another process already holds the name, so it cannot take the clients
+	for ( DWORD FirstInstance = FILE_FLAG_FIRST_PIPE_INSTANCE; ; FirstInstance = 0 )
+	{
+		HANDLE Pipe = CreateNamedPipeA( PipeName.c_str(), PIPE_ACCESS_DUPLEX | FirstInstance, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			PIPE_UNLIMITED_INSTANCES, 1 << 16, 1 << 16, 0, &Security );
+
+		if ( Pipe == INVALID_HANDLE_VALUE )
+		{
+			fprintf( stderr, "%s - Could not create pipe (%lu)\n", PipeName.c_str(), GetLastError() );
+			LocalFree( Security.lpSecurityDescriptor );
+			return 1;
+		}
+
+		// A client can connect between creating the instance and waiting for it
+		if ( !ConnectNamedPipe( Pipe, NULL ) && GetLastError() != ERROR_PIPE_CONNECTED )
+		{
+			CloseHandle( Pipe );
+			continue;
+		}
+
+		std::thread( ServeClient, Pipe, std::ref( Index ) ).detach();
+	}
+}
+
+// Quiet time after the last change before a batch of changes is applied, so a file being written is parsed once
+// A tree that never goes quiet still has its batch applied WatchMaxBatchMs after the first change of the batch
+const unsigned WatchDebounceMs = 500;
+const unsigned WatchMaxBatchMs = 2000;
+
+// The files scanned, those with one of the extensions, and with --sniff the files with no extension that start with MZ
+// The size and time limits are checked against the metadata the directory listing returns, so files outside them are not opened
+struct FileFilter
+{
+	std::vector<std::string> Extensions;
+	bool bSniff = false;
+	bool bMetadata = false;				// Any of the limits is set
+	long long MinSize = 0;
+	long long MaxSize = LLONG_MAX;
+	long long Newer = LLONG_MIN;		// Modified after, in seconds since 1970
+	long long Older = LLONG_MAX;		// Modified before
+};
+
+// Split a comma separated list of extensions, ".sys,.dll,.exe"
+static void
+ParseExtensions(
+	const char *const pszExtensions,
+	std::vector<std::string>& Extensions
+)
+{
+	std::string_view List( pszExtensions );
+
+	for ( size_t Start = 0; Start <= List.size(); )
+	{
+		size_t End = std::min( List.find( ',', Start ), List.size() );
+
+		if ( End > Start )
+			Extensions.emplace_back( List.substr( Start, End - Start ) );
+
+		Start = End + 1;
+	}
+}
+
+// 0 for a path to skip, 1 for a path to scan, 2 for a path to scan if it starts with MZ
+static int
+MatchFileFilter(
+	const FileFilter& Filter,
+	const std::filesystem::path& Path
+)
+{
+	std::string Extension = Path.extension().string();
+
+	if ( Extension.empty() )
+		return Filter.bSniff ? 2 : 0;
+
+	for ( const std::string& Listed : Filter.Extensions )
+	{
+		if ( Listed == Extension )
+			return 1;
+	}
+
+	return 0;
+}
+
+static bool
+MatchFileMetadata(
+	const FileFilter& Filter,
+	long long Size,
+	long long Time
+)
+{
+	return Size >= Filter.MinSize && Size <= Filter.MaxSize && Time > Filter.Newer && Time < Filter.Older;
+}
+
+// A FILETIME, 100 ns since 1601, in seconds since 1970
+static long long
+FileTimeToUnix(
+	ULONGLONG FileTime
+)
+{
+	return (long long)( FileTime / 10000000 ) - 11644473600ll;
+}
+
+// Size and modification time of a file from its metadata, without opening it, for paths that were not listed from a directory
+static bool
+StatFile(
+	const std::string& Path,
+	long long& Size,
+	long long& Time
+)
+{
+	WIN32_FILE_ATTRIBUTE_DATA Data;
+	if ( !GetFileAttributesExA( Path.c_str(), GetFileExInfoStandard, &Data ) )
+		return false;
+
+	Size = (long long)( ( (ULONGLONG)Data.nFileSizeHigh << 32 ) | Data.nFileSizeLow );
+	Time = FileTimeToUnix( ( (ULONGLONG)Data.ftLastWriteTime.dwHighDateTime << 32 ) | Data.ftLastWriteTime.dwLowDateTime );
+	return true;
+}
+
+// A size in bytes, with an optional k, m or g suffix, "2m"
+static bool
+ParseSize(
+	const char *const pszSize,
+	long long& Size
+)
+{
+	char *End;
+	double Value = strtod( pszSize, &End );
+
+	switch ( tolower( (unsigned char)*End ) )
+	{
+	case 'k': Value *= 1024.0; End++; break;
+	case 'm': Value *= 1024.0 * 1024.0; End++; break;
+	case 'g': Value *= 1024.0 * 1024.0 * 1024.0; End++; break;
+	}
+
+	if ( End == pszSize || *End || Value < 0.0 )
+		return false;
+
+	Size = (long long)Value;
+	return true;
+}
+
+// A time for --newer and --older, a date, 2024-05-31 or 2024-05-31T13:45:00 in UTC, or the modification time of a file, as find -newer takes
+static bool
+ParseTime(
+	const char *const pszTime,
+	long long& Time
+)
+{
+	int Year, Month, Day, Hour = 0, Minute = 0, Second = 0;
+	char Extra;
+
+	int numFields = sscanf( pszTime, "%d-%d-%d%c%d:%d:%d", &Year, &Month, &Day, &Extra, &Hour, &Minute, &Second );
+
+	if ( numFields == 3 || ( numFields == 7 && ( Extra == 'T' || Extra == ' ' ) ) )
+	{
+		if ( Month < 1 || Month > 12 || Day < 1 || Day > 31 )
+			return false;
+
+		// Days since 1970 of a civil date, shifting the year to start in March so the leap day is last
+		long long y = Year - ( Month <= 2 );
+		long long Era = ( y >= 0 ? y : y - 399 ) / 400;
+		long long YearOfEra = y - Era * 400;
+		long long DayOfYear = ( 153 * ( Month + ( Month > 2 ? -3 : 9 ) ) + 2 ) / 5 + Day - 1;
+		long long DayOfEra = YearOfEra * 365 + YearOfEra / 4 - YearOfEra / 100 + DayOfYear;
+
+		Time = ( Era * 146097 + DayOfEra - 719468 ) * 86400 + Hour * 3600 + Minute * 60 + Second;
+		return true;
+	}
+
+	long long Size;
+	return StatFile( pszTime, Size, Time );
+}
+
+// Read the first two bytes of a file, unbuffered, so the check costs an open and a two byte read
+static bool
+HasMzMagic(
+	const std::string& Path
+)
+{
+	FILE *f = NULL;
+	if ( 0 != fopen_s( &f, Path.c_str(), "rb" ) || !f )
+		return false;
+
+	setvbuf( f, NULL, _IONBF, 0 );
+
+	char Magic[2];
+	bool bMz = 1 == fread( Magic, sizeof( Magic ), 1, f ) && Magic[0] == 'M' && Magic[1] == 'Z';
+
+	fclose( f );
+	return bMz;
+}
+
+const size_t IndexCompactRatio = 4;
+
+// Drop the entries of removed files, and give the live files and the dlls they still name dense ids in their old order
+// Entries stay ordered by file, the caller holds the index exclusively
+static void
+CompactImportIndex(
+	ImportIndex& Index
+)
+{
+	std::vector<DWORD> FileIds( Index.Paths.size(), (DWORD)-1 );
+	std::vector<DWORD> DllIds( Index.Dlls.size(), IndexNoDll );
+	size_t numFiles = 0;
+	size_t numDlls = 0;
+
+	for ( size_t i = 0; i < Index.Paths.size(); i++ )
+	{
+		if ( Index.bRemoved[i] )
+			continue;
+
+		// A path moved onto itself is left empty
+		if ( numFiles != i )
+			Index.Paths[numFiles] = std::move( Index.Paths[i] );
+
+		FileIds[i] = (DWORD)numFiles++;
+	}
+
+	for ( auto Name = Index.Names.begin(); Name != Index.Names.end(); )
+	{
+		std::vector<IndexEntry>& Entries = Name->second;
+		size_t Kept = 0;
+
+		for ( IndexEntry Entry : Entries )
+		{
+			if ( Index.bRemoved[Entry.File] )
+				continue;
+
+			IndexEntry& Moved = Entries[Kept++];
+			Moved = Entry;
+			Moved.File = FileIds[Entry.File];
+
+			if ( Entry.Dll != IndexNoDll )
+			{
+				if ( DllIds[Entry.Dll] == IndexNoDll )
+					DllIds[Entry.Dll] = (DWORD)numDlls++;
+
+				Moved.Dll = DllIds[Entry.Dll];
+			}
+		}
+
+		if ( !Kept )
+		{
+			Name = Index.Names.erase( Name );
+			continue;
+		}
+
+		Entries.resize( Kept );
+		Entries.shrink_to_fit();
+		++Name;
+	}
+
+	std::vector<std::string> Dlls( numDlls );
+
+	for ( size_t i = 0; i < Index.Dlls.size(); i++ )
+	{
+		if ( DllIds[i] != IndexNoDll )
+			Dlls[DllIds[i]] = std::move( Index.Dlls[i] );
+	}
+
+	Index.Dlls = std::move( Dlls );
+	Index.DllIds.clear();
+
+	for ( size_t i = 0; i < Index.Dlls.size(); i++ )
+		Index.DllIds.emplace( Index.Dlls[i], (DWORD)i );
+
+	for ( auto& Path : Index.PathIds )
+		Path.second = FileIds[Path.second];
+
+	Index.Paths.resize( numFiles );
+	Index.bRemoved.assign( numFiles, 0 );
+	Index.numRemoved = 0;
+}
+
+// Shard of a path for --shard, fnv-1a of the path relative to the scanned directory, so every host agrees
+// The relative path of a zip member includes its archive's, "drivers.zip/x64/foo.sys", listed paths are hashed as given
+static unsigned
+ShardOfPath(
+	std::string_view RelativePath,
+	unsigned numShards
+)
+{
+	ULONGLONG Hash = 0xcbf29ce484222325ull;
+
+	for ( char c : RelativePath )
+		Hash = ( Hash ^ (unsigned char)c ) * 0x100000001b3ull;
+
+	return (unsigned)( Hash % numShards );
+}
+
+// Length of the scanned directory at the start of the paths found in it, with the separator
+static size_t
+ScanRootLength(
+	const char *const pszDirectory
+)
+{
+	return ( std::filesystem::path( pszDirectory ) / "" ).generic_string().size();
+}
+
+// Parse the changed files again and swap them into the index
+// Every changed path loses its old id, the ones that still parse get a new id, so deleted and broken files drop out
+static void
+ApplyIndexChanges(
+	ImportIndex& Index,
+	const std::filesystem::path& Directory,
+	const FileFilter& Filter,
+	bool bExports,
+	unsigned Shard,
+	unsigned numShards,
+	const std::set<std::filesystem::path>& Names
+)
+{
+	ULONGLONG Start = StatClock();
+
+	ImportIndexShard Parsed;
+	PeImage Image;
+	std::vector<std::string> Changed;
+	std::vector<std::string> Added;
+
+	// Only this thread adds files, so the ids given out here are not taken in the meantime
+	DWORD NextFile = (DWORD)Index.Paths.size();
+
+	for ( const std::filesystem::path& Name : Names )
+	{
+		std::filesystem::path Path = Directory / Name;
+
+		int Match = MatchFileFilter( Filter, Path );
+
+		// Files of other shards are left to the servers of those shards
+		if ( !Match || ( numShards && ShardOfPath( Name.generic_string(), numShards ) != Shard ) )
+			continue;
+
+		Changed.push_back( Path.generic_string() );
+
+		// A file that stopped being an image, or no longer passes the limits, is dropped, as a deleted file is
+		if ( Match == 2 && !HasMzMagic( Changed.back() ) )
+			continue;
+
+		long long Size = -1, Time;
+		if ( Filter.bMetadata && !( StatFile( Changed.back(), Size, Time ) && MatchFileMetadata( Filter, Size, Time ) ) )
+			continue;
+
+		// Deleted files fail to open
+		PeError Error;
+		FILE *f = OpenImage( Changed.back(), bExports, Image, &Error, &Size );
+		if ( !f )
+		{
+			ReportImageError( Changed.back(), Error );
+			continue;
+		}
+
+		fclose( f );
+		ReportDirectoryErrors( Changed.back(), Image );
+
+		AddToImportIndex( Parsed, NextFile + (DWORD)Added.size(), Image );
+		Added.push_back( Changed.back() );
+	}
+
+	if ( Changed.empty() )
+		return;
+
+	std::unique_lock<std::shared_mutex> Lock( Index.Lock );
+
+	for ( const std::string& Path : Changed )
+	{
+		auto Found = Index.PathIds.find( Path );
+
+		if ( Found == Index.PathIds.end() )
+			continue;
+
+		Index.bRemoved[Found->second] = 1;
+		Index.numRemoved++;
+		Index.PathIds.erase( Found );
+	}
+
+	for ( std::string& Path : Added )
+	{
+		Index.PathIds[Path] = (DWORD)Index.Paths.size();
+		Index.Paths.push_back( std::move( Path ) );
+		Index.bRemoved.push_back( 0 );
+	}
+
+	MergeImportIndexShard( Parsed, Index );
+
+	// A file rewritten over and over would otherwise grow the index without bound, and every query skips its old entries
+	bool bCompact = Index.numRemoved * IndexCompactRatio > Index.Paths.size() - Index.numRemoved;
+
+	if ( bCompact )
+		CompactImportIndex( Index );
+
+	Lock.unlock();
+
+	fprintf( stderr, "Import index - %zu changed file(s), %zu parsed%s, %.3f ms\n", Changed.size(), Added.size(), bCompact ? ", compacted" : "", ( StatClock() - Start ) / 1e6 );
+}
+
+// Keep the index up to date with the directory, blocking on change notifications so an idle tree costs nothing
+// Changes are collected until none have come for WatchDebounceMs, or for at most WatchMaxBatchMs, then applied as one batch
+static void
+WatchDirectory(
+	const char *const pszDirectory,
+	const FileFilter& Filter,
+	bool bExports,
+	unsigned Shard,
+	unsigned numShards,
+	ImportIndex& Index
+)
+{
+	const std::filesystem::path Directory( pszDirectory );
+	std::set<std::filesystem::path> Pending;
+	bool bRescan = false;
+	ULONGLONG FirstChange = 0;			// When the first change of the pending batch came
+
+	// A lost notification means any file could have changed, so every file in the directory and the index is checked
+	auto Rescan = [&]()
+	{
+		std::error_code Error;
+
+		for ( const auto& dirEntry : std::filesystem::directory_iterator( Directory, Error ) )
+			Pending.insert( dirEntry.path().filename() );
+
+		std::shared_lock<std::shared_mutex> Lock( Index.Lock );
+
+		for ( const auto& Path : Index.PathIds )
+			Pending.insert( std::filesystem::path( Path.first ).filename() );
+	};
+
+	HANDLE DirectoryHandle = CreateFileA( pszDirectory, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL );
+	HANDLE Event = CreateEventA( NULL, TRUE, FALSE, NULL );
+
+	if ( DirectoryHandle == INVALID_HANDLE_VALUE || !Event )
+	{
+		fprintf( stderr, "%s - Could not watch directory (%lu)\n", pszDirectory, GetLastError() );
+		return;
+	}
+
+	const DWORD NotifyFilter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE;
+	std::vector<DWORD> Buffer( 0x4000 );
+	OVERLAPPED Overlapped = {};
+	Overlapped.hEvent = Event;
+
+	if ( !ReadDirectoryChangesW( DirectoryHandle, Buffer.data(), (DWORD)( Buffer.size() * sizeof( DWORD ) ), FALSE, NotifyFilter, NULL, &Overlapped, NULL ) )
+	{
+		fprintf( stderr, "%s - Could not watch directory (%lu)\n", pszDirectory, GetLastError() );
+		return;
+	}
+
+	for ( ;; )
+	{
+		bool bBatch = !Pending.empty() || bRescan;
+		ULONGLONG Waited = bBatch ? GetTickCount64() - FirstChange : 0;
+
+		// The batch is applied as if the wait timed out once it is due, whether or not more changes are waiting
+		DWORD Wait = bBatch && Waited >= WatchMaxBatchMs ? WAIT_TIMEOUT
+			: WaitForSingleObject( Event, bBatch ? (DWORD)std::min<ULONGLONG>( WatchDebounceMs, WatchMaxBatchMs - Waited ) : INFINITE );
+
+		if ( Wait == WAIT_TIMEOUT )
+		{
+			if ( bRescan )
+				Rescan();
+
+			ApplyIndexChanges( Index, Directory, Filter, bExports, Shard, numShards, Pending );
+			Pending.clear();
+			bRescan = false;
+			continue;
+		}
+
+		DWORD Bytes = 0;
+
+		if ( !GetOverlappedResult( DirectoryHandle, &Overlapped, &Bytes, FALSE ) )
+			break;
+
+		if ( !bBatch )
+			FirstChange = GetTickCount64();
+
+		// No records means the buffer overflowed and the changes were lost
+		if ( !Bytes )
+			bRescan = true;
+
+		for ( const BYTE *Entry = (const BYTE *)Buffer.data(); Bytes; )
+		{
+			const FILE_NOTIFY_INFORMATION *Info = (const FILE_NOTIFY_INFORMATION *)Entry;
+			Pending.insert( std::filesystem::path( std::wstring( Info->FileName, Info->FileNameLength / sizeof( WCHAR ) ) ) );
+
+			if ( !Info->NextEntryOffset )
+				break;
+
+			Entry += Info->NextEntryOffset;
+		}
+
+		ResetEvent( Event );
+
+		if ( !ReadDirectoryChangesW( DirectoryHandle, Buffer.data(), (DWORD)( Buffer.size() * sizeof( DWORD ) ), FALSE, NotifyFilter, NULL, &Overlapped, NULL ) )
+			break;
+	}
+
+	fprintf( stderr, "%s - Stopped watching directory (%lu)\n", pszDirectory, GetLastError() );
+	CloseHandle( Event );
+	CloseHandle( DirectoryHandle );
+}
+
+// Send one query to a --serve process and print its answer
 static int
-ReadMagicNumber(
-	FILE *f,
-	const char *const Path,
-	IMAGE_DOS_HEADER *DosHeader
+QueryServer(
+	const char *const pszName,
+	int numImports,
+	const char *const *const ppszImports
+)
+{
+	std::string PipeName = std::string( "\\\\.\\pipe\\" ) + pszName;
+	QueryConnection Connection;
+
+	// Every instance can be busy with another client
+	// The server may only identify the client, not impersonate it, in case another process created the pipe first
+	while ( ( Connection = CreateFileA( PipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, NULL ) ) == INVALID_HANDLE_VALUE )
+	{
+		if ( GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeA( PipeName.c_str(), 5000 ) )
+		{
+			fprintf( stderr, "%s - No server found\n", PipeName.c_str() );
+			return 1;
+		}
+	}
+
+	std::string Query;
+
+	for ( int k = 0; k < numImports; k++ )
+		Query.append( k ? " " : "" ).append( ppszImports[k] );
+
+	Query += '\n';
+
+	if ( !QueryWrite( Connection, Query ) )
+	{
+		QueryClose( Connection );
+		return 1;
+	}
+
+	// The answer ends with an empty line
+	std::string Response;
+	char Buffer[4096];
+
+	for ( size_t Read; ( Read = QueryRead( Connection, Buffer, sizeof( Buffer ) ) ); )
+	{
+		Response.append( Buffer, Read );
+
+		if ( Response.size() >= 1 && Response.back() == '\n' && ( Response.size() == 1 || Response.compare( Response.size() - 2, 2, "\n\n" ) == 0 ) )
+			break;
+	}
+
+	CloseHandle( Connection );
+
+	fwrite( Response.data(), 1, Response.size() ? Response.size() - 1 : 0, stdout );
+	return 0;
+}
+
+// Sum the workers' statistics and print them to stderr, so they stay out of the results
+static void
+PrintScanStats(
+	const std::vector<ScanStats>& Stats,
+	ULONGLONG WallTime,
+	bool bHistogram
 )
 {
-	DosHeader->e_magic = 0;
+	ScanStats Total;
+
+	for ( const ScanStats& Worker : Stats )
+	{
+		for ( int i = 0; i < NumScanStages; i++ )
+			Total.StageTime[i] += Worker.StageTime[i];
+
+		for ( int i = 0; i < NumRejectFunctions; i++ )
+			for ( int j = 0; j < NumRejectCodes; j++ )
+				Total.Rejected[i][j] += Worker.Rejected[i][j];
+
+		for ( int i = 0; i < 32; i++ )
+			Total.Latency[i] += Worker.Latency[i];
+
+		Total.FilesSeen += Worker.FilesSeen;
+		Total.FilesOpened += Worker.FilesOpened;
+		Total.FilesParsed += Worker.FilesParsed;
+		Total.FilesCached += Worker.FilesCached;
+		Total.FilesMatched += Worker.FilesMatched;
+		Total.Reads += Worker.Reads;
+		Total.Seeks += Worker.Seeks;
+		Total.BytesRead += Worker.BytesRead;
+	}
+
+	fprintf( stderr, "Scan statistics - %zu thread(s), %.3f s\n", Stats.size(), WallTime / 1e9 );
+	fprintf( stderr, "\tFiles - %llu seen, %llu opened, %llu parsed, %llu matched\n", Total.FilesSeen, Total.FilesOpened, Total.FilesParsed, Total.FilesMatched );
+	if ( Stats[0].FilesLinked )
+		fprintf( stderr, "\tLinks - %llu path(s) name a file already read through another path\n", Stats[0].FilesLinked );
+
+	if ( Total.FilesCached )
+		fprintf( stderr, "\tCache - %llu file(s) taken from the cache instead of parsed\n", Total.FilesCached );
+
+	fprintf( stderr, "\tI/O - %llu fread(s), %llu fseek(s), %llu bytes read\n", Total.Reads, Total.Seeks, Total.BytesRead );
+
+	for ( int i = 0; i < NumRejectFunctions; i++ )
+		for ( int j = 1; j < NumRejectCodes; j++ )
+			if ( Total.Rejected[i][j] )
+				fprintf( stderr, "\tRejected - %s returned %i%s: %llu\n", RejectNames[i], j, j == NumRejectCodes - 1 ? " or more" : "", Total.Rejected[i][j] );
+
+	// Stage times are summed over workers, so they can add up to more than the wall time
+	fprintf( stderr, "\tStage        total ms    us/file\n" );
+
+	for ( int i = 0; i < NumScanStages; i++ )
+		fprintf( stderr, "\t%-10s %10.3f %10.3f\n", ScanStageNames[i], Total.StageTime[i] / 1e6, Total.FilesSeen ? Total.StageTime[i] / 1e3 / Total.FilesSeen : 0.0 );
+
+	if ( !bHistogram )
+		return;
 
-	// Read magic number
-	if ( 1 != fread( &DosHeader->e_magic, sizeof( DosHeader->e_magic ), 1, f ) )
+	fprintf( stderr, "\tLatency per file\n" );
+
+	for ( int i = 0; i < 32; i++ )
+		if ( Total.Latency[i] )
+			fprintf( stderr, "\t%10llu - %10llu us: %llu\n", i ? 1ull << i : 0ull, ( 2ull << i ) - 1, Total.Latency[i] );
+}
+
+// Write the spans of every worker as a chrome trace, which perfetto (ui.perfetto.dev) and chrome://tracing open
+// One thread per worker, each file is a span with its path, holding the spans of its stages
+static int
+WriteTrace(
+	const char *const pszTracePath,
+	const std::vector<TraceRing>& Traces,
+	const std::vector<std::string>& Paths,
+	ULONGLONG TraceStart
+)
+{
+	FILE *f = NULL;
+	if ( 0 != fopen_s( &f, pszTracePath, "wb" ) || !f )
 	{
-		printf( "%s - Too small to read magic number from DOS header\n", Path );
+		fprintf( stderr, "%s - Could not create trace\n", pszTracePath );
 		return 1;
 	}
 
-	// Check 'MZ' signature
-	if ( DosHeader->e_magic != 'ZM' )
+	std::string Buffer;
+	Buffer.reserve( OutputBufferSize + 0x10000 );
+	Buffer.append( "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" );
+	Buffer.append( "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"impfi\"}}" );
+
+	ULONGLONG Dropped = 0;
+
+	for ( size_t Worker = 0; Worker < Traces.size(); Worker++ )
 	{
-		printf( "%s - Incorrect magic number from DOS header\n", Path );
-		return 2;
+		const TraceRing& Ring = Traces[Worker];
+		ULONGLONG Head = Ring.Head.load( std::memory_order_acquire );
+		ULONGLONG First = Head > TraceRingCapacity ? Head - TraceRingCapacity : 0;
+
+		Dropped += First;
+
+		Buffer.append( ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" );
+		AppendNumber( Buffer, Worker );
+		Buffer.append( ",\"args\":{\"name\":\"worker " );
+		AppendNumber( Buffer, Worker );
+		Buffer.append( "\"}}" );
+
+		for ( ULONGLONG i = First; i < Head; i++ )
+		{
+			const TraceSpan& Span = Ring.Spans[i % TraceRingCapacity];
+
+			// Microseconds with nanosecond decimals
+			Buffer.append( ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":" );
+			AppendNumber( Buffer, Worker );
+			Buffer.append( ",\"name\":\"" ).append( Span.Stage == NumScanStages ? "file" : ScanStageNames[Span.Stage] );
+			Buffer.append( "\",\"ts\":" );
+			AppendNumber( Buffer, ( Span.Start - TraceStart ) / 1e3 );
+			Buffer.append( ",\"dur\":" );
+			AppendNumber( Buffer, Span.Duration / 1e3 );
+
+			if ( Span.Stage == NumScanStages && Span.File < Paths.size() )
+			{
+				Buffer.append( ",\"args\":{\"path\":" );
+				AppendField( Buffer, Paths[Span.File], FormatNdjson );
+				Buffer += '}';
+			}
+
+			Buffer += '}';
+
+			if ( Buffer.size() >= OutputBufferSize )
+			{
+				fwrite( Buffer.data(), 1, Buffer.size(), f );
+				Buffer.clear();
+			}
+		}
 	}
 
+	Buffer.append( "\n]}\n" );
+	fwrite( Buffer.data(), 1, Buffer.size(), f );
+	fclose( f );
+
+	if ( Dropped )
+		fprintf( stderr, "%s - %llu of the oldest spans were dropped\n", pszTracePath, Dropped );
+
 	return 0;
 }
 
-static int
-ReadNtHeaders(
-	FILE *f,
-	const char *const Path,
-	IMAGE_DOS_HEADER *DosHeader,
-	IMAGE_NT_HEADERS *NtHeaders
+// Identity of a physical file, the volume and file index (device and inode), all zero when unknown
+struct FileId
+{
+	ULONGLONG Volume;
+	ULONGLONG Index;
+
+	bool
+	operator==(
+		const FileId& Other
+	) const
+	{
+		return Volume == Other.Volume && Index == Other.Index;
+	}
+};
+
+struct FileIdHash
+{
+	size_t
+	operator()(
+		const FileId& Id
+	) const
+	{
+		return (size_t)( MixHash( Id.Index ) ^ Id.Volume );
+	}
+};
+
+// Enumerate the files that pass the filter, along with the id and size of each file
+// Unsniffed is set for the files with no extension whose magic is still to be checked, see SniffImages
+static void
+EnumerateFiles(
+	const char *const pszDirectory,
+	const FileFilter& Filter,
+	std::vector<std::string>& Paths,
+	std::vector<FileId>& Ids,
+	std::vector<long long>& Sizes,
+	std::vector<char>& Unsniffed
+)
+{
+	// The file ids, sizes and times come with the directory listing, so no file is opened to get them
+	HANDLE Directory = CreateFileA( pszDirectory, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL );
+	BY_HANDLE_FILE_INFORMATION DirectoryInfo;
+
+	if ( Directory == INVALID_HANDLE_VALUE || !GetFileInformationByHandle( Directory, &DirectoryInfo ) )
+	{
+		if ( Directory != INVALID_HANDLE_VALUE )
+			CloseHandle( Directory );
+
+		fprintf( stderr, "%s - Directory not found\n", pszDirectory );
+		return;
+	}
+
+	std::vector<ULONGLONG> Buffer( 0x2000 );
+	const std::filesystem::path DirectoryPath( pszDirectory );
+	FILE_INFO_BY_HANDLE_CLASS Class = FileIdBothDirectoryRestartInfo;
+
+	while ( GetFileInformationByHandleEx( Directory, Class, Buffer.data(), (DWORD)( Buffer.size() * sizeof( ULONGLONG ) ) ) )
+	{
+		Class = FileIdBothDirectoryInfo;
+
+		for ( const BYTE *Entry = (const BYTE *)Buffer.data(); ; )
+		{
+			const FILE_ID_BOTH_DIR_INFO *Info = (const FILE_ID_BOTH_DIR_INFO *)Entry;
+			std::filesystem::path Path = DirectoryPath / std::wstring( Info->FileName, Info->FileNameLength / sizeof( WCHAR ) );
+
+			int Match = Info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY ? 0 : MatchFileFilter( Filter, Path );
+
+			if ( Match && Filter.bMetadata && !MatchFileMetadata( Filter, Info->EndOfFile.QuadPart, FileTimeToUnix( (ULONGLONG)Info->LastWriteTime.QuadPart ) ) )
+				Match = 0;
+
+			if ( Match )
+			{
+				Paths.push_back( Path.generic_string() );
+				Sizes.push_back( Info->EndOfFile.QuadPart );
+				Unsniffed.push_back( Match == 2 );
+
+				// A link's own id is not the id of the file it points to
+				if ( Info->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT )
+					Ids.push_back( { 0, 0 } );
+				else
+					Ids.push_back( { DirectoryInfo.dwVolumeSerialNumber, (ULONGLONG)Info->FileId.QuadPart } );
+			}
+
+			if ( !Info->NextEntryOffset )
+				break;
+
+			Entry += Info->NextEntryOffset;
+		}
+	}
+
+	CloseHandle( Directory );
+}
+
+// Keep the unsniffed files that start with MZ, checked in parallel, one unbuffered two byte read per file
+// The check runs as a batch after the listing, so the opens overlap instead of stalling the enumeration
+static void
+SniffImages(
+	unsigned numThreads,
+	std::vector<std::string>& Paths,
+	std::vector<FileId>& Ids,
+	std::vector<long long>& Sizes,
+	const std::vector<char>& Unsniffed
+)
+{
+	std::vector<size_t> Sniffed;
+
+	for ( size_t i = 0; i < Unsniffed.size(); i++ )
+	{
+		if ( Unsniffed[i] )
+			Sniffed.push_back( i );
+	}
+
+	if ( Sniffed.empty() )
+		return;
+
+	std::vector<char> bImage( Paths.size(), 1 );
+
+	ParallelFor( Sniffed.size(), numThreads, NULL, NULL, [&]( unsigned, size_t Index )
+	{
+		bImage[Sniffed[Index]] = HasMzMagic( Paths[Sniffed[Index]] );
+	} );
+
+	size_t Kept = 0;
+
+	for ( size_t i = 0; i < Paths.size(); i++ )
+	{
+		if ( !bImage[i] )
+			continue;
+
+		if ( Kept != i )
+		{
+			Paths[Kept] = std::move( Paths[i] );
+			Ids[Kept] = Ids[i];
+			Sizes[Kept] = Sizes[i];
+		}
+
+		Kept++;
+	}
+
+	Paths.resize( Kept );
+	Ids.resize( Kept );
+	Sizes.resize( Kept );
+}
+
+const size_t NoAlias = (size_t)-1;
+
+// Paths that name the same physical file, through hard links or another mount of the same volume
+// Only the first path of a file is read, its result is reported for every path of the file
+struct FileAliases
+{
+	std::vector<size_t> Next;	// The next path of the same file, NoAlias after the last
+	std::vector<char> bAlias;	// Not the first path of its file, so not read
+	size_t numAliases = 0;
+};
+
+static void
+FindAliases(
+	const std::vector<FileId>& Ids,
+	FileAliases& Aliases
+)
+{
+	std::unordered_map<FileId, size_t, FileIdHash> Last;
+	Last.reserve( Ids.size() );
+
+	Aliases.Next.assign( Ids.size(), NoAlias );
+	Aliases.bAlias.assign( Ids.size(), 0 );
+
+	for ( size_t i = 0; i < Ids.size(); i++ )
+	{
+		if ( !Ids[i].Volume && !Ids[i].Index )
+			continue;
+
+		auto Found = Last.emplace( Ids[i], i );
+
+		if ( Found.second )
+			continue;
+
+		// Chain the path after the last path of the same file
+		Aliases.Next[Found.first->second] = i;
+		Aliases.bAlias[i] = 1;
+		Aliases.numAliases++;
+		Found.first->second = i;
+	}
+}
+
+// Where a path of the scan is read from, with --zip, a file, or a member of a zip archive in the directory
+struct ZipMember
+{
+	DWORD Archive;	// NoArchive for files
+	DWORD Entry;
+};
+
+const DWORD NoArchive = 0xffffffff;
+
+// Add the members of the zip archives in the directory that have one of the extensions, as <archive>/<member> paths
+// The central directory of each archive is read once here, members are read by the workers as any other path
+static void
+EnumerateZipMembers(
+	const char *const pszDirectory,
+	const FileFilter& Filter,
+	std::vector<ZipArchive>& Archives,
+	std::vector<std::string>& Paths,
+	std::vector<FileId>& Ids,
+	std::vector<long long>& Sizes,
+	std::vector<ZipMember>& Members
+)
+{
+	std::vector<std::string> ArchivePaths;
+	std::vector<FileId> ArchiveIds;
+	std::vector<long long> ArchiveSizes;
+	std::vector<char> Unsniffed;
+	FileFilter Zips;
+
+	// Members take the modification time of their archive, their own sizes are checked below
+	Zips.Extensions.push_back( ".zip" );
+	Zips.bMetadata = Filter.bMetadata;
+	Zips.Newer = Filter.Newer;
+	Zips.Older = Filter.Older;
+	EnumerateFiles( pszDirectory, Zips, ArchivePaths, ArchiveIds, ArchiveSizes, Unsniffed );
+
+	Members.assign( Paths.size(), { NoArchive, 0 } );
+	Archives.resize( ArchivePaths.size() );
+
+	for ( size_t i = 0; i < ArchivePaths.size(); i++ )
+	{
+		if ( 0 != ReadZipDirectory( ArchivePaths[i], Filter.Extensions, Archives[i] ) )
+			continue;
+
+		// Members have no file id, each is read on its own
+		for ( size_t k = 0; k < Archives[i].Entries.size(); k++ )
+		{
+			long long Size = (long long)Archives[i].Entries[k].UncompressedSize;
+
+			if ( Size < Filter.MinSize || Size > Filter.MaxSize )
+				continue;
+
+			Paths.push_back( ArchivePaths[i] + '/' + Archives[i].Entries[k].Name );
+			Ids.push_back( { 0, 0 } );
+			Sizes.push_back( Size );
+			Members.push_back( { (DWORD)i, (DWORD)k } );
+		}
+	}
+}
+
+// Read a path of the scan, a file through the content cache, or a zip member inflated by the worker's reader
+// Returns false when it could not be read, Size is the size of the file or of the inflated member
+// A file's size is taken from the listing when it is known, Size is -1 when it is not
+static bool
+ReadScanPath(
+	const std::vector<ZipArchive>& Archives,
+	const std::vector<ZipMember>& Members,
+	size_t Index,
+	const std::string& Path,
+	bool bExports,
+	ImageCache *Cache,
+	ZipReader *Reader,
+	PeImage& Image,
+	const PeImage *& pImage,
+	long long& Size
 )
 {
-	// Initialize the rest of the header
-	memset( &DosHeader->e_cblp, 0, sizeof( *DosHeader ) - sizeof( DosHeader->e_magic ) );
+	PeError Error;
 
-	// Read the rest of the header
-	if ( 1 != fread( &DosHeader->e_cblp, sizeof( *DosHeader ) - sizeof( DosHeader->e_magic ), 1, f ) )
+	if ( Members.empty() || Members[Index].Archive == NoArchive )
 	{
-		printf( "%s - DOS header incomplete after magic number\n", Path );
-		return 1;
-	}
+		// The listed size saves the reader a seek to find it
+		FILE *f = OpenCachedImage( Path, bExports, Cache, Image, pImage, &Error, &Size );
+		if ( !f )
+		{
+			ReportImageError( Path, Error );
+			return false;
+		}
 
-	// Seek to the NT header offset from the beginning of the file
-	if ( 0 != fseek( f, DosHeader->e_lfanew, SEEK_SET ) )
-	{
-		printf( "%s - NT header not found\n", Path );
-		return 2;
+		fclose( f );
+		ReportDirectoryErrors( Path, *pImage );
+		return true;
 	}
 
-	// Read the NT header
-	if ( 1 != fread( NtHeaders, sizeof( *NtHeaders ), 1, f ) )
-	{
-		printf( "%s - NT headers incomplete\n", Path );
-		return 3;
-	}
+	StageClock Clock;
+	pImage = &Image;
 
-	// Check 'PE' signature
-	if ( NtHeaders->Signature != 'EP' )
-	{
-		printf( "%s - Incorrect NT header signature\n", Path );
-		return 4;
-	}
+	int Result = ReadZipMember( Archives[Members[Index].Archive], Members[Index].Entry, *Reader );
+
+	Clock.Lap( StageOpen );
 
-	// Check architecture
-#ifdef _M_X64
-	if ( NtHeaders->FileHeader.Machine != IMAGE_FILE_MACHINE_AMD64 )
-#elif _M_IA64
-	if ( NtHeaders->FileHeader.Machine != IMAGE_FILE_MACHINE_IA64 )
-#else
-	if ( NtHeaders->FileHeader.Machine != IMAGE_FILE_MACHINE_I386 )
-#endif
+	if ( 0 != Result )
+		return false;
+
+	if ( t_pStats )
+		t_pStats->FilesOpened++;
+
+	Size = (long long)Reader->Data.size();
+
+	if ( 0 != ParseImage( Reader->Data.data(), Reader->Data.size(), bExports, Image, &Error ) )
 	{
-		// Fail silently to ignore architectures that are not targeted
-		return 5;
+		ReportImageError( Path, Error );
+		return false;
 	}
 
-	if ( NtHeaders->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR_MAGIC )
+	ReportDirectoryErrors( Path, Image );
+	return true;
+}
+
+// Open the list of --files-from, a manifest file or - for stdin, -1 when it could not be opened
+static int
+OpenPathList(
+	const char *const pszList
+)
+{
+	if ( 0 == strcmp( pszList, "-" ) )
 	{
-		printf( "%s - Optional header magic number is inconsistent with NT header architecture, corrupted?\n", Path );
-		return 6;
+		// No newline translation, a \r before a newline is dropped with the newline
+		_setmode( 0, _O_BINARY );
+		return 0;
 	}
 
-	return 0;
+	int List = _open( pszList, _O_RDONLY | _O_BINARY );
+
+	if ( List < 0 )
+		fprintf( stderr, "%s - Could not open file list\n", pszList );
+
+	return List;
 }
 
-static int
-ReadSections(
-	FILE *f,
-	const char *const Path,
-	IMAGE_FILE_HEADER *DosHeader,
-	std::vector<IMAGE_SECTION_HEADER>& Sections
+// Call Add( Path ) for each path of the list, delimited by newlines, or by NULs (find -print0) when Delimiter is 0
+// The list is read as the chunks arrive, so a path is added as soon as its delimiter has been read, not when the list ends
+template <typename AddFn>
+static void
+ReadPathList(
+	int List,
+	char Delimiter,
+	AddFn Add
 )
 {
-	Sections.clear();
+	char Buffer[0x10000];
+	std::string Path;
+
+	auto AddPath = [&]()
+	{
+		if ( Delimiter == '\n' && !Path.empty() && Path.back() == '\r' )
+			Path.pop_back();
 
-	IMAGE_SECTION_HEADER SectionHeader;
+		if ( !Path.empty() )
+			Add( std::move( Path ) );
 
-	for ( WORD i = 0; i < DosHeader->NumberOfSections; i++ )
+		Path.clear();
+	};
+
+	for ( ;; )
 	{
-		memset( &SectionHeader, 0, sizeof( SectionHeader ) );
+		int Read = _read( List, Buffer, sizeof( Buffer ) );
+		if ( Read <= 0 )
+			break;
 
-		if ( 1 != fread( &SectionHeader, sizeof( SectionHeader ), 1, f ) )
+		for ( const char *Next = Buffer, *End = Buffer + Read; Next < End; )
 		{
-			printf( "%s - Corrupted section %i\n", Path, i );
-			return 1;
-		}
+			const char *Delimited = (const char *)memchr( Next, Delimiter, End - Next );
+
+			Path.append( Next, Delimited ? Delimited : End );
 
-		Sections.push_back( SectionHeader );
+			if ( !Delimited )
+				break;
+
+			AddPath();
+			Next = Delimited + 1;
+		}
 	}
 
-	return 0;
+	// The last path needs no delimiter
+	AddPath();
+
+	// stdin is left open
+	if ( List == 0 )
+		return;
+
+	_close( List );
 }
 
-// Search all sections for the given relative virtual address
-static DWORD
-SectionRvaFileOffset( 
-	IMAGE_FILE_HEADER *FileHeader,
-	const std::vector<IMAGE_SECTION_HEADER>& Sections,
-	DWORD Rva 
+// Keep the paths (and their ids and zip members) of one shard
+static void
+SelectShard(
+	unsigned Shard,
+	unsigned numShards,
+	size_t RootLength,
+	std::vector<std::string>& Paths,
+	std::vector<FileId>& Ids,
+	std::vector<long long>& Sizes,
+	std::vector<ZipMember>& Members
 )
 {
-	for ( WORD i = 0; i < FileHeader->NumberOfSections; i++ )
+	size_t Kept = 0;
+
+	for ( size_t i = 0; i < Paths.size(); i++ )
 	{
-		DWORD VirtualAddress = Sections[i].VirtualAddress;
-		DWORD VirtualSize = Sections[i].Misc.VirtualSize;
+		if ( ShardOfPath( std::string_view( Paths[i] ).substr( RootLength ), numShards ) != Shard )
+			continue;
 
-		if ( VirtualAddress <= Rva && Rva < VirtualAddress + VirtualSize )
+		// A path moved onto itself is left empty
+		if ( Kept != i )
 		{
-			return ( Rva - VirtualAddress ) + Sections[i].PointerToRawData;
+			Paths[Kept] = std::move( Paths[i] );
+			Ids[Kept] = Ids[i];
+			Sizes[Kept] = Sizes[i];
+
+			if ( !Members.empty() )
+				Members[Kept] = Members[i];
 		}
+
+		Kept++;
 	}
 
-	return 0;
+	Paths.resize( Kept );
+	Ids.resize( Kept );
+	Sizes.resize( Kept );
+
+	if ( !Members.empty() )
+		Members.resize( Kept );
 }
 
-// Enumerate import descriptors
-// This could be refactored
-static int
-ReadImportDescriptors(
-	FILE *f,
-	const char *const Path,
-	IMAGE_FILE_HEADER *FileHeader,
-	IMAGE_OPTIONAL_HEADER *OptionalHeader,
-	const std::vector<IMAGE_SECTION_HEADER>& Sections,
-	std::vector<IMAGE_IMPORT_DESCRIPTOR>& ImportDescriptors,
-	std::vector<std::string>& ImportDllNames,
-	std::vector<std::vector<std::string>>& ImportThunkNames
+// Id of a string of an input stream in the merged stream
+static DWORD
+MergeString(
+	OutputBuffer& Buffer,
+	const ResultStream& Stream,
+	uint32_t Id
 )
 {
-	ImportDescriptors.clear();
-	ImportDllNames.clear();
-	ImportThunkNames.clear();
-
-	DWORD NumberOfEntries = OptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].Size / sizeof( IMAGE_IMPORT_DESCRIPTOR ) - 1;
-	DWORD Offset = SectionRvaFileOffset( FileHeader, Sections, OptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress );
+	const char *Value = ResultStreamString( &Stream, Id );
+	return Value ? InternString( Buffer, Value ) : RESULT_STRING_NONE;
+}
 
-	if ( 0 != fseek( f, (long)Offset, SEEK_SET ) )
+// Merge binary result streams (of --shard runs) into one stream on stdout, with the files ordered by path
+// String ids are only unique within a stream, so every string is written again with a new id
+static int
+MergeResults(
+	int numInputs,
+	const char *const *const ppszInputs
+)
+{
+	struct MergedFile
 	{
-		printf( "%s - Import descriptor not found\n", Path );
-		return 1;
-	}
+		const ResultStream *Stream;
+		const ResultFileRecord *File;
+		const char *Path;
+	};
 
-	IMAGE_IMPORT_DESCRIPTOR Descriptor;
+	std::vector<ResultStream> Streams( numInputs );
+	std::vector<MergedFile> Files;
 
-	for ( DWORD i = 0; i < NumberOfEntries; i++ )
+	for ( int i = 0; i < numInputs; i++ )
 	{
-		memset( &Descriptor, 0, sizeof( Descriptor ) );
+		int Result = ResultStreamOpen( &Streams[i], ppszInputs[i] );
 
-		if ( 1 != fread( &Descriptor, sizeof( Descriptor ), 1, f ) )
+		if ( Result )
 		{
-			printf( "%s - File too small to read import descriptor\n", Path );
-			return 2;
+			fprintf( stderr, "%s - Could not read result stream (%i)\n", ppszInputs[i], Result );
+
+			for ( int k = 0; k < i; k++ )
+				ResultStreamClose( &Streams[k] );
+
+			return 1;
 		}
 
-		ImportDescriptors.push_back( Descriptor );
+		size_t Cursor = 0;
+
+		for ( const ResultFileRecord *File; ( File = ResultStreamNextFile( &Streams[i], &Cursor ) ); )
+		{
+			const char *Path = ResultStreamString( &Streams[i], File->PathId );
+			Files.push_back( { &Streams[i], File, Path ? Path : "" } );
+		}
 	}
-	
-	char Name[32];
-	IMAGE_THUNK_DATA Thunk;
-	IMAGE_IMPORT_BY_NAME ImportName;
-	DWORD ThunkOffset;
 
-	for ( DWORD i = 0; i < NumberOfEntries; i++ )
+	std::stable_sort( Files.begin(), Files.end(), []( const MergedFile& a, const MergedFile& b ) { return strcmp( a.Path, b.Path ) < 0; } );
+
+	WriteHeader( FormatBinary, false );
+
+	std::mutex OutputLock;
+	OutputBuffer Buffer;
+	std::vector<ResultHitRecord> Hits;
+
+	for ( const MergedFile& Merged : Files )
 	{
-		Offset = SectionRvaFileOffset( FileHeader, Sections, ImportDescriptors[i].Name );
+		const ResultHitRecord *InputHits = ResultFileHits( Merged.File );
+		Hits.assign( InputHits, InputHits + Merged.File->NumHits );
 
-		if ( 0 != fseek( f, (long)Offset, SEEK_SET ) )
+		for ( ResultHitRecord& Hit : Hits )
 		{
-			printf( "%s - Import descriptor name not found\n", Path );
-			return 3;
+			Hit.DllId = MergeString( Buffer, *Merged.Stream, Hit.DllId );
+			Hit.NameId = MergeString( Buffer, *Merged.Stream, Hit.NameId );
+			Hit.ExportId = MergeString( Buffer, *Merged.Stream, Hit.ExportId );
+			Hit.ForwarderId = MergeString( Buffer, *Merged.Stream, Hit.ForwarderId );
 		}
 
-		Name[0] = 0;
+		ResultFileRecord File = *Merged.File;
+		File.Header.Size = ResultRecordSize( sizeof( File ) + Hits.size() * sizeof( ResultHitRecord ) );
 
-		if ( 1 != fread( Name, sizeof(Name), 1, f ) )
-		{
-			printf( "%s - File too small to read import descriptor name\n", Path );
-			return 4;
-		}
+		if ( File.Flags & ResultFileHasQuery )
+			File.QueryId = MergeString( Buffer, *Merged.Stream, File.QueryId );
+		File.PathId = AppendStringRecord( Buffer, Merged.Path );
+
+		size_t Start = Buffer.Data.size();
+		Buffer.Data.append( (const char *)&File, sizeof( File ) );
+		Buffer.Data.append( (const char *)Hits.data(), Hits.size() * sizeof( ResultHitRecord ) );
+		Buffer.Data.resize( Start + File.Header.Size, 0 );
+
+		if ( Buffer.Data.size() >= OutputBufferSize )
+			FlushOutput( Buffer, OutputLock );
+	}
 
-		Name[sizeof(Name) - 1] = 0;
+	FlushOutput( Buffer, OutputLock );
+	fflush( stdout );
 
-		ImportDllNames.push_back( Name );
+	fprintf( stderr, "Merged %zu file(s) from %i stream(s)\n", Files.size(), numInputs );
+
+	for ( ResultStream& Stream : Streams )
+		ResultStreamClose( &Stream );
+
+	return 0;
+}
 
-		ThunkOffset = SectionRvaFileOffset( FileHeader, Sections, ImportDescriptors[i].FirstThunk );
-		ImportThunkNames.push_back({});
+int main( int argc, char **argv )
+{
+	bool bExports = false;
+	bool bCache = false;
+	bool bMerge = false;
+	bool bWatch = false;
+	bool bZip = false;
+	bool bNull = false;
+	bool bSniff = false;
+	unsigned Shard = 0;
+	unsigned numShards = 0;
+	FileFilter Filter;
+	bool bGraph = false;
+	bool bImphash = false;
+	bool bStats = false;
+	bool bHistogram = false;
+	const char *pszTracePath = NULL;
+	const char *pszServe = NULL;
+	const char *pszQuery = NULL;
+	const char *pszList = NULL;
+	const char *pszQueries = NULL;
+	bool bFrequency = false;
+	size_t TopK = 100;
+	size_t SketchWidth = 0;
+	double Similarity = 0.0;
+	OutputFormat Format = FormatText;
+	unsigned numThreads = 1;		// One thread by default, so the results come in directory order and are numbered the same every run
+	int argi = 1;
 
-		for ( ;; )
+	// Options come before the directory
+	for ( ; argi < argc && 0 == strncmp( argv[argi], "--", 2 ); argi++ )
+	{
+		if ( 0 == strcmp( argv[argi], "--exports" ) )
+			bExports = true;
+		else if ( 0 == strcmp( argv[argi], "--cache" ) )
+			bCache = true;
+		else if ( 0 == strcmp( argv[argi], "--merge" ) )
+			bMerge = true;
+		else if ( 0 == strcmp( argv[argi], "--watch" ) )
+			bWatch = true;
+		else if ( 0 == strcmp( argv[argi], "--zip" ) )
+			bZip = true;
+		else if ( 0 == strcmp( argv[argi], "--files-from" ) && argi + 1 < argc )
+			pszList = argv[++argi];
+		else if ( 0 == strcmp( argv[argi], "--null" ) )
+			bNull = true;
+		else if ( 0 == strcmp( argv[argi], "--sniff" ) )
+			bSniff = true;
+		else if ( ( 0 == strcmp( argv[argi], "--min-size" ) || 0 == strcmp( argv[argi], "--max-size" ) ) && argi + 1 < argc )
 		{
-			if ( 0 != fseek( f, (long)ThunkOffset, SEEK_SET ) )
+			long long& Limit = argv[argi][2] == 'm' && argv[argi][3] == 'i' ? Filter.MinSize : Filter.MaxSize;
+
+			if ( !ParseSize( argv[++argi], Limit ) )
 			{
-				printf( "%s - Import descriptor first thunk not found\n", Path );
-				return 5;
+				printf( "Invalid size %s, expected bytes with an optional k, m or g suffix\n", argv[argi] );
+				return 1;
 			}
 
-			if ( 1 != fread( &Thunk, sizeof( Thunk ), 1, f ) )
+			Filter.bMetadata = true;
+		}
+		else if ( ( 0 == strcmp( argv[argi], "--newer" ) || 0 == strcmp( argv[argi], "--older" ) ) && argi + 1 < argc )
+		{
+			long long& Limit = argv[argi][2] == 'n' ? Filter.Newer : Filter.Older;
+
+			if ( !ParseTime( argv[++argi], Limit ) )
 			{
-				printf( "%s - File too small to read first thunk from file descriptor\n", Path );
-				return 6;
+				printf( "Invalid time %s, expected a date, 2024-05-31 or 2024-05-31T13:45:00 (UTC), or a file\n", argv[argi] );
+				return 1;
 			}
 
-			Offset = SectionRvaFileOffset( FileHeader, Sections, (DWORD)Thunk.u1.AddressOfData );
+			Filter.bMetadata = true;
+		}
+		else if ( 0 == strcmp( argv[argi], "--serve" ) && argi + 1 < argc )
+			pszServe = argv[++argi];
+		else if ( 0 == strcmp( argv[argi], "--query" ) && argi + 1 < argc )
+			pszQuery = argv[++argi];
+		else if ( 0 == strcmp( argv[argi], "--queries" ) && argi + 1 < argc )
+			pszQueries = argv[++argi];
+		else if ( 0 == strcmp( argv[argi], "--frequency" ) )
+			bFrequency = true;
+		else if ( 0 == strcmp( argv[argi], "--top" ) && argi + 1 < argc )
+			TopK = (size_t)strtoull( argv[++argi], NULL, 10 );
+		else if ( 0 == strcmp( argv[argi], "--sketch" ) && argi + 1 < argc )
+		{
+			long long Width;
 
-			// Skip hint
-			if ( 0 != fseek( f, (long)Offset, SEEK_SET ) )
+			if ( !ParseSize( argv[++argi], Width ) || Width <= 0 )
 			{
-				printf( "%s - Thunk name not found\n", Path );
-				return 7;
+				printf( "Invalid sketch width %s, expected counters per row with an optional k, m or g suffix\n", argv[argi] );
+				return 1;
 			}
 
-			if ( 1 != fread( &ImportName, sizeof( ImportName.Hint ), 1, f))
+			SketchWidth = (size_t)Width;
+		}
+		else if ( 0 == strcmp( argv[argi], "--shard" ) && argi + 1 < argc )
+		{
+			if ( 2 != sscanf( argv[++argi], "%u/%u", &Shard, &numShards ) || !numShards || Shard >= numShards )
 			{
-				printf( "%s - File too small to read thunk hint from thunk name\n", Path );
-				return 8;
+				printf( "Invalid shard %s, expected i/N with i from 0 to N - 1\n", argv[argi] );
+				return 1;
 			}
+		}
+		else if ( 0 == strcmp( argv[argi], "--graph" ) )
+			bGraph = true;
+		else if ( 0 == strcmp( argv[argi], "--imphash" ) )
+			bImphash = true;
+		else if ( 0 == strcmp( argv[argi], "--format" ) && argi + 1 < argc )
+		{
+			const char *const pszFormat = argv[++argi];
 
-			// Import by name hint is MZ at the last hunk
-			// Thanks for this documentation microsoft.
-			if ( ImportName.Hint == 'ZM' )
-				break;
-
-			Name[0] = 0;
-
-			if ( 1 != fread( Name, sizeof( Name ), 1, f ) )
+			if ( 0 == strcmp( pszFormat, "text" ) )
+				Format = FormatText;
+			else if ( 0 == strcmp( pszFormat, "ndjson" ) )
+				Format = FormatNdjson;
+			else if ( 0 == strcmp( pszFormat, "csv" ) )
+				Format = FormatCsv;
+			else if ( 0 == strcmp( pszFormat, "tsv" ) )
+				Format = FormatTsv;
+			else if ( 0 == strcmp( pszFormat, "binary" ) )
+				Format = FormatBinary;
+			else
 			{
-				printf( "%s - File too small to read thunk name from thunk\n", Path );
-				return 9;
+				printf( "Unknown format %s\n", pszFormat );
+				return 1;
 			}
-
-			Name[sizeof(Name) - 1] = 0;
-			ImportThunkNames.back().push_back( Name );
-			ThunkOffset += sizeof( IMAGE_THUNK_DATA );
+		}
+		else if ( 0 == strcmp( argv[argi], "--stats" ) )
+			bStats = true;
+		else if ( 0 == strcmp( argv[argi], "--stats-histogram" ) )
+			bStats = bHistogram = true;
+		else if ( 0 == strcmp( argv[argi], "--trace" ) && argi + 1 < argc )
+			pszTracePath = argv[++argi];
+		else if ( 0 == strcmp( argv[argi], "--similar" ) && argi + 1 < argc )
+			Similarity = atof( argv[++argi] );
+		else if ( 0 == strcmp( argv[argi], "--threads" ) && argi + 1 < argc )
+		{
+			int Threads = atoi( argv[++argi] );
+			numThreads = Threads > 0 ? (unsigned)Threads : std::max( 1u, std::thread::hardware_concurrency() );
+		}
+		else
+		{
+			printf( "Unknown option %s\n", argv[argi] );
+			return 1;
 		}
 	}
 
-	return 0;
-}
+	// The arguments of --merge are the streams to merge, and of --query the imports
+	if ( bMerge && argc - argi >= 1 )
+		return MergeResults( argc - argi, argv + argi );
 
-int main( int argc, char **argv )
-{
-	if ( argc < 4 )
+	if ( pszQuery && argc - argi >= 1 )
+		return QueryServer( pszQuery, argc - argi, argv + argi );
+
+	// With --files-from the imports follow the options, there is no directory or extension
+	int numPositional = pszList ? 0 : 2;
+
+	// Imports are optional with --imphash, every file is listed, not used by --similar or --serve, and come from the file with --queries
+	if ( bMerge || pszQuery || argc - argi < numPositional + ( bImphash || Similarity > 0.0 || pszServe || pszQueries || bFrequency ? 0 : 1 ) )
 	{
 		std::cout << "Import Finder - Finds all files which import any of the listed imports\n";
-		std::cout << "\timpfi <directory> <extension> [imports]\n";
+		std::cout << "\timpfi [options] <directory> <extensions> [imports]\n";
 		std::cout << "\timpfi \"C:\\Windows\\System32\\drivers\" .sys IoCreateDevice ZwOpenProcess\n";
+		std::cout << "Options\n";
+		std::cout << "\t--cache\t\tParse identical files once, keyed by size and a hash of their headers and import directory\n";
+		std::cout << "\t--files-from <file>\tScan the paths listed in the file, one per line, - for stdin, instead of a directory\n";
+		std::cout << "\t\timpfi --files-from - IoCreateDevice\n";
+		std::cout << "\t--exports\tAlso list files that export, or forward an export to, any of the listed imports\n";
+		std::cout << "\t--frequency\tCount the files importing each dll and function, and print the --top <k> (100, 0 for all) most imported\n";
+		std::cout << "\t--sketch <w>\tWith --frequency, count in a count-min sketch of 4 rows of w counters, in bounded memory\n";
+		std::cout << "\t--format <f>\tOutput format of the results, text (default), ndjson, csv, tsv or binary (see resultstream.h)\n";
+		std::cout << "\t--graph\t\tList files that reach the imports directly or through the dlls they import, exports are read too\n";
+		std::cout << "\t--imphash\tAdd the imphash of each file, lists every file when no imports are given\n";
+		std::cout << "\t--null\t\tPaths of --files-from are delimited by NULs, as find -print0 writes them\n";
+		std::cout << "\t--min-size <n>\tOnly scan files of at least n bytes, with an optional k, m or g suffix, --max-size for at most\n";
+		std::cout << "\t--newer <t>\tOnly scan files modified after t, a date, 2024-05-31 or 2024-05-31T13:45:00 (UTC), or a file, --older for before\n";
+		std::cout << "\t--merge <files>\tMerge binary results, e.g. of --shard runs, into one stream ordered by path on stdout\n";
+		std::cout << "\t--shard <i/N>\tOnly scan shard i (0 to N - 1) of N, by a stable hash of the path within the directory\n";
+		std::cout << "\t--query <name>\tSend the imports to a --serve process, and print a line per hit, path, kind, dll and name\n";
+		std::cout << "\t--queries <file>\tMatch the named queries of the file, a line each, \"<name> <import> [import&import ...]\", in one scan\n";
+		std::cout << "\t--serve <name>\tIndex the directory once, then answer --query clients on a named pipe\n";
+		std::cout << "\t--sniff\t\tAlso scan the files with no extension that start with MZ\n";
+		std::cout << "\t--similar <s>\tCluster files whose import sets are at least s (0 to 1) similar, by minhash\n";
+		std::cout << "\t--stats\t\tPrint file counts, rejections, I/O and time per stage to stderr at the end\n";
+		std::cout << "\t--stats-histogram\tAs --stats, with a histogram of the time taken per file\n";
+		std::cout << "\t--threads <n>\tNumber of files read at once, 0 for the number of processors, defaults to 1 so the order of the results is stable\n";
+		std::cout << "\t--trace <file>\tWrite a chrome trace of every file and stage on every worker, open it in ui.perfetto.dev\n";
+		std::cout << "\t--watch\t\tWith --serve, parse changed files again as the directory changes\n";
+		std::cout << "\t--zip\t\tAlso scan the members of the zip archives in the directory, in memory, as <archive>/<member>\n";
 		std::cout << "Note - Make sure that if there are spaces in the directory, place the argument in quotation marks.\n";
-		std::cout << "Note - You must also include the `.` in the extension.\n";
+		std::cout << "Note - You must also include the `.` in the extension, several are separated by commas, .sys,.dll,.exe\n";
 		return 0;
 	}
 
-	const char *const pszDirectory = argv[1];
-	const char *const pszExtension = argv[2];
-	int numImports = argc - 3;
-	const char *const *const ppszImports = argv + 3;
+	const char *const pszDirectory = pszList ? NULL : argv[argi];
+	Filter.bSniff = bSniff;
 
-	IMAGE_DOS_HEADER DosHeader;
-	IMAGE_NT_HEADERS NtHeaders;
-	std::vector<IMAGE_SECTION_HEADER> Sections;
-	std::vector<IMAGE_IMPORT_DESCRIPTOR> ImportDescriptors;
-	std::vector<std::string> ImportDllNames;
-	std::vector<std::vector<std::string>> ImportThunkNames;
-	std::string Path;
+	if ( !pszList )
+		ParseExtensions( argv[argi + 1], Filter.Extensions );
 
-	std::ostringstream oss;
-	std::ostringstream oss2;
-	int importCount = 0;
-	int numResults = 0;
-	long SizeInBytes;
+	int numImports = argc - argi - numPositional;
+	const char *const *const ppszImports = argv + argi + numPositional;
 
-	for ( const auto& dirEntry : std::filesystem::directory_iterator( pszDirectory ) )
+	if ( pszList && ( bWatch || bZip ) )
 	{
-		if ( dirEntry.path().extension() != pszExtension )
-			continue;
-
-		Path = dirEntry.path().generic_string();
+		printf( "--watch and --zip scan a directory, not a file list\n" );
+		return 1;
+	}
 
-		FILE *f = NULL;
-		if ( 0 != fopen_s( &f, Path.c_str(), "rb" ) || !f )
-			continue;
+	QuerySet Queries;
 
-		// ReadMagicNumber initializes e_magic
-		if ( 0 != ReadMagicNumber( f, Path.c_str(), &DosHeader ) )
+	if ( pszQueries )
+	{
+		if ( numImports || pszServe || bGraph || Similarity > 0.0 )
 		{
-			fclose( f );
-			continue;
+			printf( "--queries takes its imports from the file, and does not apply to --serve, --graph or --similar\n" );
+			return 1;
 		}
-		
-		// Checks NT headers signature, and checks architecture
-		if ( 0 != ReadNtHeaders( f, Path.c_str(), &DosHeader, &NtHeaders ) )
+
+		if ( !ReadQueryFile( pszQueries, Queries ) )
+			return 1;
+	}
+
+	if ( bFrequency && ( numImports || pszServe || bGraph || Similarity > 0.0 || pszQueries ) )
+	{
+		printf( "--frequency counts every import, it takes no imports, and does not apply to --serve, --graph, --similar or --queries\n" );
+		return 1;
+	}
+
+	if ( SketchWidth && ( !bFrequency || !TopK ) )
+	{
+		printf( "--sketch estimates the --top imports of --frequency, it can not list them all\n" );
+		return 1;
+	}
+
+	// A list is streamed to the workers as it is read when results are written as files finish
+	// The other modes need every path before they can start, so they read the whole list first
+	bool bStream = pszList && !pszServe && !bGraph && Similarity <= 0.0 && !bFrequency;
+	int List = pszList ? OpenPathList( pszList ) : -1;
+
+	if ( pszList && List < 0 )
+		return 1;
+
+	std::vector<ScanStats> Stats( bStats ? numThreads : 0 );
+	ScanStats *pStats = bStats ? Stats.data() : NULL;
+	std::vector<TraceRing> Traces( pszTracePath ? numThreads : 0 );
+	TraceRing *pTraces = pszTracePath ? Traces.data() : NULL;
+	ULONGLONG ScanStart = StatClock();
+
+	std::vector<std::string> Paths;
+	std::vector<FileId> Ids;
+	std::vector<long long> Sizes;		// From the listing, -1 when unknown
+	std::vector<ZipArchive> Archives;
+	std::vector<ZipMember> Members;
+	FileAliases Aliases;
+
+	// A list has no metadata, its paths are only stat'ed when there are limits to check
+	auto KeepListed = [&]( const std::string& Path, long long& Size )
+	{
+		long long Time;
+		Size = -1;
+		return !Filter.bMetadata || ( StatFile( Path, Size, Time ) && MatchFileMetadata( Filter, Size, Time ) );
+	};
+
+	if ( !pszList )
+	{
+		std::vector<char> Unsniffed;
+
+		EnumerateFiles( pszDirectory, Filter, Paths, Ids, Sizes, Unsniffed );
+
+		if ( bSniff )
+			SniffImages( numThreads, Paths, Ids, Sizes, Unsniffed );
+
+		if ( bZip )
+			EnumerateZipMembers( pszDirectory, Filter, Archives, Paths, Ids, Sizes, Members );
+	}
+	else if ( !bStream )
+	{
+		ReadPathList( List, bNull ? '\0' : '\n', [&]( std::string&& Path )
 		{
-			fclose( f );
-			continue;
+			long long Size;
+
+			if ( !KeepListed( Path, Size ) )
+				return;
+
+			Paths.push_back( std::move( Path ) );
+			Sizes.push_back( Size );
+		} );
+
+		// Listed paths are read as given, each on its own
+		Ids.assign( Paths.size(), { 0, 0 } );
+	}
+
+	if ( numShards )
+		SelectShard( Shard, numShards, pszList ? 0 : ScanRootLength( pszDirectory ), Paths, Ids, Sizes, Members );
+
+	FindAliases( Ids, Aliases );
+
+	if ( bStats )
+		Stats[0].FilesLinked = Aliases.numAliases;
+
+	if ( bStats )
+		Stats[0].StageTime[StageEnumerate] += StatClock() - ScanStart;
+
+	// The main thread is worker 0
+	if ( pTraces )
+	{
+		t_pTrace = pTraces;
+		TraceRecord( StageEnumerate, ScanStart, StatClock() - ScanStart );
+		t_pTrace = NULL;
+	}
+
+	std::vector<PeImage> Images( numThreads );
+	std::vector<ZipReader> ZipReaders( numThreads );
+	ImageCache Cache;
+	ImageCache *pCache = bCache ? &Cache : NULL;
+
+	if ( pszServe )
+	{
+		auto Start = std::chrono::steady_clock::now();
+		std::vector<ImportIndexShard> Shards( numThreads );
+
+		ParallelFor( Paths.size(), numThreads, pStats, pTraces, [&]( unsigned Worker, size_t Index )
+		{
+			if ( Aliases.bAlias[Index] )
+				return;
+
+			const PeImage *pImage;
+			long long SizeInBytes = Index < Sizes.size() ? Sizes[Index] : -1;
+			if ( !ReadScanPath( Archives, Members, Index, Paths[Index], bExports, pCache, &ZipReaders[Worker], Images[Worker], pImage, SizeInBytes ) )
+				return;
+
+			for ( size_t Alias = Index; Alias != NoAlias; Alias = Aliases.Next[Alias] )
+				AddToImportIndex( Shards[Worker], (DWORD)Alias, *pImage );
+		} );
+
+		Images.clear();
+
+		for ( ZipReader& Reader : ZipReaders )
+			CloseZipReader( Reader );
+
+		ZipReaders.clear();
+
+		ImportIndex Index;
+		Index.Paths = Paths;
+		BuildImportIndex( Shards, Index );
+
+		fprintf( stderr, "Import index - %zu file(s), %zu name(s), %lld ms\n", Index.Paths.size(), Index.Names.size(),
+			(long long)std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - Start ).count() );
+
+		if ( bStats )
+			PrintScanStats( Stats, StatClock() - ScanStart, bHistogram );
+
+		if ( bWatch )
+		{
+			for ( size_t i = 0; i < Index.Paths.size(); i++ )
+				Index.PathIds.emplace( Index.Paths[i], (DWORD)i );
+
+			std::thread( WatchDirectory, pszDirectory, Filter, bExports, Shard, numShards, std::ref( Index ) ).detach();
 		}
 
-		// Read sections for virtual address translation in the file
-		if ( 0 != ReadSections( f, Path.c_str(), &NtHeaders.FileHeader, Sections ) )
+		return ServeImportIndex( pszServe, Index );
+	}
+	else if ( bGraph )
+	{
+		auto Start = std::chrono::steady_clock::now();
+		std::vector<ImportGraphShard> Shards( numThreads );
+
+		ParallelFor( Paths.size(), numThreads, pStats, pTraces, [&]( unsigned Worker, size_t Index )
 		{
-			fclose( f );
-			continue;
+			if ( Aliases.bAlias[Index] )
+				return;
+
+			// Forwarders are needed to resolve imports through dlls in the tree
+			const PeImage *pImage;
+			long long SizeInBytes = Index < Sizes.size() ? Sizes[Index] : -1;
+			if ( !ReadScanPath( Archives, Members, Index, Paths[Index], true, pCache, &ZipReaders[Worker], Images[Worker], pImage, SizeInBytes ) )
+				return;
+
+			// Every path of the file is a binary in the graph
+			for ( size_t Alias = Index; Alias != NoAlias; Alias = Aliases.Next[Alias] )
+				AddToImportGraph( Shards[Worker], Alias, Paths[Alias], *pImage );
+		} );
+
+		Images.clear();
+
+		ImportGraph Graph;
+		BuildImportGraph( Shards, Graph );
+
+		auto Built = std::chrono::steady_clock::now();
+
+		std::cout << "Import graph - " << Graph.Merged.Binaries.size() << " file(s), " << Graph.Merged.Names.size() << " name(s), "
+			<< Graph.Merged.Imports.size() << " import(s), " << std::chrono::duration_cast<std::chrono::milliseconds>( Built - Start ).count() << " ms\n";
+
+		for ( int k = 0; k < numImports; k++ )
+		{
+			auto QueryStart = std::chrono::steady_clock::now();
+
+			std::cout << ppszImports[k] << '\n';
+			int numResults = QueryImportGraph( Graph, Paths, ppszImports[k] );
+
+			std::cout << ppszImports[k] << " - " << numResults << " file(s), "
+				<< std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - QueryStart ).count() << " us\n";
 		}
+	}
+	else if ( Similarity > 0.0 )
+	{
+		std::vector<MinHashSignature> Signatures( Paths.size() );
+		std::vector<char> Valid( Paths.size(), 0 );
 
-		// Read import descriptors and dll import names
-		if ( 0 != ReadImportDescriptors( f, Path.c_str(), &NtHeaders.FileHeader, &NtHeaders.OptionalHeader, Sections, ImportDescriptors, ImportDllNames, ImportThunkNames ) )
+		ParallelFor( Paths.size(), numThreads, pStats, pTraces, [&]( unsigned Worker, size_t Index )
 		{
-			fclose( f );
-			continue;
+			if ( Aliases.bAlias[Index] )
+				return;
+
+			const PeImage *pImage;
+			long long SizeInBytes = Index < Sizes.size() ? Sizes[Index] : -1;
+			if ( !ReadScanPath( Archives, Members, Index, Paths[Index], false, pCache, &ZipReaders[Worker], Images[Worker], pImage, SizeInBytes ) )
+				return;
+
+			// Files without imports have nothing to compare
+			Valid[Index] = 0 != ComputeMinHash( *pImage, Signatures[Index] );
+
+			for ( size_t Alias = Aliases.Next[Index]; Alias != NoAlias; Alias = Aliases.Next[Alias] )
+			{
+				Signatures[Alias] = Signatures[Index];
+				Valid[Alias] = Valid[Index];
+			}
+		} );
+
+		ClusterSimilarImages( Paths, Signatures, Valid, Similarity );
+	}
+	else if ( bFrequency )
+	{
+		std::vector<FrequencyShard> Shards( numThreads );
+		std::atomic<ULONGLONG> numFiles( 0 );
+
+		// The candidates a sketch keeps per worker, well above the pairs listed so a top pair is not dropped
+		size_t MaxCandidates = std::max<size_t>( 0x1000, TopK * 16 );
+
+		ParallelFor( Paths.size(), numThreads, pStats, pTraces, [&]( unsigned Worker, size_t Index )
+		{
+			if ( Aliases.bAlias[Index] )
+				return;
+
+			const PeImage *pImage;
+			long long SizeInBytes = Index < Sizes.size() ? Sizes[Index] : -1;
+			if ( !ReadScanPath( Archives, Members, Index, Paths[Index], false, pCache, &ZipReaders[Worker], Images[Worker], pImage, SizeInBytes ) )
+				return;
+
+			StageClock Clock;
+
+			// Every path of the file is a file importing its pairs
+			ULONGLONG Weight = 0;
+
+			for ( size_t Alias = Index; Alias != NoAlias; Alias = Aliases.Next[Alias] )
+				Weight++;
+
+			CountImportFrequencies( Shards[Worker], *pImage, Weight, SketchWidth, MaxCandidates );
+			numFiles += Weight;
+
+			Clock.Lap( StageMatch );
+		} );
+
+		ULONGLONG OutputStart = StatClock();
+
+		PrintImportFrequencies( Shards, SketchWidth, TopK, numFiles );
+
+		if ( bStats )
+			Stats[0].StageTime[StageOutput] += StatClock() - OutputStart;
+	}
+	else
+	{
+		std::mutex OutputLock;
+		std::atomic<int> numResults( 0 );
+		std::atomic<DWORD> NextString( 0 );
+		std::vector<OutputBuffer> Buffers( numThreads );
+		std::vector<std::vector<ImportHit>> Hits( numThreads );
+		std::vector<QueryMatch> Matches( pszQueries ? numThreads : 0 );
+
+		for ( unsigned i = 0; i < numThreads; i++ )
+		{
+			Buffers[i].Data.reserve( OutputBufferSize + 0x10000 );
+			Buffers[i].pNextString = &NextString;
 		}
 
-		// Bad C++
-		// Use two string streams to put the path BEFORE listing imports because we have to make sure it has the listed imports
-		oss.str("");
-		oss2.str("");
-		importCount = 0;
+		WriteHeader( Format, pszQueries != NULL );
 
-		// Probably a more efficient way to do this
-		for ( size_t i = 0; i < ImportThunkNames.size(); i++ )
+		// Size is the listed size of the file, -1 when it is not known
+		auto ScanFile = [&]( unsigned Worker, size_t Index, const std::string& Path, long long Size )
 		{
-			for ( size_t j = 0; j < ImportThunkNames[i].size(); j++ )
+			std::vector<ImportHit>& FileHits = Hits[Worker];
+
+			const PeImage *pImage;
+			long long SizeInBytes = Size;
+			if ( !ReadScanPath( Archives, Members, Index, Path, bExports, pCache, &ZipReaders[Worker], Images[Worker], pImage, SizeInBytes ) )
+				return;
+
+			const PeImage& Image = *pImage;
+
+			StageClock Clock;
+			FileHits.clear();
+
+			if ( pszQueries )
 			{
-				// Loop thru imports
-				for ( int k = 0; k < numImports; k++ )
+				// The imports of every query are matched at once, then the hits are split by query
+				MatchThunkNames( Image.ImportThunkNames, Queries.Set, HitImport, FileHits );
+				MatchThunkNames( Image.DelayImportThunkNames, Queries.Set, HitDelayLoad, FileHits );
+
+				if ( bExports )
+					MatchExportNames( Image.ExportNames, Image.ExportForwarders, Queries.Set, FileHits );
+
+				QueryMatch& Match = Matches[Worker];
+				MatchQueries( Queries, FileHits, Match );
+
+				Clock.Lap( StageMatch );
+
+				if ( Match.Matched.empty() )
+					return;
+
+				uint8_t Imphash[16];
+
+				if ( bImphash )
+					ComputeImphash( Image, Imphash );
+
+				// A result for each query that matched, for each path of the file
+				for ( size_t Alias = Index; Alias != NoAlias; Alias = bStream ? NoAlias : Aliases.Next[Alias] )
 				{
-					if ( 0 == ImportThunkNames[i][j].compare( ppszImports[k] ) )
+					for ( int Query : Match.Matched )
 					{
-						if ( numImports > 1 )
-							oss << '\t' << ppszImports[k] << '\n';
-						importCount++;
+						const ImportQuery& Matched = Queries.Queries[Query];
+						AppendResult( Buffers[Worker], Format, numResults++, Alias == Index ? Path : Paths[Alias], SizeInBytes, Image, Match.Hits[Query], Matched.numImports, Queries.Imports.data(), bImphash ? Imphash : NULL, Matched.Name.c_str() );
 					}
+
+					if ( Buffers[Worker].Data.size() >= OutputBufferSize )
+						FlushOutput( Buffers[Worker], OutputLock );
+
+					if ( t_pStats )
+						t_pStats->FilesMatched++;
 				}
+
+				Clock.Lap( StageOutput );
+				return;
 			}
-		}
 
-		// If there are any imports, name the path, then list the imports
-		if ( importCount )
+			int importCount = MatchThunkNames( Image.ImportThunkNames, numImports, ppszImports, HitImport, FileHits );
+			importCount += MatchThunkNames( Image.DelayImportThunkNames, numImports, ppszImports, HitDelayLoad, FileHits );
+			int exportCount = bExports ? MatchExportNames( Image.ExportNames, Image.ExportForwarders, numImports, ppszImports, FileHits ) : 0;
+
+			Clock.Lap( StageMatch );
+
+			// If there are any imports, name the path, then list the imports
+			if ( importCount || exportCount || !numImports )
+			{
+				uint8_t Imphash[16];
+
+				if ( bImphash )
+					ComputeImphash( Image, Imphash );
+
+				// One result for each path of the file, a streamed list has no other paths
+				for ( size_t Alias = Index; Alias != NoAlias; Alias = bStream ? NoAlias : Aliases.Next[Alias] )
+				{
+					AppendResult( Buffers[Worker], Format, numResults++, Alias == Index ? Path : Paths[Alias], SizeInBytes, Image, FileHits, numImports, ppszImports, bImphash ? Imphash : NULL, NULL );
+
+					if ( Buffers[Worker].Data.size() >= OutputBufferSize )
+						FlushOutput( Buffers[Worker], OutputLock );
+
+					if ( t_pStats )
+						t_pStats->FilesMatched++;
+				}
+
+				Clock.Lap( StageOutput );
+			}
+		};
+
+		if ( bStream )
 		{
-			rewind( f );
-			fseek( f, 0, SEEK_END );
-			SizeInBytes = ftell( f );
+			PathQueue Queue;
+			std::vector<std::string> Claimed( numThreads );
+			std::vector<long long> ClaimedSizes( numThreads );
+
+			// Paths is only touched by the reader until it is joined
+			std::thread Reader( [&]()
+			{
+				ReadPathList( List, bNull ? '\0' : '\n', [&]( std::string&& Path )
+				{
+					long long Size;
+
+					if ( ( numShards && ShardOfPath( Path, numShards ) != Shard ) || !KeepListed( Path, Size ) )
+						return;
+
+					{
+						std::lock_guard<std::mutex> Guard( Queue.Lock );
+						Queue.Pending.push_back( { Paths.size(), Path, Size } );
+					}
+
+					Queue.Ready.notify_one();
+					Paths.push_back( std::move( Path ) );
+				} );
 
-			oss2 << numResults++ << " - " << Path << " (" << SizeInBytes / 1024.f << " kb)" << ", " << importCount << " import(s) found\n";
-			oss2 << oss.str();
-			std::cout << oss2.str();
+				std::lock_guard<std::mutex> Guard( Queue.Lock );
+				Queue.bDone = true;
+				Queue.Ready.notify_all();
+			} );
+
+			ParallelClaim( numThreads, pStats, pTraces, [&]( unsigned Worker, size_t& Index )
+			{
+				return ClaimQueuedPath( Queue, Index, Claimed[Worker], ClaimedSizes[Worker] );
+			}, [&]( unsigned Worker, size_t Index )
+			{
+				ScanFile( Worker, Index, Claimed[Worker], ClaimedSizes[Worker] );
+			} );
+
+			Reader.join();
+		}
+		else
+		{
+			ParallelFor( Paths.size(), numThreads, pStats, pTraces, [&]( unsigned Worker, size_t Index )
+			{
+				if ( !Aliases.bAlias[Index] )
+					ScanFile( Worker, Index, Paths[Index], Index < Sizes.size() ? Sizes[Index] : -1 );
+			} );
 		}
 
-		fclose( f );
+		ULONGLONG FlushStart = StatClock();
+
+		for ( OutputBuffer& Buffer : Buffers )
+			FlushOutput( Buffer, OutputLock );
+
+		if ( bStats )
+			Stats[0].StageTime[StageOutput] += StatClock() - FlushStart;
 	}
+
+	for ( ZipReader& Reader : ZipReaders )
+		CloseZipReader( Reader );
+
+	fflush( stdout );
+
+	if ( bStats )
+		PrintScanStats( Stats, StatClock() - ScanStart, bHistogram );
+
+	if ( pszTracePath )
+		return WriteTrace( pszTracePath, Traces, Paths, ScanStart );
+
+	return 0;
 }
@@ -0,0 +1,204 @@
+#include "md5.h"
+
+#include <string.h>
+
+#define MD5_F( x, y, z ) ( (z) ^ ( (x) & ( (y) ^ (z) ) ) )
+#define MD5_G( x, y, z ) ( (y) ^ ( (z) & ( (x) ^ (y) ) ) )
+#define MD5_H( x, y, z ) ( (x) ^ (y) ^ (z) )
+#define MD5_I( x, y, z ) ( (y) ^ ( (x) | ~(z) ) )
+
+#define MD5_STEP( f, a, b, c, d, x, t, s ) \
+	(a) += f( (b), (c), (d) ) + (x) + (t); \
+	(a) = ( ( (a) << (s) ) | ( (a) >> ( 32 - (s) ) ) ) + (b);
+
+// Process whole 64 byte blocks, the rounds are unrolled so every constant is an immediate
+static void
+Md5Blocks(
+	uint32_t State[4],
+	const uint8_t *Data,
+	size_t NumBlocks
+)
+{
+	uint32_t a = State[0], b = State[1], c = State[2], d = State[3];
+	uint32_t x[16];
+
+	for ( ; NumBlocks; NumBlocks--, Data += 64 )
+	{
+		// Little endian loads
+		for ( int i = 0; i < 16; i++ )
+			x[i] = (uint32_t)Data[i * 4] | ( (uint32_t)Data[i * 4 + 1] << 8 ) | ( (uint32_t)Data[i * 4 + 2] << 16 ) | ( (uint32_t)Data[i * 4 + 3] << 24 );
+
+		uint32_t aa = a, bb = b, cc = c, dd = d;
+
+		MD5_STEP( MD5_F, a, b, c, d, x[0], 0xd76aa478, 7 )
+		MD5_STEP( MD5_F, d, a, b, c, x[1], 0xe8c7b756, 12 )
+		MD5_STEP( MD5_F, c, d, a, b, x[2], 0x242070db, 17 )
+		MD5_STEP( MD5_F, b, c, d, a, x[3], 0xc1bdceee, 22 )
+		MD5_STEP( MD5_F, a, b, c, d, x[4], 0xf57c0faf, 7 )
+		MD5_STEP( MD5_F, d, a, b, c, x[5], 0x4787c62a, 12 )
+		MD5_STEP( MD5_F, c, d, a, b, x[6], 0xa8304613, 17 )
+		MD5_STEP( MD5_F, b, c, d, a, x[7], 0xfd469501, 22 )
+		MD5_STEP( MD5_F, a, b, c, d, x[8], 0x698098d8, 7 )
+		MD5_STEP( MD5_F, d, a, b, c, x[9], 0x8b44f7af, 12 )
+		MD5_STEP( MD5_F, c, d, a, b, x[10], 0xffff5bb1, 17 )
+		MD5_STEP( MD5_F, b, c, d, a, x[11], 0x895cd7be, 22 )
+		MD5_STEP( MD5_F, a, b, c, d, x[12], 0x6b901122, 7 )
+		MD5_STEP( MD5_F, d, a, b, c, x[13], 0xfd987193, 12 )
+		MD5_STEP( MD5_F, c, d, a, b, x[14], 0xa679438e, 17 )
+		MD5_STEP( MD5_F, b, c, d, a, x[15], 0x49b40821, 22 )
+
+		MD5_STEP( MD5_G, a, b, c, d, x[1], 0xf61e2562, 5 )
+		MD5_STEP( MD5_G, d, a, b, c, x[6], 0xc040b340, 9 )
+		MD5_STEP( MD5_G, c, d, a, b, x[11], 0x265e5a51, 14 )
+		MD5_STEP( MD5_G, b, c, d, a, x[0], 0xe9b6c7aa, 20 )
+		MD5_STEP( MD5_G, a, b, c, d, x[5], 0xd62f105d, 5 )
+		MD5_STEP( MD5_G, d, a, b, c, x[10], 0x02441453, 9 )
+		MD5_STEP( MD5_G, c, d, a, b, x[15], 0xd8a1e681, 14 )
+		MD5_STEP( MD5_G, b, c, d, a, x[4], 0xe7d3fbc8, 20 )
+		MD5_STEP( MD5_G, a, b, c, d, x[9], 0x21e1cde6, 5 )
+		MD5_STEP( MD5_G, d, a, b, c, x[14], 0xc33707d6, 9 )
+		MD5_STEP( MD5_G, c, d, a, b, x[3], 0xf4d50d87, 14 )
+		MD5_STEP( MD5_G, b, c, d, a, x[8], 0x455a14ed, 20 )
+		MD5_STEP( MD5_G, a, b, c, d, x[13], 0xa9e3e905, 5 )
+		MD5_STEP( MD5_G, d, a, b, c, x[2], 0xfcefa3f8, 9 )
+		MD5_STEP( MD5_G, c, d, a, b, x[7], 0x676f02d9, 14 )
+		MD5_STEP( MD5_G, b, c, d, a, x[12], 0x8d2a4c8a, 20 )
+
+		MD5_STEP( MD5_H, a, b, c, d, x[5], 0xfffa3942, 4 )
+		MD5_STEP( MD5_H, d, a, b, c, x[8], 0x8771f681, 11 )
+		MD5_STEP( MD5_H, c, d, a, b, x[11], 0x6d9d6122, 16 )
+		MD5_STEP( MD5_H, b, c, d, a, x[14], 0xfde5380c, 23 )
+		MD5_STEP( MD5_H, a, b, c, d, x[1], 0xa4beea44, 4 )
+		MD5_STEP( MD5_H, d, a, b, c, x[4], 0x4bdecfa9, 11 )
+		MD5_STEP( MD5_H, c, d, a, b, x[7], 0xf6bb4b60, 16 )
+		MD5_STEP( MD5_H, b, c, d, a, x[10], 0xbebfbc70, 23 )
+		MD5_STEP( MD5_H, a, b, c, d, x[13], 0x289b7ec6, 4 )
+		MD5_STEP( MD5_H, d, a, b, c, x[0], 0xeaa127fa, 11 )
+		MD5_STEP( MD5_H, c, d, a, b, x[3], 0xd4ef3085, 16 )
+		MD5_STEP( MD5_H, b, c, d, a, x[6], 0x04881d05, 23 )
+		MD5_STEP( MD5_H, a, b, c, d, x[9], 0xd9d4d039, 4 )
+		MD5_STEP( MD5_H, d, a, b, c, x[12], 0xe6db99e5, 11 )
+		MD5_STEP( MD5_H, c, d, a, b, x[15], 0x1fa27cf8, 16 )
+		MD5_STEP( MD5_H, b, c, d, a, x[2], 0xc4ac5665, 23 )
+
+		MD5_STEP( MD5_I, a, b, c, d, x[0], 0xf4292244, 6 )
+		MD5_STEP( MD5_I, d, a, b, c, x[7], 0x432aff97, 10 )
+		MD5_STEP( MD5_I, c, d, a, b, x[14], 0xab9423a7, 15 )
+		MD5_STEP( MD5_I, b, c, d, a, x[5], 0xfc93a039, 21 )
+		MD5_STEP( MD5_I, a, b, c, d, x[12], 0x655b59c3, 6 )
+		MD5_STEP( MD5_I, d, a, b, c, x[3], 0x8f0ccc92, 10 )
+		MD5_STEP( MD5_I, c, d, a, b, x[10], 0xffeff47d, 15 )
+		MD5_STEP( MD5_I, b, c, d, a, x[1], 0x85845dd1, 21 )
+		MD5_STEP( MD5_I, a, b, c, d, x[8], 0x6fa87e4f, 6 )
+		MD5_STEP( MD5_I, d, a, b, c, x[15], 0xfe2ce6e0, 10 )
+		MD5_STEP( MD5_I, c, d, a, b, x[6], 0xa3014314, 15 )
+		MD5_STEP( MD5_I, b, c, d, a, x[13], 0x4e0811a1, 21 )
+		MD5_STEP( MD5_I, a, b, c, d, x[4], 0xf7537e82, 6 )
+		MD5_STEP( MD5_I, d, a, b, c, x[11], 0xbd3af235, 10 )
+		MD5_STEP( MD5_I, c, d, a, b, x[2], 0x2ad7d2bb, 15 )
+		MD5_STEP( MD5_I, b, c, d, a, x[9], 0xeb86d391, 21 )
+
+		a += aa;
+		b += bb;
+		c += cc;
+		d += dd;
+	}
+
+	State[0] = a;
+	State[1] = b;
+	State[2] = c;
+	State[3] = d;
+}
+
+void
+Md5Init(
+	Md5Context *Context
+)
+{
+	Context->State[0] = 0x67452301;
+	Context->State[1] = 0xefcdab89;
+	Context->State[2] = 0x98badcfe;
+	Context->State[3] = 0x10325476;
+	Context->Length = 0;
+}
+
+void
+Md5Update(
+	Md5Context *Context,
+	const void *Data,
+	size_t Size
+)
+{
+	const uint8_t *Bytes = (const uint8_t *)Data;
+	size_t Used = (size_t)( Context->Length & 63 );
+
+	Context->Length += Size;
+
+	// Top up a partial block first
+	if ( Used )
+	{
+		size_t Fill = 64 - Used;
+
+		if ( Size < Fill )
+		{
+			memcpy( Context->Buffer + Used, Bytes, Size );
+			return;
+		}
+
+		memcpy( Context->Buffer + Used, Bytes, Fill );
+		Md5Blocks( Context->State, Context->Buffer, 1 );
+		Bytes += Fill;
+		Size -= Fill;
+	}
+
+	// Hash whole blocks straight from the input
+	Md5Blocks( Context->State, Bytes, Size / 64 );
+	Bytes += Size & ~(size_t)63;
+	Size &= 63;
+
+	memcpy( Context->Buffer, Bytes, Size );
+}
+
+void
+Md5Final(
+	Md5Context *Context,
+	uint8_t Digest[16]
+)
+{
+	uint64_t Bits = Context->Length * 8;
+	size_t Used = (size_t)( Context->Length & 63 );
+	uint8_t Padding[72] = { 0x80 };
+
+	// Pad to 56 bytes into a block, then append the length in bits
+	size_t PadSize = ( Used < 56 ? 56 : 120 ) - Used;
+
+	for ( int i = 0; i < 8; i++ )
+		Padding[PadSize + i] = (uint8_t)( Bits >> ( i * 8 ) );
+
+	Md5Update( Context, Padding, PadSize + 8 );
+
+	for ( int i = 0; i < 4; i++ )
+	{
+		Digest[i * 4] = (uint8_t)Context->State[i];
+		Digest[i * 4 + 1] = (uint8_t)( Context->State[i] >> 8 );
+		Digest[i * 4 + 2] = (uint8_t)( Context->State[i] >> 16 );
+		Digest[i * 4 + 3] = (uint8_t)( Context->State[i] >> 24 );
+	}
+}
+
+void
+Md5Hex(
+	const uint8_t Digest[16],
+	char *Hex
+)
+{
+	static const char Digits[] = "0123456789abcdef";
+
+	for ( int i = 0; i < 16; i++ )
+	{
+		Hex[i * 2] = Digits[Digest[i] >> 4];
+		Hex[i * 2 + 1] = Digits[Digest[i] & 15];
+	}
+
+	Hex[32] = 0;
+}
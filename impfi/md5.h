@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// MD5 (RFC 1321), only used for imphash, so inputs are a few hundred bytes per file
+struct Md5Context
+{
+	uint32_t State[4];
+	uint64_t Length;
+	uint8_t Buffer[64];
+};
+
+void
+Md5Init(
+	Md5Context *Context
+);
+
+void
+Md5Update(
+	Md5Context *Context,
+	const void *Data,
+	size_t Size
+);
+
+void
+Md5Final(
+	Md5Context *Context,
+	uint8_t Digest[16]
+);
+
+// Write the lower case hex of the digest, Hex must hold 33 characters
+void
+Md5Hex(
+	const uint8_t Digest[16],
+	char *Hex
+);
@@ -0,0 +1,1302 @@
+#include "peimage.h"
+#include "scanstats.h"
+#include "imagecache.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+
+const char *const ScanStageNames[NumScanStages] = { "enumerate", "open", "headers", "sections", "imports", "match", "output" };
+
+// Indexed by the return value of ReadImage - 1, and by the return value of the function
+const char *const RejectNames[NumRejectFunctions] = { "ReadMagicNumber", "ReadNtHeaders", "ReadSections", "ReadImportDescriptors", "ReadDelayImportDescriptors", "ReadExportDirectory" };
+
+// The diagnostic of each return value of each function, NULL when it is not reported
+const char *const RejectMessages[NumRejectFunctions][NumRejectCodes] =
+{
+	{
+		NULL,
+		"Too small to read magic number from DOS header",
+		"Incorrect magic number from DOS header"
+	},
+	{
+		NULL,
+		"DOS header incomplete after magic number",
+		"NT header not found",
+		"NT headers incomplete",
+		"Incorrect NT header signature",
+		NULL,	// Architectures that are not targeted are ignored silently
+		"Optional header magic number is inconsistent with NT header architecture, corrupted?"
+	},
+	{
+		NULL,
+		"Corrupted section"
+	},
+	{
+		NULL,
+		"Import descriptor not found",
+		"File too small to read import descriptor",
+		"Import descriptor name not found",
+		"File too small to read import descriptor name",
+		"Import descriptor first thunk not found",
+		"File too small to read first thunk from file descriptor",
+		"Thunk name not found",
+		"File too small to read thunk hint from thunk name",
+		"File too small to read thunk name from thunk"
+	},
+	{
+		NULL,
+		"Delay import descriptor not found",
+		"File too small to read delay import descriptor",
+		"Delay import descriptor name not found",
+		"File too small to read delay import descriptor name",
+		"Delay import name table not found",
+		"Delay import thunk not found",
+		"File too small to read delay import thunk",
+		"Delay import thunk name not found",
+		"File too small to read delay import thunk name"
+	},
+	{
+		NULL,
+		"Export directory not found",
+		"File too small to read export directory",
+		"Export directory corrupted",
+		"Export address table not found",
+		"Export name table not found",
+		"Export ordinal table not found",
+		"Export name not found",
+		"File too small to read export name",
+		"Export forwarder not found",
+		"File too small to read export forwarder"
+	}
+};
+
+thread_local ScanStats *t_pStats = NULL;
+
+thread_local TraceRing *t_pTrace = NULL;
+thread_local size_t t_TraceFile = TraceNoFile;
+
+ULONGLONG
+StatClock()
+{
+	return (ULONGLONG)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void
+TraceRecord(
+	int Stage,
+	ULONGLONG Start,
+	ULONGLONG Duration
+)
+{
+	TraceRing *Ring = t_pTrace;
+	ULONGLONG Head = Ring->Head.load( std::memory_order_relaxed );
+
+	// The ring only grows as far as it is used, short scans do not pay for the whole capacity
+	if ( Head < TraceRingCapacity )
+		Ring->Spans.push_back( { Start, Duration, t_TraceFile, Stage } );
+	else
+		Ring->Spans[Head % TraceRingCapacity] = { Start, Duration, t_TraceFile, Stage };
+
+	// Rings are read once their worker has finished
+	Ring->Head.store( Head + 1, std::memory_order_release );
+}
+
+// fread and fseek, counted for --stats
+size_t
+StatRead(
+	void *Buffer,
+	size_t Size,
+	size_t Count,
+	FILE *f
+)
+{
+	size_t Result = fread( Buffer, Size, Count, f );
+
+	if ( t_pStats )
+	{
+		t_pStats->Reads++;
+		t_pStats->BytesRead += Result * Size;
+	}
+
+	return Result;
+}
+
+int
+StatSeek(
+	FILE *f,
+	long Offset,
+	int Origin
+)
+{
+	if ( t_pStats )
+		t_pStats->Seeks++;
+
+	return fseek( f, Offset, Origin );
+}
+
+size_t
+StatRead(
+	void *Buffer,
+	size_t Size,
+	size_t Count,
+	PeSource *f
+)
+{
+	// Charged for what is asked, so a read that fails still costs
+	size_t Cost = Size * Count + ReadCost;
+
+	if ( Cost > f->Budget )
+	{
+		f->Budget = 0;
+		return 0;
+	}
+
+	f->Budget -= Cost;
+
+	if ( f->File )
+		return StatRead( Buffer, Size, Count, f->File );
+
+	// Whole elements only, as much of the buffer as is left
+	size_t Left = f->Offset < f->Size ? f->Size - f->Offset : 0;
+	size_t Result = Size ? std::min( Count, Left / Size ) : 0;
+
+	memcpy( Buffer, f->Data + f->Offset, Result * Size );
+	f->Offset += Result * Size;
+
+	if ( t_pStats )
+	{
+		t_pStats->Reads++;
+		t_pStats->BytesRead += Result * Size;
+	}
+
+	return Result;
+}
+
+int
+StatSeek(
+	PeSource *f,
+	long Offset,
+	int Origin
+)
+{
+	if ( ReadCost > f->Budget )
+	{
+		f->Budget = 0;
+		return -1;
+	}
+
+	f->Budget -= ReadCost;
+
+	if ( f->File )
+		return StatSeek( f->File, Offset, Origin );
+
+	if ( t_pStats )
+		t_pStats->Seeks++;
+
+	long long Base = Origin == SEEK_CUR ? (long long)f->Offset : Origin == SEEK_END ? (long long)f->Size : 0;
+
+	// Seeking past the end succeeds as it does for a file, the next read fails
+	if ( Base + Offset < 0 )
+		return -1;
+
+	f->Offset = (size_t)( Base + Offset );
+	return 0;
+}
+
+// Count iterations of the reader's loops for impfifuzz, which checks that they stay linear in the size of the file
+static void
+CountSteps(
+	ULONGLONG numSteps
+)
+{
+	if ( t_pStats )
+		t_pStats->Steps += numSteps;
+}
+
+// Name an import by ordinal as forwarders name it, "#123", built in place so it comes from the image's memory resource
+static void
+AppendOrdinalName(
+	PeNames& Names,
+	ULONGLONG Ordinal
+)
+{
+	char Digits[8];
+	std::to_chars_result Result = std::to_chars( Digits, Digits + sizeof( Digits ), (unsigned)( Ordinal & 0xffff ) );
+
+	PeName& Name = Names.emplace_back();
+	Name += '#';
+	Name.append( Digits, Result.ptr );
+}
+
+// Names are read from a file a chunk at a time, most fit in the first
+const size_t NameChunkSize = 64;
+
+// Read the NUL terminated name at the current position, of any length up to MaxNameLength
+// A buffer is searched in place, and charged for as far as it was searched
+// Returns 0, 1 when the name is not terminated before the end of the image, or PeErrorLimit when it is too long
+static int
+ReadName(
+	PeSource *f,
+	PeName& Name
+)
+{
+	Name.clear();
+
+	if ( f->File )
+	{
+		char Chunk[NameChunkSize];
+
+		for ( ;; )
+		{
+			CountSteps( 1 );
+
+			size_t Result = StatRead( Chunk, 1, sizeof( Chunk ), f );
+			const char *End = (const char *)memchr( Chunk, 0, Result );
+
+			Name.append( Chunk, End ? End - Chunk : Result );
+
+			if ( Name.size() > MaxNameLength )
+				return PeErrorLimit;
+
+			if ( End )
+				return 0;
+
+			if ( Result < sizeof( Chunk ) )
+				return 1;
+		}
+	}
+
+	size_t Left = f->Offset < f->Size ? f->Size - f->Offset : 0;
+	size_t Window = std::min( Left, MaxNameLength + 1 );
+	const uint8_t *Start = f->Data + f->Size - Left;
+	const uint8_t *End = (const uint8_t *)memchr( Start, 0, Window );
+	size_t Length = End ? End - Start + 1 : Window;
+
+	if ( Length + ReadCost > f->Budget )
+	{
+		f->Budget = 0;
+		return 1;
+	}
+
+	f->Budget -= Length + ReadCost;
+
+	if ( t_pStats )
+	{
+		t_pStats->Reads++;
+		t_pStats->BytesRead += Length;
+	}
+
+	if ( !End )
+		return Window > MaxNameLength ? PeErrorLimit : 1;
+
+	Name.assign( (const char *)Start, Length - 1 );
+	f->Offset += Length;
+
+	return 0;
+}
+
+int
+ReadMagicNumber(
+	PeSource *f,
+	IMAGE_DOS_HEADER *DosHeader
+)
+{
+	DosHeader->e_magic = 0;
+
+	// Read magic number
+	if ( 1 != StatRead( &DosHeader->e_magic, sizeof( DosHeader->e_magic ), 1, f ) )
+		return 1;
+
+	// Check 'MZ' signature
+	if ( DosHeader->e_magic != 'ZM' )
+		return 2;
+
+	return 0;
+}
+
+int
+ReadNtHeaders(
+	PeSource *f,
+	IMAGE_DOS_HEADER *DosHeader,
+	IMAGE_NT_HEADERS *NtHeaders
+)
+{
+	// Initialize the rest of the header
+	memset( &DosHeader->e_cblp, 0, sizeof( *DosHeader ) - sizeof( DosHeader->e_magic ) );
+
+	// Read the rest of the header
+	if ( 1 != StatRead( &DosHeader->e_cblp, sizeof( *DosHeader ) - sizeof( DosHeader->e_magic ), 1, f ) )
+		return 1;
+
+	// Seek to the NT header offset from the beginning of the file
+	if ( 0 != StatSeek( f, DosHeader->e_lfanew, SEEK_SET ) )
+		return 2;
+
+	// Read the NT header
+	if ( 1 != StatRead( NtHeaders, sizeof( *NtHeaders ), 1, f ) )
+		return 3;
+
+	// Check 'PE' signature
+	if ( NtHeaders->Signature != 'EP' )
+		return 4;
+
+	// Check architecture
+#ifdef _M_X64
+	if ( NtHeaders->FileHeader.Machine != IMAGE_FILE_MACHINE_AMD64 )
+#elif _M_IA64
+	if ( NtHeaders->FileHeader.Machine != IMAGE_FILE_MACHINE_IA64 )
+#else
+	if ( NtHeaders->FileHeader.Machine != IMAGE_FILE_MACHINE_I386 )
+#endif
+	{
+		// Fail silently to ignore architectures that are not targeted
+		return 5;
+	}
+
+	if ( NtHeaders->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR_MAGIC )
+		return 6;
+
+	return 0;
+}
+
+int
+ReadSections(
+	PeSource *f,
+	IMAGE_FILE_HEADER *DosHeader,
+	PeSections& Sections
+)
+{
+	Sections.clear();
+
+	if ( DosHeader->NumberOfSections > MaxSections )
+		return PeErrorLimit;
+
+	IMAGE_SECTION_HEADER SectionHeader;
+
+	for ( WORD i = 0; i < DosHeader->NumberOfSections; i++ )
+	{
+		CountSteps( 1 );
+
+		memset( &SectionHeader, 0, sizeof( SectionHeader ) );
+
+		if ( 1 != StatRead( &SectionHeader, sizeof( SectionHeader ), 1, f ) )
+			return 1;
+
+		Sections.push_back( SectionHeader );
+	}
+
+	return 0;
+}
+
+// Search all sections for the given relative virtual address
+DWORD
+SectionRvaFileOffset( 
+	IMAGE_FILE_HEADER *FileHeader,
+	const PeSections& Sections,
+	DWORD Rva 
+)
+{
+	// At most one pass over the sections
+	CountSteps( FileHeader->NumberOfSections );
+
+	for ( WORD i = 0; i < FileHeader->NumberOfSections; i++ )
+	{
+		DWORD VirtualAddress = Sections[i].VirtualAddress;
+		DWORD Delta = Rva - VirtualAddress;
+
+		// Compared as a delta so a section at the top of the address space does not wrap around
+		if ( VirtualAddress <= Rva && Delta < Sections[i].Misc.VirtualSize )
+		{
+			// The part of the section past its raw data is not in the file
+			if ( Delta >= Sections[i].SizeOfRawData || Sections[i].PointerToRawData > MAXDWORD - Delta )
+				return 0;
+
+			return Delta + Sections[i].PointerToRawData;
+		}
+	}
+
+	return 0;
+}
+
+// Enumerate import descriptors
+// This could be refactored
+int
+ReadImportDescriptors(
+	PeSource *f,
+	IMAGE_FILE_HEADER *FileHeader,
+	IMAGE_OPTIONAL_HEADER *OptionalHeader,
+	const PeSections& Sections,
+	std::pmr::vector<IMAGE_IMPORT_DESCRIPTOR>& ImportDescriptors,
+	PeNames& ImportDllNames,
+	PeNamesByDll& ImportThunkNames
+)
+{
+	ImportDescriptors.clear();
+	ImportDllNames.clear();
+	ImportThunkNames.clear();
+
+	IMAGE_DATA_DIRECTORY *Directory = &OptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+
+	// An image without imports has no directory, the size counts the empty descriptor that ends the table
+	if ( !Directory->VirtualAddress || Directory->Size < sizeof( IMAGE_IMPORT_DESCRIPTOR ) )
+		return 0;
+
+	DWORD NumberOfEntries = Directory->Size / sizeof( IMAGE_IMPORT_DESCRIPTOR ) - 1;
+	DWORD Offset = SectionRvaFileOffset( FileHeader, Sections, Directory->VirtualAddress );
+
+	if ( !Offset || 0 != StatSeek( f, (long)Offset, SEEK_SET ) )
+		return 1;
+
+	IMAGE_IMPORT_DESCRIPTOR Descriptor;
+	const IMAGE_IMPORT_DESCRIPTOR Empty = {};
+
+	for ( DWORD i = 0; i < NumberOfEntries; i++ )
+	{
+		CountSteps( 1 );
+
+		memset( &Descriptor, 0, sizeof( Descriptor ) );
+
+		if ( 1 != StatRead( &Descriptor, sizeof( Descriptor ), 1, f ) )
+			return 2;
+
+		// The table can end before the size says
+		if ( 0 == memcmp( &Descriptor, &Empty, sizeof( Descriptor ) ) )
+			break;
+
+		if ( ImportDescriptors.size() == MaxImportDescriptors )
+			return PeErrorLimit;
+
+		ImportDescriptors.push_back( Descriptor );
+	}
+	
+	IMAGE_THUNK_DATA Thunk;
+	IMAGE_IMPORT_BY_NAME ImportName;
+	DWORD ThunkOffset;
+	int Result;
+
+	for ( size_t i = 0; i < ImportDescriptors.size(); i++ )
+	{
+		CountSteps( 1 );
+
+		Offset = SectionRvaFileOffset( FileHeader, Sections, ImportDescriptors[i].Name );
+
+		if ( !Offset || 0 != StatSeek( f, (long)Offset, SEEK_SET ) )
+			return 3;
+
+		// Names are read straight into the list, whatever their length
+		ImportDllNames.emplace_back();
+
+		if ( 0 != ( Result = ReadName( f, ImportDllNames.back() ) ) )
+			return Result == PeErrorLimit ? Result : 4;
+
+		// The import name table is never overwritten by binding, fall back to the address table when it is missing
+		ThunkOffset = SectionRvaFileOffset( FileHeader, Sections, ImportDescriptors[i].OriginalFirstThunk ? ImportDescriptors[i].OriginalFirstThunk : ImportDescriptors[i].FirstThunk );
+		ImportThunkNames.push_back({});
+
+		// A table outside the file has no names to read
+		if ( !ThunkOffset )
+			continue;
+
+		for ( DWORD numThunks = 0; ; numThunks++ )
+		{
+			CountSteps( 1 );
+
+			if ( numThunks == MaxThunksPerDll )
+				return PeErrorLimit;
+
+			if ( 0 != StatSeek( f, (long)ThunkOffset, SEEK_SET ) )
+				return 5;
+
+			if ( 1 != StatRead( &Thunk, sizeof( Thunk ), 1, f ) )
+				return 6;
+
+			if ( !Thunk.u1.AddressOfData )
+				break;
+
+			// Imports by ordinal are named like forwarders name them, "#123"
+			if ( IMAGE_SNAP_BY_ORDINAL( Thunk.u1.Ordinal ) )
+			{
+				AppendOrdinalName( ImportThunkNames.back(), Thunk.u1.Ordinal );
+				ThunkOffset += sizeof( IMAGE_THUNK_DATA );
+				continue;
+			}
+
+			Offset = SectionRvaFileOffset( FileHeader, Sections, (DWORD)Thunk.u1.AddressOfData );
+
+			// A bound address table holds addresses rather than names, which are not in any section, so the table ends here
+			if ( !Offset )
+				break;
+
+			// Skip hint
+			if ( 0 != StatSeek( f, (long)Offset, SEEK_SET ) )
+				return 7;
+
+			if ( 1 != StatRead( &ImportName, sizeof( ImportName.Hint ), 1, f))
+				return 8;
+
+			// Import by name hint is MZ at the last hunk
+			// Thanks for this documentation microsoft.
+			if ( ImportName.Hint == 'ZM' )
+				break;
+
+			ImportThunkNames.back().emplace_back();
+
+			if ( 0 != ( Result = ReadName( f, ImportThunkNames.back().back() ) ) )
+				return Result == PeErrorLimit ? Result : 9;
+
+			ThunkOffset += sizeof( IMAGE_THUNK_DATA );
+		}
+	}
+
+	return 0;
+}
+
+// Enumerate delay load descriptors
+// Same layout of results as ReadImportDescriptors, the descriptor table is terminated by an empty entry
+int
+ReadDelayImportDescriptors(
+	PeSource *f,
+	IMAGE_FILE_HEADER *FileHeader,
+	IMAGE_OPTIONAL_HEADER *OptionalHeader,
+	const PeSections& Sections,
+	PeNames& DelayImportDllNames,
+	PeNamesByDll& DelayImportThunkNames
+)
+{
+	DelayImportDllNames.clear();
+	DelayImportThunkNames.clear();
+
+	IMAGE_DATA_DIRECTORY *Directory = &OptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT];
+
+	// Most images have no delay imports
+	if ( !Directory->VirtualAddress || !Directory->Size )
+		return 0;
+
+	DWORD NumberOfEntries = Directory->Size / sizeof( IMAGE_DELAYLOAD_DESCRIPTOR );
+	DWORD Offset = SectionRvaFileOffset( FileHeader, Sections, Directory->VirtualAddress );
+
+	if ( !Offset || 0 != StatSeek( f, (long)Offset, SEEK_SET ) )
+		return 1;
+
+	// Scratch tables come from the image's memory resource too
+	std::pmr::vector<IMAGE_DELAYLOAD_DESCRIPTOR> DelayDescriptors( DelayImportDllNames.get_allocator().resource() );
+	IMAGE_DELAYLOAD_DESCRIPTOR Descriptor;
+
+	for ( DWORD i = 0; i < NumberOfEntries; i++ )
+	{
+		CountSteps( 1 );
+
+		memset( &Descriptor, 0, sizeof( Descriptor ) );
+
+		if ( 1 != StatRead( &Descriptor, sizeof( Descriptor ), 1, f ) )
+			return 2;
+
+		if ( !Descriptor.DllNameRVA )
+			break;
+
+		if ( DelayDescriptors.size() == MaxImportDescriptors )
+			return PeErrorLimit;
+
+		// Old (VC6) delay descriptors hold virtual addresses instead of relative virtual addresses
+		if ( !Descriptor.Attributes.RvaBased )
+		{
+			Descriptor.DllNameRVA -= (DWORD)OptionalHeader->ImageBase;
+			Descriptor.ImportNameTableRVA -= (DWORD)OptionalHeader->ImageBase;
+		}
+
+		DelayDescriptors.push_back( Descriptor );
+	}
+
+	IMAGE_THUNK_DATA Thunk;
+	DWORD ThunkOffset;
+	int Result;
+
+	for ( size_t i = 0; i < DelayDescriptors.size(); i++ )
+	{
+		CountSteps( 1 );
+
+		Offset = SectionRvaFileOffset( FileHeader, Sections, DelayDescriptors[i].DllNameRVA );
+
+		if ( !Offset || 0 != StatSeek( f, (long)Offset, SEEK_SET ) )
+			return 3;
+
+		DelayImportDllNames.emplace_back();
+		DelayImportThunkNames.push_back( {} );
+
+		if ( 0 != ( Result = ReadName( f, DelayImportDllNames.back() ) ) )
+			return Result == PeErrorLimit ? Result : 4;
+
+		ThunkOffset = SectionRvaFileOffset( FileHeader, Sections, DelayDescriptors[i].ImportNameTableRVA );
+
+		if ( !ThunkOffset )
+			return 5;
+
+		for ( DWORD numThunks = 0; ; numThunks++, ThunkOffset += sizeof( IMAGE_THUNK_DATA ) )
+		{
+			CountSteps( 1 );
+
+			if ( numThunks == MaxThunksPerDll )
+				return PeErrorLimit;
+
+			if ( 0 != StatSeek( f, (long)ThunkOffset, SEEK_SET ) )
+				return 6;
+
+			if ( 1 != StatRead( &Thunk, sizeof( Thunk ), 1, f ) )
+				return 7;
+
+			// Unlike the import address table, the name table ends with an empty thunk
+			if ( !Thunk.u1.AddressOfData )
+				break;
+
+			// Imports by ordinal are named as in the import table, "#123"
+			if ( IMAGE_SNAP_BY_ORDINAL( Thunk.u1.Ordinal ) )
+			{
+				AppendOrdinalName( DelayImportThunkNames.back(), Thunk.u1.Ordinal );
+				continue;
+			}
+
+			DWORD NameRva = (DWORD)Thunk.u1.AddressOfData;
+
+			if ( !DelayDescriptors[i].Attributes.RvaBased )
+				NameRva -= (DWORD)OptionalHeader->ImageBase;
+
+			// Skip hint
+			Offset = SectionRvaFileOffset( FileHeader, Sections, NameRva );
+
+			if ( !Offset || 0 != StatSeek( f, (long)( Offset + sizeof( WORD ) ), SEEK_SET ) )
+				return 8;
+
+			DelayImportThunkNames.back().emplace_back();
+
+			if ( 0 != ( Result = ReadName( f, DelayImportThunkNames.back().back() ) ) )
+				return Result == PeErrorLimit ? Result : 9;
+		}
+	}
+
+	return 0;
+}
+
+// Enumerate exported names, and the forwarder string of each name that is forwarded to another dll
+// ExportForwarders[i] is empty when ExportNames[i] is exported by this image
+int
+ReadExportDirectory(
+	PeSource *f,
+	IMAGE_FILE_HEADER *FileHeader,
+	IMAGE_OPTIONAL_HEADER *OptionalHeader,
+	const PeSections& Sections,
+	PeNames& ExportNames,
+	PeNames& ExportForwarders
+)
+{
+	ExportNames.clear();
+	ExportForwarders.clear();
+
+	IMAGE_DATA_DIRECTORY *Directory = &OptionalHeader->DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+
+	// Most drivers and executables export nothing
+	if ( !Directory->VirtualAddress || !Directory->Size )
+		return 0;
+
+	DWORD Offset = SectionRvaFileOffset( FileHeader, Sections, Directory->VirtualAddress );
+
+	if ( !Offset || 0 != StatSeek( f, (long)Offset, SEEK_SET ) )
+		return 1;
+
+	IMAGE_EXPORT_DIRECTORY ExportDirectory;
+
+	if ( 1 != StatRead( &ExportDirectory, sizeof( ExportDirectory ), 1, f ) )
+		return 2;
+
+	if ( !ExportDirectory.NumberOfNames )
+		return 0;
+
+	// Bound the table sizes before allocating for them, ntoskrnl exports a few thousand names
+	if ( ExportDirectory.NumberOfNames > 0x10000 || ExportDirectory.NumberOfFunctions > 0x10000 )
+		return 3;
+
+	// Scratch tables come from the image's memory resource too
+	std::pmr::memory_resource *Resource = ExportNames.get_allocator().resource();
+	std::pmr::vector<DWORD> Functions( ExportDirectory.NumberOfFunctions, Resource );
+	std::pmr::vector<DWORD> Names( ExportDirectory.NumberOfNames, Resource );
+	std::pmr::vector<WORD> NameOrdinals( ExportDirectory.NumberOfNames, Resource );
+
+	// Read each table in one go
+	Offset = SectionRvaFileOffset( FileHeader, Sections, ExportDirectory.AddressOfFunctions );
+
+	if ( Functions.size() && ( !Offset || 0 != StatSeek( f, (long)Offset, SEEK_SET ) || 1 != StatRead( Functions.data(), Functions.size() * sizeof( DWORD ), 1, f ) ) )
+		return 4;
+
+	Offset = SectionRvaFileOffset( FileHeader, Sections, ExportDirectory.AddressOfNames );
+
+	if ( !Offset || 0 != StatSeek( f, (long)Offset, SEEK_SET ) || 1 != StatRead( Names.data(), Names.size() * sizeof( DWORD ), 1, f ) )
+		return 5;
+
+	Offset = SectionRvaFileOffset( FileHeader, Sections, ExportDirectory.AddressOfNameOrdinals );
+
+	if ( !Offset || 0 != StatSeek( f, (long)Offset, SEEK_SET ) || 1 != StatRead( NameOrdinals.data(), NameOrdinals.size() * sizeof( WORD ), 1, f ) )
+		return 6;
+
+	int Result;
+
+	for ( DWORD i = 0; i < ExportDirectory.NumberOfNames; i++ )
+	{
+		CountSteps( 1 );
+
+		Offset = SectionRvaFileOffset( FileHeader, Sections, Names[i] );
+
+		if ( !Offset || 0 != StatSeek( f, (long)Offset, SEEK_SET ) )
+			return 7;
+
+		ExportNames.emplace_back();
+		ExportForwarders.push_back( {} );
+
+		if ( 0 != ( Result = ReadName( f, ExportNames.back() ) ) )
+			return Result == PeErrorLimit ? Result : 8;
+
+		if ( NameOrdinals[i] >= Functions.size() )
+			continue;
+
+		DWORD FunctionRva = Functions[NameOrdinals[i]];
+
+		// Functions that point back into the export directory are forwarder strings, "NTOSKRNL.KeFoo"
+		if ( FunctionRva < Directory->VirtualAddress || FunctionRva >= Directory->VirtualAddress + Directory->Size )
+			continue;
+
+		Offset = SectionRvaFileOffset( FileHeader, Sections, FunctionRva );
+
+		if ( !Offset || 0 != StatSeek( f, (long)Offset, SEEK_SET ) )
+			return 9;
+
+		if ( 0 != ( Result = ReadName( f, ExportForwarders.back() ) ) )
+			return Result == PeErrorLimit ? Result : 10;
+	}
+
+	return 0;
+}
+
+// Collect the exports that are in the import list
+// A forwarded export matches on its own name, or on the function (or full "DLL.Function") it is forwarded to
+int
+MatchExportNames(
+	const PeNames& ExportNames,
+	const PeNames& ExportForwarders,
+	int numImports,
+	const char *const *const ppszImports,
+	std::vector<ImportHit>& Hits
+)
+{
+	int exportCount = 0;
+
+	for ( size_t i = 0; i < ExportNames.size(); i++ )
+	{
+		const PeName& Forwarder = ExportForwarders[i];
+		size_t Dot = Forwarder.find( '.' );
+
+		for ( int k = 0; k < numImports; k++ )
+		{
+			bool Exported = 0 == ExportNames[i].compare( ppszImports[k] );
+			bool Forwarded = Dot != std::string::npos && ( 0 == Forwarder.compare( Dot + 1, std::string::npos, ppszImports[k] ) || 0 == Forwarder.compare( ppszImports[k] ) );
+
+			if ( !Exported && !Forwarded )
+				continue;
+
+			Hits.push_back( { HitExport, 0, i, k } );
+			exportCount++;
+		}
+	}
+
+	return exportCount;
+}
+
+// Collect the thunk names that are in the import list
+// Delay loaded imports go through the same matcher and are tagged by Kind
+int
+MatchThunkNames(
+	const PeNamesByDll& ThunkNames,
+	int numImports,
+	const char *const *const ppszImports,
+	HitKind Kind,
+	std::vector<ImportHit>& Hits
+)
+{
+	int importCount = 0;
+
+	// Probably a more efficient way to do this
+	for ( size_t i = 0; i < ThunkNames.size(); i++ )
+	{
+		for ( size_t j = 0; j < ThunkNames[i].size(); j++ )
+		{
+			// Loop thru imports
+			for ( int k = 0; k < numImports; k++ )
+			{
+				if ( 0 == ThunkNames[i][j].compare( ppszImports[k] ) )
+				{
+					Hits.push_back( { Kind, i, j, k } );
+					importCount++;
+				}
+			}
+		}
+	}
+
+	return importCount;
+}
+
+void
+BuildImportNameSet(
+	int numImports,
+	const char *const *const ppszImports,
+	ImportNameSet& Set
+)
+{
+	Set.Imports.clear();
+	Set.Imports.reserve( numImports );
+
+	for ( int k = 0; k < numImports; k++ )
+		Set.Imports.emplace( ppszImports[k], k );
+}
+
+// Each export is looked up by its name, and when forwarded by the function and the full "DLL.Function" it is forwarded to
+int
+MatchExportNames(
+	const PeNames& ExportNames,
+	const PeNames& ExportForwarders,
+	const ImportNameSet& Set,
+	std::vector<ImportHit>& Hits
+)
+{
+	int exportCount = 0;
+
+	for ( size_t i = 0; i < ExportNames.size(); i++ )
+	{
+		std::string_view Forwarder( ExportForwarders[i] );
+		size_t Dot = Forwarder.find( '.' );
+		int Found[3] = { -1, -1, -1 };
+
+		auto Exported = Set.Imports.find( std::string_view( ExportNames[i] ) );
+
+		if ( Exported != Set.Imports.end() )
+			Found[0] = Exported->second;
+
+		if ( Dot != std::string_view::npos )
+		{
+			auto Function = Set.Imports.find( Forwarder.substr( Dot + 1 ) );
+			auto Full = Set.Imports.find( Forwarder );
+
+			if ( Function != Set.Imports.end() )
+				Found[1] = Function->second;
+
+			if ( Full != Set.Imports.end() )
+				Found[2] = Full->second;
+		}
+
+		// One hit per listed import, in the order of the list, as the linear matcher finds them
+		std::sort( Found, Found + 3 );
+
+		for ( int f = 0; f < 3; f++ )
+		{
+			if ( Found[f] < 0 || ( f && Found[f] == Found[f - 1] ) )
+				continue;
+
+			Hits.push_back( { HitExport, 0, i, Found[f] } );
+			exportCount++;
+		}
+	}
+
+	return exportCount;
+}
+
+int
+MatchThunkNames(
+	const PeNamesByDll& ThunkNames,
+	const ImportNameSet& Set,
+	HitKind Kind,
+	std::vector<ImportHit>& Hits
+)
+{
+	int importCount = 0;
+
+	for ( size_t i = 0; i < ThunkNames.size(); i++ )
+	{
+		for ( size_t j = 0; j < ThunkNames[i].size(); j++ )
+		{
+			auto Found = Set.Imports.find( std::string_view( ThunkNames[i][j] ) );
+
+			if ( Found == Set.Imports.end() )
+				continue;
+
+			Hits.push_back( { Kind, i, j, Found->second } );
+			importCount++;
+		}
+	}
+
+	return importCount;
+}
+
+// Count why a file was rejected, by the ReadImage return value and the return value of the function that failed
+static int
+RejectImage(
+	StageClock& Clock,
+	ScanStage Stage,
+	int Function,
+	int Result,
+	PeError *Error
+)
+{
+	Clock.Lap( Stage );
+
+	if ( t_pStats )
+		t_pStats->Rejected[Function - 1][std::min( Result, NumRejectCodes - 1 )]++;
+
+	if ( Error )
+		*Error = { Function, Result };
+
+	return Function;
+}
+
+// Read the headers, imports, delay imports and optionally exports of an open file
+int
+ReadImage(
+	PeSource *f,
+	bool bExports,
+	PeImage& Image,
+	PeError *Error
+)
+{
+	StageClock Clock;
+	int Result;
+
+	// The budget is set from the size of the file, which is only found with a seek when the caller did not know it
+	if ( f->File && f->Size == PeSizeUnknown )
+	{
+		if ( 0 != StatSeek( f->File, 0, SEEK_END ) )
+			return RejectImage( Clock, StageHeaders, 1, 1, Error );
+
+		long FileSize = ftell( f->File );
+		f->Size = FileSize > 0 ? (size_t)FileSize : 0;
+
+		if ( 0 != StatSeek( f->File, 0, SEEK_SET ) )
+			return RejectImage( Clock, StageHeaders, 1, 1, Error );
+	}
+
+	f->Budget = f->Size * ReadBudgetPerByte + ReadBudgetSlack;
+
+	// A step that fails once the budget is spent failed because of it
+	auto Failed = [&]( int Result ) { return f->Budget ? Result : PeErrorLimit; };
+
+	// ReadMagicNumber initializes e_magic
+	if ( 0 != ( Result = ReadMagicNumber( f, &Image.DosHeader ) ) )
+		return RejectImage( Clock, StageHeaders, 1, Failed( Result ), Error );
+
+	// Checks NT headers signature, and checks architecture
+	if ( 0 != ( Result = ReadNtHeaders( f, &Image.DosHeader, &Image.NtHeaders ) ) )
+		return RejectImage( Clock, StageHeaders, 2, Failed( Result ), Error );
+
+	Clock.Lap( StageHeaders );
+
+	// Read sections for virtual address translation in the file
+	if ( 0 != ( Result = ReadSections( f, &Image.NtHeaders.FileHeader, Image.Sections ) ) )
+		return RejectImage( Clock, StageSections, 3, Failed( Result ), Error );
+
+	Clock.Lap( StageSections );
+
+	// Read import descriptors and dll import names
+	if ( 0 != ( Result = ReadImportDescriptors( f, &Image.NtHeaders.FileHeader, &Image.NtHeaders.OptionalHeader, Image.Sections, Image.ImportDescriptors, Image.ImportDllNames, Image.ImportThunkNames ) ) )
+		return RejectImage( Clock, StageImports, 4, Failed( Result ), Error );
+
+	// Read delay load descriptors in the same pass, they go through the same matcher
+	// A corrupt delay import directory does not lose the imports already read, the image keeps the error and no delay imports
+	Image.DelayImportError = {};
+
+	if ( 0 != ( Result = ReadDelayImportDescriptors( f, &Image.NtHeaders.FileHeader, &Image.NtHeaders.OptionalHeader, Image.Sections, Image.DelayImportDllNames, Image.DelayImportThunkNames ) ) )
+	{
+		Image.DelayImportError = { 5, Failed( Result ) };
+		Image.DelayImportDllNames.clear();
+		Image.DelayImportThunkNames.clear();
+	}
+
+	// Exports share the open file and the section table, and a corrupt export directory keeps the imports as well
+	Image.ExportError = {};
+
+	if ( bExports && 0 != ( Result = ReadExportDirectory( f, &Image.NtHeaders.FileHeader, &Image.NtHeaders.OptionalHeader, Image.Sections, Image.ExportNames, Image.ExportForwarders ) ) )
+	{
+		Image.ExportError = { 6, Failed( Result ) };
+		Image.ExportNames.clear();
+		Image.ExportForwarders.clear();
+	}
+
+	Clock.Lap( StageImports );
+
+	if ( t_pStats )
+		t_pStats->FilesParsed++;
+
+	return 0;
+}
+
+// Open and read a file, returning the open file, or NULL when it could not be opened or read
+FILE *
+OpenImage(
+	const std::string& Path,
+	bool bExports,
+	PeImage& Image,
+	PeError *Error,
+	long long *pSize
+)
+{
+	StageClock Clock;
+
+	FILE *f = NULL;
+	if ( 0 != fopen_s( &f, Path.c_str(), "rb" ) || !f )
+	{
+		Clock.Lap( StageOpen );
+
+		if ( Error )
+			*Error = { PeErrorOpen, 0 };
+
+		return NULL;
+	}
+
+	Clock.Lap( StageOpen );
+
+	if ( t_pStats )
+		t_pStats->FilesOpened++;
+
+	PeSource Source = { f, NULL, pSize && *pSize >= 0 ? (size_t)*pSize : PeSizeUnknown, 0 };
+
+	if ( 0 != ReadImage( &Source, bExports, Image, Error ) )
+	{
+		fclose( f );
+		return NULL;
+	}
+
+	if ( pSize )
+		*pSize = (long long)Source.Size;
+
+	return f;
+}
+
+int
+ParseImage(
+	const uint8_t *Data,
+	size_t Size,
+	bool bExports,
+	PeImage& Image,
+	PeError *Error
+)
+{
+	PeSource Source = { NULL, Data, Size, 0 };
+	return ReadImage( &Source, bExports, Image, Error );
+}
+
+const char *
+PeErrorMessage(
+	const PeError& Error
+)
+{
+	if ( Error.Step < 1 || Error.Step > NumRejectFunctions || Error.Code < 0 || Error.Code >= NumRejectCodes )
+		return NULL;
+
+	if ( Error.Code == PeErrorLimit )
+		return "Exceeds the per file limits, corrupted?";
+
+	return RejectMessages[Error.Step - 1][Error.Code];
+}
+
+// 64 bit hash of a block of bytes, a word at a time
+static ULONGLONG
+ContentHash(
+	const void *Data,
+	size_t Size,
+	ULONGLONG Seed
+)
+{
+	const uint8_t *Bytes = (const uint8_t *)Data;
+	ULONGLONG Hash = Seed ^ ( Size * 0x9e3779b97f4a7c15ull );
+	ULONGLONG Word;
+
+	for ( ; Size >= 8; Bytes += 8, Size -= 8 )
+	{
+		memcpy( &Word, Bytes, 8 );
+		Hash = ( Hash ^ Word ) * 0xff51afd7ed558ccdull;
+		Hash ^= Hash >> 29;
+	}
+
+	Word = 0;
+	memcpy( &Word, Bytes, Size );
+	Hash = ( Hash ^ Word ) * 0xc4ceb9fe1a85ec53ull;
+
+	return Hash ^ ( Hash >> 32 );
+}
+
+// Size of the page read to key a file, it holds the headers and section table of almost every image
+const size_t CacheKeyPageSize = 4096;
+
+// The largest import directory hashed, anything larger is not cached
+const DWORD CacheKeyMaxImportSize = 0x10000;
+
+// Key a file by its size, its first page and its import directory bytes, which are left in Content
+// Size is the size of the file, or -1 to find it with a seek
+// Returns false when the file can not be keyed, it is then parsed and not cached
+static bool
+ImageContentKey(
+	FILE *f,
+	long long& Size,
+	std::vector<uint8_t>& Content,
+	ULONGLONG& Key
+)
+{
+	if ( Size < 0 )
+	{
+		if ( 0 != StatSeek( f, 0, SEEK_END ) )
+			return false;
+
+		Size = ftell( f );
+
+		if ( Size < 0 )
+			return false;
+	}
+
+	size_t PageSize = (size_t)std::min<long long>( Size, CacheKeyPageSize );
+
+	Content.resize( PageSize );
+
+	if ( PageSize < sizeof( IMAGE_DOS_HEADER ) || 0 != StatSeek( f, 0, SEEK_SET ) || 1 != StatRead( Content.data(), PageSize, 1, f ) )
+		return false;
+
+	// Find the import directory from the headers in the page, as ReadImage would
+	IMAGE_DOS_HEADER DosHeader;
+	IMAGE_NT_HEADERS NtHeaders;
+	memcpy( &DosHeader, Content.data(), sizeof( DosHeader ) );
+
+	if ( DosHeader.e_magic != 'ZM' || DosHeader.e_lfanew < 0 || (size_t)DosHeader.e_lfanew + sizeof( NtHeaders ) > PageSize )
+		return false;
+
+	memcpy( &NtHeaders, &Content[DosHeader.e_lfanew], sizeof( NtHeaders ) );
+
+	size_t SectionOffset = DosHeader.e_lfanew + sizeof( NtHeaders );
+	WORD numSections = NtHeaders.FileHeader.NumberOfSections;
+
+	if ( NtHeaders.Signature != 'EP' || SectionOffset + numSections * sizeof( IMAGE_SECTION_HEADER ) > PageSize ||
+		NtHeaders.OptionalHeader.NumberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_IMPORT )
+		return false;
+
+	PeSections Sections( numSections );
+
+	if ( numSections )
+		memcpy( Sections.data(), &Content[SectionOffset], numSections * sizeof( IMAGE_SECTION_HEADER ) );
+
+	IMAGE_DATA_DIRECTORY *Directory = &NtHeaders.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+	DWORD Offset = SectionRvaFileOffset( &NtHeaders.FileHeader, Sections, Directory->VirtualAddress );
+
+	if ( Directory->Size )
+	{
+		if ( !Offset || Directory->Size > CacheKeyMaxImportSize )
+			return false;
+
+		Content.resize( PageSize + Directory->Size );
+
+		if ( 0 != StatSeek( f, (long)Offset, SEEK_SET ) || 1 != StatRead( &Content[PageSize], Directory->Size, 1, f ) )
+			return false;
+	}
+
+	Key = ContentHash( Content.data(), Content.size(), (ULONGLONG)Size );
+	return true;
+}
+
+FILE *
+OpenCachedImage(
+	const std::string& Path,
+	bool bExports,
+	ImageCache *Cache,
+	PeImage& Image,
+	const PeImage *& pImage,
+	PeError *Error,
+	long long *pSize
+)
+{
+	pImage = &Image;
+
+	if ( !Cache )
+		return OpenImage( Path, bExports, Image, Error, pSize );
+
+	StageClock Clock;
+
+	FILE *f = NULL;
+	if ( 0 != fopen_s( &f, Path.c_str(), "rb" ) || !f )
+	{
+		Clock.Lap( StageOpen );
+
+		if ( Error )
+			*Error = { PeErrorOpen, 0 };
+
+		return NULL;
+	}
+
+	Clock.Lap( StageOpen );
+
+	if ( t_pStats )
+		t_pStats->FilesOpened++;
+
+	static thread_local std::vector<uint8_t> Content;
+	long long Size = pSize ? *pSize : -1;
+	ULONGLONG Key = 0;
+	bool bKeyed = ImageContentKey( f, Size, Content, Key );
+
+	if ( bKeyed )
+	{
+		const CachedImage *Cached = NULL;
+
+		{
+			std::lock_guard<std::mutex> Guard( Cache->Lock );
+			auto Found = Cache->Images.find( Key );
+
+			if ( Found != Cache->Images.end() )
+				Cached = &Found->second;
+		}
+
+		// Entries are never changed or removed once added, so they are compared without the lock
+		if ( Cached && Cached->Size == (ULONGLONG)Size && Cached->Content == Content )
+			pImage = Cached->Image.get();
+	}
+
+	Clock.Lap( StageHeaders );
+
+	if ( pImage != &Image )
+	{
+		if ( t_pStats )
+			t_pStats->FilesCached++;
+
+		if ( pSize )
+			*pSize = Size;
+
+		return f;
+	}
+
+	rewind( f );
+
+	PeSource Source = { f, NULL, Size < 0 ? PeSizeUnknown : (size_t)Size, 0 };
+
+	if ( 0 != ReadImage( &Source, bExports, Image, Error ) )
+	{
+		fclose( f );
+		return NULL;
+	}
+
+	if ( pSize )
+		*pSize = (long long)Source.Size;
+
+	// Files that fail to parse are not cached, so each one is still reported
+	// A file whose hash is taken by other bytes is not cached either, the first file keeps the entry
+	if ( bKeyed )
+	{
+		// The copy outlives the worker's image and its resource, so it is allocated from the default resource
+		auto Copy = std::make_shared<PeImage>( std::pmr::get_default_resource() );
+		*Copy = Image;
+
+		CachedImage Cached = { (ULONGLONG)Size, Content, std::move( Copy ) };
+		std::lock_guard<std::mutex> Guard( Cache->Lock );
+		Cache->Images.emplace( Key, std::move( Cached ) );
+	}
+
+	return f;
+}
@@ -0,0 +1,282 @@
+#pragma once
+
+// PE reader, built as the impfilib library that impfi and impfibench link
+// Reads the headers, sections, imports, delay imports and exports of an open file or a buffer in memory, and matches names against an import list
+// Nothing is printed, failures are returned as a PeError, and everything read is allocated from the memory resource the PeImage was made with
+
+#include <Windows.h>
+#include <stdio.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory_resource>
+#include <unordered_map>
+
+// Indexed by the return value of ReadImage - 1, and by the return value of the function
+const int NumRejectFunctions = 6;
+const int NumRejectCodes = 16;
+
+extern const char *const RejectNames[NumRejectFunctions];
+
+// Why an image was not read, Step is the function that failed, 1 based as RejectNames, and Code the value it returned
+struct PeError
+{
+	int Step;
+	int Code;
+};
+
+// Step of a file that could not be opened
+const int PeErrorOpen = NumRejectFunctions + 1;
+
+// Code of a step that hit one of the per file limits below, or ran out of its read budget
+const int PeErrorLimit = NumRejectCodes - 1;
+
+// Per file limits, far above what any linker writes, so a corrupted count can not make a file expensive
+const WORD MaxSections = 96;					// As the loader allows
+const DWORD MaxImportDescriptors = 0x1000;		// Per import or delay import directory
+const DWORD MaxThunksPerDll = 0x10000;
+const size_t MaxNameLength = 0x1000;			// Dll, import, export and forwarder names, as long as MSVC decorates a name
+
+// Every read and seek of an image is charged to a budget of ReadBudgetPerByte per byte of the file, plus ReadBudgetSlack
+// A read costs its size plus ReadCost, a seek costs ReadCost, so the work done on any input is linear in its size
+const size_t ReadCost = 16;
+const size_t ReadBudgetPerByte = 16;
+const size_t ReadBudgetSlack = 0x10000;
+
+// The diagnostic of an error, NULL for the ones that are not reported, files that could not be opened and architectures that are not targeted
+const char *
+PeErrorMessage(
+	const PeError& Error
+);
+
+// Names, sections and descriptors read from an image
+typedef std::pmr::string PeName;
+typedef std::pmr::vector<PeName> PeNames;
+typedef std::pmr::vector<PeNames> PeNamesByDll;
+typedef std::pmr::vector<IMAGE_SECTION_HEADER> PeSections;
+
+// Size of a file source that the caller does not know, ReadImage then finds it with a seek
+const size_t PeSizeUnknown = (size_t)-1;
+
+// Where an image is read from, an open file, or Size bytes at Data when File is NULL (a zip member inflated to memory)
+// A file is read from its current position, which must be the start of the file
+struct PeSource
+{
+	FILE *File;
+	const uint8_t *Data;
+	size_t Size;							// A file's size from its directory listing, or PeSizeUnknown
+	size_t Offset;
+	size_t Budget = (size_t)-1;				// Left to spend, set by ReadImage, 0 once spent
+};
+
+// As fread and fseek, on either kind of source, failing once the budget is spent
+size_t
+StatRead(
+	void *Buffer,
+	size_t Size,
+	size_t Count,
+	PeSource *f
+);
+
+int
+StatSeek(
+	PeSource *f,
+	long Offset,
+	int Origin
+);
+
+int
+ReadMagicNumber(
+	PeSource *f,
+	IMAGE_DOS_HEADER *DosHeader
+);
+
+int
+ReadNtHeaders(
+	PeSource *f,
+	IMAGE_DOS_HEADER *DosHeader,
+	IMAGE_NT_HEADERS *NtHeaders
+);
+
+int
+ReadSections(
+	PeSource *f,
+	IMAGE_FILE_HEADER *DosHeader,
+	PeSections& Sections
+);
+
+// Search all sections for the given relative virtual address, 0 when it is not in the raw data of any section
+DWORD
+SectionRvaFileOffset(
+	IMAGE_FILE_HEADER *FileHeader,
+	const PeSections& Sections,
+	DWORD Rva
+);
+
+// Enumerate import descriptors
+int
+ReadImportDescriptors(
+	PeSource *f,
+	IMAGE_FILE_HEADER *FileHeader,
+	IMAGE_OPTIONAL_HEADER *OptionalHeader,
+	const PeSections& Sections,
+	std::pmr::vector<IMAGE_IMPORT_DESCRIPTOR>& ImportDescriptors,
+	PeNames& ImportDllNames,
+	PeNamesByDll& ImportThunkNames
+);
+
+// Enumerate delay load descriptors, same layout of results as ReadImportDescriptors
+int
+ReadDelayImportDescriptors(
+	PeSource *f,
+	IMAGE_FILE_HEADER *FileHeader,
+	IMAGE_OPTIONAL_HEADER *OptionalHeader,
+	const PeSections& Sections,
+	PeNames& DelayImportDllNames,
+	PeNamesByDll& DelayImportThunkNames
+);
+
+// Enumerate exported names, ExportForwarders[i] is empty when ExportNames[i] is exported by this image
+int
+ReadExportDirectory(
+	PeSource *f,
+	IMAGE_FILE_HEADER *FileHeader,
+	IMAGE_OPTIONAL_HEADER *OptionalHeader,
+	const PeSections& Sections,
+	PeNames& ExportNames,
+	PeNames& ExportForwarders
+);
+
+// Where a listed import was found in an image
+enum HitKind
+{
+	HitImport,
+	HitDelayLoad,
+	HitExport
+};
+
+struct ImportHit
+{
+	HitKind Kind;
+	size_t Dll;		// Index of the (delay load) dll, unused for exports
+	size_t Index;	// Index of the thunk in the dll, or of the export
+	int Import;		// Index of the listed import
+};
+
+// Collect the exports that are in the import list
+int
+MatchExportNames(
+	const PeNames& ExportNames,
+	const PeNames& ExportForwarders,
+	int numImports,
+	const char *const *const ppszImports,
+	std::vector<ImportHit>& Hits
+);
+
+// Collect the thunk names that are in the import list
+int
+MatchThunkNames(
+	const PeNamesByDll& ThunkNames,
+	int numImports,
+	const char *const *const ppszImports,
+	HitKind Kind,
+	std::vector<ImportHit>& Hits
+);
+
+// The import list hashed by name, so a name is matched with one lookup however many imports are listed
+// The names are not copied, they must outlive the set
+struct ImportNameSet
+{
+	std::unordered_map<std::string_view, int> Imports;		// Index of the first listing of each name
+};
+
+void
+BuildImportNameSet(
+	int numImports,
+	const char *const *const ppszImports,
+	ImportNameSet& Set
+);
+
+// As above, against the hashed list, a name listed twice is only found once
+int
+MatchExportNames(
+	const PeNames& ExportNames,
+	const PeNames& ExportForwarders,
+	const ImportNameSet& Set,
+	std::vector<ImportHit>& Hits
+);
+
+int
+MatchThunkNames(
+	const PeNamesByDll& ThunkNames,
+	const ImportNameSet& Set,
+	HitKind Kind,
+	std::vector<ImportHit>& Hits
+);
+
+// Everything read from one image, kept per worker so the vectors are reused between files
+// The vectors and names are allocated from Resource, e.g. a std::pmr::monotonic_buffer_resource released after each batch
+struct PeImage
+{
+	explicit PeImage(
+		std::pmr::memory_resource *Resource = std::pmr::get_default_resource()
+	) :
+		Sections( Resource ),
+		ImportDescriptors( Resource ),
+		ImportDllNames( Resource ),
+		ImportThunkNames( Resource ),
+		DelayImportDllNames( Resource ),
+		DelayImportThunkNames( Resource ),
+		ExportNames( Resource ),
+		ExportForwarders( Resource )
+	{
+	}
+
+	IMAGE_DOS_HEADER DosHeader;
+	IMAGE_NT_HEADERS NtHeaders;
+	PeSections Sections;
+	std::pmr::vector<IMAGE_IMPORT_DESCRIPTOR> ImportDescriptors;
+	PeNames ImportDllNames;
+	PeNamesByDll ImportThunkNames;
+	PeNames DelayImportDllNames;
+	PeNamesByDll DelayImportThunkNames;
+	PeNames ExportNames;
+	PeNames ExportForwarders;
+	PeError DelayImportError = {};		// Why the delay imports were not read, Step is 0 when they were
+	PeError ExportError = {};			// Why the exports were not read, as DelayImportError
+};
+
+// Read the headers, imports, delay imports and optionally exports of an open file or buffer
+// Returns 0, or the step that failed, see RejectNames, Error (when not NULL) is set to the step and its code
+// A delay import directory that can not be read does not fail the image, it is left empty and Image.DelayImportError is set
+// An export directory likewise, with Image.ExportError
+// Reads are bounded by the budget, so the time taken is linear in the size of the file whatever it holds
+int
+ReadImage(
+	PeSource *f,
+	bool bExports,
+	PeImage& Image,
+	PeError *Error
+);
+
+// Open and read a file, returning the open file, or NULL when it could not be opened or read
+// pSize (when not NULL) holds the size of the file when the caller knows it, or -1, and is set to the size once read
+FILE *
+OpenImage(
+	const std::string& Path,
+	bool bExports,
+	PeImage& Image,
+	PeError *Error,
+	long long *pSize = NULL
+);
+
+// Parse an image of Size bytes at Data, a buffer the caller already holds, such as a zip member or a mapped file
+// Returns 0, or the step that failed, as ReadImage
+int
+ParseImage(
+	const uint8_t *Data,
+	size_t Size,
+	bool bExports,
+	PeImage& Image,
+	PeError *Error
+);
@@ -0,0 +1,327 @@
+#pragma once
+
+// Binary result stream written by impfi --format binary, and a reader that walks it in place
+// Header only, so other tools can include it without linking anything from impfi
+//
+// The stream is a ResultStreamHeader followed by records, each starting with a ResultRecordHeader
+// Records are padded to 8 bytes, so every record can be read straight from a mapped file
+// Names are written once as string records and referenced by id, ids are only unique within a stream
+// A string record always comes before the first record that references it
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define RESULT_STREAM_MAGIC "IMPFIRS1"
+#define RESULT_STREAM_VERSION 1
+
+// Id of a field that has no string
+#define RESULT_STRING_NONE 0xffffffff
+
+enum ResultRecordType
+{
+	ResultRecordString = 1,
+	ResultRecordFile = 2
+};
+
+enum ResultHitKind
+{
+	ResultHitImport = 0,
+	ResultHitDelayLoad = 1,
+	ResultHitExport = 2
+};
+
+enum ResultFileFlags
+{
+	ResultFileHasImphash = 1,
+	ResultFileHasQuery = 2		// impfi --queries, a record per file and query that matched it
+};
+
+struct ResultStreamHeader
+{
+	char Magic[8];
+	uint32_t Version;
+	uint32_t Reserved;
+};
+
+struct ResultRecordHeader
+{
+	uint32_t Size;		// Including this header and padding
+	uint16_t Type;
+	uint16_t Reserved;
+};
+
+// Followed by Length characters and a null terminator
+struct ResultStringRecord
+{
+	ResultRecordHeader Header;
+	uint32_t Id;
+	uint32_t Length;
+};
+
+struct ResultHitRecord
+{
+	uint32_t Kind;
+	uint32_t DllId;			// Imports and delay loads
+	uint32_t NameId;		// The listed import that matched
+	uint32_t ExportId;		// Exports
+	uint32_t ForwarderId;	// Forwarded exports
+};
+
+// Followed by NumHits hit records
+struct ResultFileRecord
+{
+	ResultRecordHeader Header;
+	uint32_t PathId;
+	uint32_t NumHits;
+	uint64_t Size;
+	uint8_t Imphash[16];
+	uint32_t Flags;
+	uint32_t QueryId;		// Name of the query, with ResultFileHasQuery
+};
+
+inline const ResultHitRecord *
+ResultFileHits(
+	const ResultFileRecord *File
+)
+{
+	return (const ResultHitRecord *)( File + 1 );
+}
+
+// Record sizes are rounded up to this
+inline uint32_t
+ResultRecordSize(
+	size_t Size
+)
+{
+	return (uint32_t)( ( Size + 7 ) & ~(size_t)7 );
+}
+
+struct ResultStream
+{
+	const uint8_t *Data;
+	size_t Size;
+	std::vector<const char *> Strings;	// Indexed by id
+#ifdef _WIN32
+	HANDLE File;
+	HANDLE Mapping;
+#else
+	int File;
+#endif
+};
+
+// Validate the record at Offset, returning NULL at the end of the stream or on a truncated record
+inline const ResultRecordHeader *
+ResultStreamRecord(
+	const ResultStream *Stream,
+	size_t Offset
+)
+{
+	if ( Offset + sizeof( ResultRecordHeader ) > Stream->Size )
+		return NULL;
+
+	const ResultRecordHeader *Record = (const ResultRecordHeader *)( Stream->Data + Offset );
+
+	if ( Record->Size < sizeof( ResultRecordHeader ) || Record->Size > Stream->Size - Offset )
+		return NULL;
+
+	if ( Record->Type == ResultRecordFile && ( Record->Size < sizeof( ResultFileRecord ) ||
+		( Record->Size - sizeof( ResultFileRecord ) ) / sizeof( ResultHitRecord ) < ( (const ResultFileRecord *)Record )->NumHits ) )
+		return NULL;
+
+	return Record;
+}
+
+// Index the string records, the only pass over the stream that is needed
+inline int
+ResultStreamIndex(
+	ResultStream *Stream
+)
+{
+	if ( Stream->Size < sizeof( ResultStreamHeader ) || 0 != memcmp( Stream->Data, RESULT_STREAM_MAGIC, 8 ) )
+		return 1;
+
+	if ( ( (const ResultStreamHeader *)Stream->Data )->Version != RESULT_STREAM_VERSION )
+		return 2;
+
+	size_t Offset = sizeof( ResultStreamHeader );
+
+	for ( const ResultRecordHeader *Record; ( Record = ResultStreamRecord( Stream, Offset ) ); Offset += Record->Size )
+	{
+		if ( Record->Type != ResultRecordString )
+			continue;
+
+		const ResultStringRecord *String = (const ResultStringRecord *)Record;
+
+		if ( Record->Size < sizeof( ResultStringRecord ) + String->Length + 1 )
+			return 3;
+
+		// Ids are dense, so an id past the number of string records the stream could hold is corrupt, and would size the table from it
+		if ( String->Id >= Stream->Size / sizeof( ResultStringRecord ) )
+			return 3;
+
+		// Strings are handed out in place, so they must be terminated
+		if ( ( (const char *)( String + 1 ) )[String->Length] != '\0' )
+			return 3;
+
+		if ( String->Id >= Stream->Strings.size() )
+			Stream->Strings.resize( String->Id + 1, NULL );
+
+		Stream->Strings[String->Id] = (const char *)( String + 1 );
+	}
+
+	// Anything left over is a truncated record
+	return Offset == Stream->Size ? 0 : 4;
+}
+
+// Use a stream already in memory, Data must stay valid and 8 byte aligned
+inline int
+ResultStreamOpenMemory(
+	ResultStream *Stream,
+	const void *Data,
+	size_t Size
+)
+{
+	*Stream = {};
+	Stream->Data = (const uint8_t *)Data;
+	Stream->Size = Size;
+#ifdef _WIN32
+	Stream->File = INVALID_HANDLE_VALUE;
+#else
+	Stream->File = -1;
+#endif
+	return ResultStreamIndex( Stream );
+}
+
+inline void
+ResultStreamClose(
+	ResultStream *Stream
+)
+{
+#ifdef _WIN32
+	if ( Stream->Mapping )
+	{
+		UnmapViewOfFile( Stream->Data );
+		CloseHandle( Stream->Mapping );
+	}
+
+	if ( Stream->File != INVALID_HANDLE_VALUE )
+		CloseHandle( Stream->File );
+
+	Stream->File = INVALID_HANDLE_VALUE;
+#else
+	if ( Stream->File != -1 )
+	{
+		if ( Stream->Size )
+			munmap( (void *)Stream->Data, Stream->Size );
+
+		close( Stream->File );
+	}
+
+	Stream->File = -1;
+#endif
+	Stream->Data = NULL;
+	Stream->Size = 0;
+	Stream->Strings.clear();
+}
+
+// Map a result file, 0 on success
+inline int
+ResultStreamOpen(
+	ResultStream *Stream,
+	const char *Path
+)
+{
+	*Stream = {};
+
+#ifdef _WIN32
+	Stream->File = CreateFileA( Path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+
+	if ( Stream->File == INVALID_HANDLE_VALUE )
+		return -1;
+
+	LARGE_INTEGER FileSize;
+
+	if ( !GetFileSizeEx( Stream->File, &FileSize ) || !FileSize.QuadPart )
+	{
+		ResultStreamClose( Stream );
+		return -1;
+	}
+
+	Stream->Mapping = CreateFileMappingA( Stream->File, NULL, PAGE_READONLY, 0, 0, NULL );
+	Stream->Data = Stream->Mapping ? (const uint8_t *)MapViewOfFile( Stream->Mapping, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+	Stream->Size = (size_t)FileSize.QuadPart;
+#else
+	Stream->File = open( Path, O_RDONLY );
+
+	if ( Stream->File == -1 )
+		return -1;
+
+	struct stat Stat;
+
+	if ( 0 != fstat( Stream->File, &Stat ) || !Stat.st_size )
+	{
+		ResultStreamClose( Stream );
+		return -1;
+	}
+
+	void *Data = mmap( NULL, (size_t)Stat.st_size, PROT_READ, MAP_SHARED, Stream->File, 0 );
+	Stream->Data = Data == MAP_FAILED ? NULL : (const uint8_t *)Data;
+	Stream->Size = Stream->Data ? (size_t)Stat.st_size : 0;
+#endif
+
+	if ( !Stream->Data )
+	{
+		ResultStreamClose( Stream );
+		return -1;
+	}
+
+	int Result = ResultStreamIndex( Stream );
+
+	if ( Result )
+		ResultStreamClose( Stream );
+
+	return Result;
+}
+
+// String of an id, NULL for RESULT_STRING_NONE
+inline const char *
+ResultStreamString(
+	const ResultStream *Stream,
+	uint32_t Id
+)
+{
+	return Id < Stream->Strings.size() ? Stream->Strings[Id] : NULL;
+}
+
+// Iterate the file records in place, start with *Cursor = 0
+//	for ( size_t Cursor = 0; const ResultFileRecord *File = ResultStreamNextFile( &Stream, &Cursor ); )
+inline const ResultFileRecord *
+ResultStreamNextFile(
+	const ResultStream *Stream,
+	size_t *Cursor
+)
+{
+	if ( *Cursor < sizeof( ResultStreamHeader ) )
+		*Cursor = sizeof( ResultStreamHeader );
+
+	for ( const ResultRecordHeader *Record; ( Record = ResultStreamRecord( Stream, *Cursor ) ); )
+	{
+		*Cursor += Record->Size;
+
+		if ( Record->Type == ResultRecordFile )
+			return (const ResultFileRecord *)Record;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+// Scan statistics and tracing for impfi --stats and --trace, not part of the reader's API
+// impfilib counts into the calling thread's ScanStats and TraceRing when they are set, the tools that link it set and read them
+
+#include "peimage.h"
+
+#include <atomic>
+
+// Each worker counts into its own ScanStats through t_pStats, which is null when --stats is off
+enum ScanStage
+{
+	StageEnumerate,
+	StageOpen,
+	StageHeaders,
+	StageSections,
+	StageImports,
+	StageMatch,
+	StageOutput,
+	NumScanStages
+};
+
+extern const char *const ScanStageNames[NumScanStages];
+
+struct ScanStats
+{
+	ULONGLONG StageTime[NumScanStages] = {};	// Nanoseconds, summed over workers
+	ULONGLONG FilesSeen = 0;
+	ULONGLONG FilesOpened = 0;
+	ULONGLONG FilesParsed = 0;
+	ULONGLONG FilesCached = 0;			// Taken from the content cache instead of parsed
+	ULONGLONG FilesLinked = 0;			// Paths of a file already read through another path
+	ULONGLONG FilesMatched = 0;
+	ULONGLONG Rejected[NumRejectFunctions][NumRejectCodes] = {};
+	ULONGLONG Reads = 0;
+	ULONGLONG Seeks = 0;
+	ULONGLONG BytesRead = 0;
+	ULONGLONG Steps = 0;				// Iterations of the reader's loops and section searches, which the read budget does not charge
+	ULONGLONG Latency[32] = {};				// Files by log2 of their latency in microseconds
+};
+
+extern thread_local ScanStats *t_pStats;
+
+// Spans for --trace, each worker records into its own ring, so recording takes no lock
+// A full ring overwrites its oldest spans, Head only ever grows, so Head - Capacity spans were dropped
+struct TraceSpan
+{
+	ULONGLONG Start;
+	ULONGLONG Duration;
+	size_t File;		// Path index, TraceNoFile for spans that are not about a file
+	int Stage;			// ScanStage, or NumScanStages for the span of a whole file
+};
+
+const size_t TraceNoFile = (size_t)-1;
+const size_t TraceRingCapacity = 1 << 20;
+
+struct TraceRing
+{
+	std::vector<TraceSpan> Spans;
+	std::atomic<ULONGLONG> Head{ 0 };
+};
+
+extern thread_local TraceRing *t_pTrace;
+extern thread_local size_t t_TraceFile;
+
+ULONGLONG
+StatClock();
+
+void
+TraceRecord(
+	int Stage,
+	ULONGLONG Start,
+	ULONGLONG Duration
+);
+
+// Adds the time since the last lap to a stage, the clock is only read when --stats or --trace is on
+struct StageClock
+{
+	ULONGLONG Last = t_pStats || t_pTrace ? StatClock() : 0;
+
+	void
+	Lap(
+		ScanStage Stage
+	)
+	{
+		if ( !t_pStats && !t_pTrace )
+			return;
+
+		ULONGLONG Now = StatClock();
+
+		if ( t_pStats )
+			t_pStats->StageTime[Stage] += Now - Last;
+
+		if ( t_pTrace )
+			TraceRecord( Stage, Last, Now - Last );
+
+		Last = Now;
+	}
+};
+
+// fread and fseek, counted for --stats
+size_t
+StatRead(
+	void *Buffer,
+	size_t Size,
+	size_t Count,
+	FILE *f
+);
+
+int
+StatSeek(
+	FILE *f,
+	long Offset,
+	int Origin
+);
@@ -0,0 +1,807 @@
+#include "ziparchive.h"
+#include "scanstats.h"
+
+#include <algorithm>
+#include <string.h>
+
+// Codes up to this long are decoded with one table lookup, longer codes a bit at a time
+const int InflateFastBits = 10;
+
+struct InflateHuffman
+{
+	uint16_t Fast[1 << InflateFastBits];	// Symbol << 4 | length, 0 when the code is longer, or not a code
+	uint16_t Count[16];						// Codes of each length
+	uint16_t Symbol[288];					// Symbols ordered by code
+};
+
+struct InflateState
+{
+	const uint8_t *In;
+	size_t InSize;
+	size_t InPos;
+	ULONGLONG Bits;
+	int numBits;
+	size_t Padding;		// Zero bytes added past the end of the input
+};
+
+static const uint16_t LengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t LengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t DistanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t DistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t CodeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Fill the bit buffer to at least 57 bits, a word at a time away from the end of the input
+static void
+InflateRefill(
+	InflateState& State
+)
+{
+	if ( State.InPos + 8 <= State.InSize )
+	{
+		// Bits above numBits are either zero or the bytes that follow, so they can be ORed in again
+		ULONGLONG Word;
+		memcpy( &Word, State.In + State.InPos, 8 );
+		State.Bits |= Word << State.numBits;
+
+		int Bytes = ( 63 - State.numBits ) >> 3;
+		State.InPos += Bytes;
+		State.numBits += Bytes * 8;
+		return;
+	}
+
+	while ( State.numBits <= 56 )
+	{
+		ULONGLONG Byte = 0;
+
+		if ( State.InPos < State.InSize )
+			Byte = State.In[State.InPos++];
+		else
+			State.Padding++;
+
+		State.Bits |= Byte << State.numBits;
+		State.numBits += 8;
+	}
+}
+
+static DWORD
+InflateBits(
+	InflateState& State,
+	int Count
+)
+{
+	if ( State.numBits < Count )
+		InflateRefill( State );
+
+	DWORD Value = (DWORD)( State.Bits & ( ( 1ull << Count ) - 1 ) );
+	State.Bits >>= Count;
+	State.numBits -= Count;
+
+	return Value;
+}
+
+// Build the canonical code of the code lengths, 0 on success, incomplete codes are allowed as zlib does
+static int
+InflateBuild(
+	InflateHuffman& Huffman,
+	const uint8_t *Lengths,
+	int numSymbols
+)
+{
+	memset( Huffman.Count, 0, sizeof( Huffman.Count ) );
+
+	for ( int i = 0; i < numSymbols; i++ )
+		Huffman.Count[Lengths[i]]++;
+
+	Huffman.Count[0] = 0;
+
+	// Over subscribed
+	int Left = 1;
+
+	for ( int Length = 1; Length < 16; Length++ )
+	{
+		Left = ( Left << 1 ) - Huffman.Count[Length];
+
+		if ( Left < 0 )
+			return 1;
+	}
+
+	uint16_t Offsets[16];
+	uint16_t NextCode[16];
+	Offsets[1] = 0;
+	NextCode[1] = 0;
+
+	for ( int Length = 1; Length < 15; Length++ )
+	{
+		Offsets[Length + 1] = Offsets[Length] + Huffman.Count[Length];
+		NextCode[Length + 1] = ( NextCode[Length] + Huffman.Count[Length] ) << 1;
+	}
+
+	memset( Huffman.Fast, 0, sizeof( Huffman.Fast ) );
+
+	for ( int i = 0; i < numSymbols; i++ )
+	{
+		int Length = Lengths[i];
+
+		if ( !Length )
+			continue;
+
+		Huffman.Symbol[Offsets[Length]++] = (uint16_t)i;
+
+		int Code = NextCode[Length]++;
+
+		if ( Length > InflateFastBits )
+			continue;
+
+		// Codes are packed from their most significant bit, the table is indexed by the bits as they come
+		int Reversed = 0;
+
+		for ( int k = 0; k < Length; k++ )
+			Reversed |= ( ( Code >> k ) & 1 ) << ( Length - 1 - k );
+
+		for ( int k = Reversed; k < ( 1 << InflateFastBits ); k += 1 << Length )
+			Huffman.Fast[k] = (uint16_t)( i << 4 | Length );
+	}
+
+	return 0;
+}
+
+// Next symbol, or -1 when the bits are not a code
+static int
+InflateDecode(
+	InflateState& State,
+	const InflateHuffman& Huffman
+)
+{
+	if ( State.numBits < 15 )
+		InflateRefill( State );
+
+	uint16_t Entry = Huffman.Fast[State.Bits & ( ( 1 << InflateFastBits ) - 1 )];
+
+	if ( Entry )
+	{
+		State.Bits >>= Entry & 15;
+		State.numBits -= Entry & 15;
+		return Entry >> 4;
+	}
+
+	int Code = 0;
+	int First = 0;
+	int Index = 0;
+
+	for ( int Length = 1; Length < 16; Length++ )
+	{
+		Code |= (int)( ( State.Bits >> ( Length - 1 ) ) & 1 );
+
+		int Count = Huffman.Count[Length];
+
+		if ( Code - First < Count )
+		{
+			State.Bits >>= Length;
+			State.numBits -= Length;
+			return Huffman.Symbol[Index + Code - First];
+		}
+
+		Index += Count;
+		First = ( First + Count ) << 1;
+		Code <<= 1;
+	}
+
+	return -1;
+}
+
+static const InflateHuffman *
+InflateFixedCodes()
+{
+	static const InflateHuffman *Codes = []()
+	{
+		static InflateHuffman Fixed[2];
+		uint8_t Lengths[288];
+
+		memset( Lengths, 8, 144 );
+		memset( Lengths + 144, 9, 112 );
+		memset( Lengths + 256, 7, 24 );
+		memset( Lengths + 280, 8, 8 );
+		InflateBuild( Fixed[0], Lengths, 288 );
+
+		memset( Lengths, 5, 30 );
+		InflateBuild( Fixed[1], Lengths, 30 );
+
+		return Fixed;
+	}();
+
+	return Codes;
+}
+
+static int
+InflateDynamicCodes(
+	InflateState& State,
+	InflateHuffman& LiteralCodes,
+	InflateHuffman& DistanceCodes
+)
+{
+	int numLiterals = InflateBits( State, 5 ) + 257;
+	int numDistances = InflateBits( State, 5 ) + 1;
+	int numCodeLengths = InflateBits( State, 4 ) + 4;
+
+	if ( numLiterals > 286 || numDistances > 30 )
+		return 1;
+
+	uint8_t Lengths[286 + 30] = {};
+
+	for ( int i = 0; i < numCodeLengths; i++ )
+		Lengths[CodeLengthOrder[i]] = (uint8_t)InflateBits( State, 3 );
+
+	InflateHuffman CodeLengthCodes;
+
+	if ( 0 != InflateBuild( CodeLengthCodes, Lengths, 19 ) )
+		return 2;
+
+	memset( Lengths, 0, 19 );
+
+	for ( int i = 0; i < numLiterals + numDistances; )
+	{
+		int Symbol = InflateDecode( State, CodeLengthCodes );
+
+		if ( Symbol < 0 )
+			return 3;
+
+		if ( Symbol < 16 )
+		{
+			Lengths[i++] = (uint8_t)Symbol;
+			continue;
+		}
+
+		uint8_t Repeated = 0;
+		int Repeat;
+
+		if ( Symbol == 16 )
+		{
+			if ( !i )
+				return 4;
+
+			Repeated = Lengths[i - 1];
+			Repeat = 3 + InflateBits( State, 2 );
+		}
+		else if ( Symbol == 17 )
+			Repeat = 3 + InflateBits( State, 3 );
+		else
+			Repeat = 11 + InflateBits( State, 7 );
+
+		if ( i + Repeat > numLiterals + numDistances )
+			return 5;
+
+		memset( Lengths + i, Repeated, Repeat );
+		i += Repeat;
+	}
+
+	// A block without an end code
+	if ( !Lengths[256] )
+		return 6;
+
+	if ( 0 != InflateBuild( LiteralCodes, Lengths, numLiterals ) || 0 != InflateBuild( DistanceCodes, Lengths + numLiterals, numDistances ) )
+		return 7;
+
+	return 0;
+}
+
+int
+Inflate(
+	const uint8_t *In,
+	size_t InSize,
+	uint8_t *Out,
+	size_t OutSize
+)
+{
+	InflateState State = { In, InSize, 0, 0, 0, 0 };
+	InflateHuffman DynamicCodes[2];
+	size_t OutPos = 0;
+	DWORD Final;
+
+	do
+	{
+		Final = InflateBits( State, 1 );
+		DWORD Type = InflateBits( State, 2 );
+
+		if ( Type == 0 )
+		{
+			// Stored, byte aligned, give back the whole bytes in the bit buffer
+			InflateBits( State, State.numBits & 7 );
+
+			size_t Unread = State.numBits / 8;
+
+			if ( Unread < State.Padding )
+				return 1;
+
+			State.InPos -= Unread - State.Padding;
+			State.Bits = 0;
+			State.numBits = 0;
+			State.Padding = 0;
+
+			if ( State.InSize - State.InPos < 4 )
+				return 1;
+
+			DWORD Length = In[State.InPos] | In[State.InPos + 1] << 8;
+			DWORD Complement = In[State.InPos + 2] | In[State.InPos + 3] << 8;
+			State.InPos += 4;
+
+			if ( Length != ( ~Complement & 0xffff ) || Length > State.InSize - State.InPos || Length > OutSize - OutPos )
+				return 2;
+
+			memcpy( Out + OutPos, In + State.InPos, Length );
+			State.InPos += Length;
+			OutPos += Length;
+			continue;
+		}
+
+		const InflateHuffman *LiteralCodes = InflateFixedCodes();
+		const InflateHuffman *DistanceCodes = LiteralCodes + 1;
+
+		if ( Type == 2 )
+		{
+			if ( 0 != InflateDynamicCodes( State, DynamicCodes[0], DynamicCodes[1] ) )
+				return 3;
+
+			LiteralCodes = &DynamicCodes[0];
+			DistanceCodes = &DynamicCodes[1];
+		}
+		else if ( Type != 1 )
+			return 4;
+
+		for ( ;; )
+		{
+			int Symbol = InflateDecode( State, *LiteralCodes );
+
+			if ( Symbol < 256 )
+			{
+				if ( Symbol < 0 || OutPos == OutSize )
+					return 5;
+
+				Out[OutPos++] = (uint8_t)Symbol;
+				continue;
+			}
+
+			if ( Symbol == 256 )
+				break;
+
+			Symbol -= 257;
+
+			if ( Symbol >= 29 )
+				return 6;
+
+			size_t Length = LengthBase[Symbol] + InflateBits( State, LengthExtra[Symbol] );
+			int DistanceSymbol = InflateDecode( State, *DistanceCodes );
+
+			if ( DistanceSymbol < 0 || DistanceSymbol >= 30 )
+				return 7;
+
+			size_t Distance = DistanceBase[DistanceSymbol] + InflateBits( State, DistanceExtra[DistanceSymbol] );
+
+			if ( Distance > OutPos || Length > OutSize - OutPos )
+				return 8;
+
+			// Matches may overlap what they copy
+			if ( Distance >= Length )
+				memcpy( Out + OutPos, Out + OutPos - Distance, Length );
+			else
+			{
+				for ( size_t i = 0; i < Length; i++ )
+					Out[OutPos + i] = Out[OutPos + i - Distance];
+			}
+
+			OutPos += Length;
+		}
+
+		// Read past the end of the input
+		if ( (size_t)State.numBits < State.Padding * 8 )
+			return 9;
+	}
+	while ( !Final );
+
+	return OutPos == OutSize ? 0 : 10;
+}
+
+DWORD
+Crc32(
+	const uint8_t *Data,
+	size_t Size
+)
+{
+	static const DWORD *Table = []()
+	{
+		static DWORD Entries[256];
+
+		for ( DWORD i = 0; i < 256; i++ )
+		{
+			DWORD Value = i;
+
+			for ( int k = 0; k < 8; k++ )
+				Value = Value & 1 ? 0xedb88320 ^ ( Value >> 1 ) : Value >> 1;
+
+			Entries[i] = Value;
+		}
+
+		return Entries;
+	}();
+
+	DWORD Crc = 0xffffffff;
+
+	for ( size_t i = 0; i < Size; i++ )
+		Crc = Table[( Crc ^ Data[i] ) & 0xff] ^ ( Crc >> 8 );
+
+	return ~Crc;
+}
+
+static WORD
+ZipWord(
+	const uint8_t *Data
+)
+{
+	return (WORD)( Data[0] | Data[1] << 8 );
+}
+
+static DWORD
+ZipDword(
+	const uint8_t *Data
+)
+{
+	DWORD Value;
+	memcpy( &Value, Data, sizeof( Value ) );
+	return Value;
+}
+
+static ULONGLONG
+ZipQword(
+	const uint8_t *Data
+)
+{
+	ULONGLONG Value;
+	memcpy( &Value, Data, sizeof( Value ) );
+	return Value;
+}
+
+// Archives can be larger than a long reaches
+static int
+ZipSeek(
+	FILE *f,
+	ULONGLONG Offset,
+	int Origin
+)
+{
+	if ( t_pStats )
+		t_pStats->Seeks++;
+
+	return _fseeki64( f, (long long)Offset, Origin );
+}
+
+static ULONGLONG
+ZipTell(
+	FILE *f
+)
+{
+	return (ULONGLONG)_ftelli64( f );
+}
+
+const DWORD ZipEndSignature = 0x06054b50;
+const DWORD ZipEnd64LocatorSignature = 0x07064b50;
+const DWORD ZipEnd64Signature = 0x06064b50;
+const DWORD ZipCentralSignature = 0x02014b50;
+const DWORD ZipLocalSignature = 0x04034b50;
+
+const size_t ZipEndSize = 22;
+const size_t ZipEnd64LocatorSize = 20;
+const size_t ZipEnd64Size = 56;
+const size_t ZipCentralSize = 46;
+const size_t ZipLocalSize = 30;
+
+// Encrypted, or strongly encrypted
+const WORD ZipEncryptedFlags = 0x41;
+
+// The sizes follow the data, the local header holds zeros
+const WORD ZipDataDescriptorFlag = 0x08;
+
+// Replace the sizes and offset that did not fit in 32 bits with the ones in the zip64 extra field
+static bool
+ReadZip64Extra(
+	const uint8_t *Extra,
+	size_t ExtraSize,
+	ZipEntry& Entry
+)
+{
+	for ( size_t Pos = 0; Pos + 4 <= ExtraSize; )
+	{
+		WORD Id = ZipWord( Extra + Pos );
+		WORD Size = ZipWord( Extra + Pos + 2 );
+		const uint8_t *Field = Extra + Pos + 4;
+		const uint8_t *End = Field + std::min<size_t>( Size, ExtraSize - Pos - 4 );
+
+		Pos += 4 + Size;
+
+		if ( Id != 1 )
+			continue;
+
+		ULONGLONG *Values[3] = { &Entry.UncompressedSize, &Entry.CompressedSize, &Entry.LocalHeaderOffset };
+
+		for ( ULONGLONG *Value : Values )
+		{
+			if ( *Value != 0xffffffff )
+				continue;
+
+			if ( Field + 8 > End )
+				return false;
+
+			*Value = ZipQword( Field );
+			Field += 8;
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+static bool
+ZipNameHasExtension(
+	const std::string& Name,
+	const std::vector<std::string>& Extensions
+)
+{
+	for ( const std::string& Extension : Extensions )
+	{
+		size_t Length = Extension.size();
+
+		// Not a directory, and not just the extension
+		if ( Name.size() > Length && Name[Name.size() - Length - 1] != '/' && 0 == Name.compare( Name.size() - Length, Length, Extension ) )
+			return true;
+	}
+
+	return false;
+}
+
+static int
+ReadCentralDirectory(
+	FILE *f,
+	const char *const Path,
+	const std::vector<std::string>& Extensions,
+	ZipArchive& Archive
+)
+{
+	if ( 0 != ZipSeek( f, 0, SEEK_END ) )
+		return 2;
+
+	// The end record is at the end, followed by a comment of up to 64k
+	ULONGLONG FileSize = ZipTell( f );
+	size_t TailSize = (size_t)std::min<ULONGLONG>( FileSize, ZipEndSize + 0xffff );
+	std::vector<uint8_t> Buffer( TailSize );
+
+	if ( TailSize < ZipEndSize || 0 != ZipSeek( f, FileSize - TailSize, SEEK_SET ) || 1 != StatRead( Buffer.data(), TailSize, 1, f ) )
+	{
+		fprintf( stderr, "%s - Too small to be a zip archive\n", Path );
+		return 3;
+	}
+
+	size_t End = TailSize - ZipEndSize + 1;
+
+	while ( End-- > 0 && ZipDword( &Buffer[End] ) != ZipEndSignature )
+		;
+
+	if ( End == (size_t)-1 )
+	{
+		fprintf( stderr, "%s - End of central directory not found\n", Path );
+		return 4;
+	}
+
+	const uint8_t *EndRecord = &Buffer[End];
+	ULONGLONG numEntries = ZipWord( EndRecord + 10 );
+	ULONGLONG DirectorySize = ZipDword( EndRecord + 12 );
+	ULONGLONG DirectoryOffset = ZipDword( EndRecord + 16 );
+
+	if ( numEntries == 0xffff || DirectorySize == 0xffffffff || DirectoryOffset == 0xffffffff )
+	{
+		// Zip64, the locator just before the end record points to the zip64 end record
+		uint8_t End64[ZipEnd64Size];
+
+		if ( End < ZipEnd64LocatorSize || ZipDword( EndRecord - ZipEnd64LocatorSize ) != ZipEnd64LocatorSignature ||
+			0 != ZipSeek( f, ZipQword( EndRecord - ZipEnd64LocatorSize + 8 ), SEEK_SET ) || 1 != StatRead( End64, sizeof( End64 ), 1, f ) ||
+			ZipDword( End64 ) != ZipEnd64Signature )
+		{
+			fprintf( stderr, "%s - Zip64 end of central directory not found\n", Path );
+			return 5;
+		}
+
+		numEntries = ZipQword( End64 + 32 );
+		DirectorySize = ZipQword( End64 + 40 );
+		DirectoryOffset = ZipQword( End64 + 48 );
+	}
+	else if ( ZipWord( EndRecord + 4 ) || ZipWord( EndRecord + 6 ) )
+	{
+		fprintf( stderr, "%s - Archives split over disks are not supported\n", Path );
+		return 6;
+	}
+
+	if ( DirectoryOffset > FileSize || DirectorySize > FileSize - DirectoryOffset || DirectorySize > ZipMaxEntrySize )
+	{
+		fprintf( stderr, "%s - Central directory out of the file\n", Path );
+		return 7;
+	}
+
+	// The one read of the directory, entries are only parsed from memory after this
+	Buffer.resize( (size_t)DirectorySize );
+
+	if ( DirectorySize && ( 0 != ZipSeek( f, DirectoryOffset, SEEK_SET ) || 1 != StatRead( Buffer.data(), (size_t)DirectorySize, 1, f ) ) )
+	{
+		fprintf( stderr, "%s - Central directory truncated\n", Path );
+		return 8;
+	}
+
+	size_t Pos = 0;
+
+	for ( ULONGLONG i = 0; i < numEntries; i++ )
+	{
+		if ( Buffer.size() - Pos < ZipCentralSize || ZipDword( &Buffer[Pos] ) != ZipCentralSignature )
+		{
+			fprintf( stderr, "%s - Corrupted central directory entry %llu\n", Path, i );
+			return 9;
+		}
+
+		const uint8_t *Record = &Buffer[Pos];
+		WORD Flags = ZipWord( Record + 8 );
+		size_t NameSize = ZipWord( Record + 28 );
+		size_t ExtraSize = ZipWord( Record + 30 );
+		size_t CommentSize = ZipWord( Record + 32 );
+
+		if ( Buffer.size() - Pos - ZipCentralSize < NameSize + ExtraSize + CommentSize )
+		{
+			fprintf( stderr, "%s - Corrupted central directory entry %llu\n", Path, i );
+			return 9;
+		}
+
+		Pos += ZipCentralSize + NameSize + ExtraSize + CommentSize;
+
+		ZipEntry Entry;
+		Entry.Name.assign( (const char *)Record + ZipCentralSize, NameSize );
+
+		if ( !ZipNameHasExtension( Entry.Name, Extensions ) )
+			continue;
+
+		Entry.Method = ZipWord( Record + 10 );
+		Entry.Crc = ZipDword( Record + 16 );
+		Entry.CompressedSize = ZipDword( Record + 20 );
+		Entry.UncompressedSize = ZipDword( Record + 24 );
+		Entry.LocalHeaderOffset = ZipDword( Record + 42 );
+
+		bool bZip64 = Entry.CompressedSize == 0xffffffff || Entry.UncompressedSize == 0xffffffff || Entry.LocalHeaderOffset == 0xffffffff;
+
+		if ( bZip64 && !ReadZip64Extra( Record + ZipCentralSize + NameSize, ExtraSize, Entry ) )
+			fprintf( stderr, "%s/%s - Zip64 sizes not found\n", Path, Entry.Name.c_str() );
+		else if ( Flags & ZipEncryptedFlags )
+			fprintf( stderr, "%s/%s - Encrypted member skipped\n", Path, Entry.Name.c_str() );
+		else if ( Entry.Method != ZipStored && Entry.Method != ZipDeflated )
+			fprintf( stderr, "%s/%s - Compression method %u not supported\n", Path, Entry.Name.c_str(), Entry.Method );
+		else if ( Entry.UncompressedSize > ZipMaxEntrySize || Entry.CompressedSize > ZipMaxEntrySize )
+			fprintf( stderr, "%s/%s - Member too large\n", Path, Entry.Name.c_str() );
+		else if ( Entry.LocalHeaderOffset > FileSize || Entry.CompressedSize > FileSize - Entry.LocalHeaderOffset )
+			fprintf( stderr, "%s/%s - Member out of the file\n", Path, Entry.Name.c_str() );
+		else if ( Entry.Method == ZipDeflated && Entry.UncompressedSize > Entry.CompressedSize * ZipMaxDeflateRatio )
+			fprintf( stderr, "%s/%s - Member larger than its data can inflate to\n", Path, Entry.Name.c_str() );
+		else
+			Archive.Entries.push_back( std::move( Entry ) );
+	}
+
+	return 0;
+}
+
+int
+ReadZipDirectory(
+	const std::string& Path,
+	const std::vector<std::string>& Extensions,
+	ZipArchive& Archive
+)
+{
+	Archive.Path = Path;
+	Archive.Entries.clear();
+
+	FILE *f = NULL;
+	if ( 0 != fopen_s( &f, Path.c_str(), "rb" ) || !f )
+	{
+		fprintf( stderr, "%s - Could not open archive\n", Path.c_str() );
+		return 1;
+	}
+
+	int Result = ReadCentralDirectory( f, Path.c_str(), Extensions, Archive );
+
+	fclose( f );
+	return Result;
+}
+
+void
+CloseZipReader(
+	ZipReader& Reader
+)
+{
+	if ( Reader.File )
+		fclose( Reader.File );
+
+	Reader.File = NULL;
+	Reader.Archive = NULL;
+}
+
+int
+ReadZipMember(
+	const ZipArchive& Archive,
+	size_t Entry,
+	ZipReader& Reader
+)
+{
+	const ZipEntry& Member = Archive.Entries[Entry];
+	const char *const Path = Archive.Path.c_str();
+	const char *const Name = Member.Name.c_str();
+
+	// Members of one archive usually come one after the other, so its file is kept open
+	if ( Reader.Archive != &Archive )
+	{
+		CloseZipReader( Reader );
+
+		if ( 0 != fopen_s( &Reader.File, Path, "rb" ) || !Reader.File )
+		{
+			Reader.File = NULL;
+			fprintf( stderr, "%s - Could not open archive\n", Path );
+			return 1;
+		}
+
+		Reader.Archive = &Archive;
+	}
+
+	FILE *f = Reader.File;
+	uint8_t Header[ZipLocalSize];
+
+	if ( 0 != ZipSeek( f, Member.LocalHeaderOffset, SEEK_SET ) || 1 != StatRead( Header, sizeof( Header ), 1, f ) || ZipDword( Header ) != ZipLocalSignature )
+	{
+		fprintf( stderr, "%s/%s - Local header not found\n", Path, Name );
+		return 2;
+	}
+
+	// The local name and extra field can differ from the central directory, only their sizes are used
+	ULONGLONG DataOffset = Member.LocalHeaderOffset + ZipLocalSize + ZipWord( Header + 26 ) + ZipWord( Header + 28 );
+
+	if ( Member.Method == ZipStored && Member.CompressedSize != Member.UncompressedSize )
+	{
+		fprintf( stderr, "%s/%s - Stored member sizes differ\n", Path, Name );
+		return 3;
+	}
+
+	// Checked before the buffers are sized, the local sizes are zero when a data descriptor follows, and all ones for zip64
+	DWORD LocalCompressedSize = ZipDword( Header + 18 );
+	DWORD LocalUncompressedSize = ZipDword( Header + 22 );
+
+	if ( !( ZipWord( Header + 6 ) & ZipDataDescriptorFlag ) && LocalCompressedSize != 0xffffffff && LocalUncompressedSize != 0xffffffff &&
+		( LocalCompressedSize != Member.CompressedSize || LocalUncompressedSize != Member.UncompressedSize ) )
+	{
+		fprintf( stderr, "%s/%s - Local sizes differ from the central directory\n", Path, Name );
+		return 7;
+	}
+
+	// Stored members are read straight into the data buffer
+	std::vector<uint8_t>& Target = Member.Method == ZipStored ? Reader.Data : Reader.Compressed;
+	Reader.Data.resize( (size_t)Member.UncompressedSize );
+	Target.resize( (size_t)Member.CompressedSize );
+
+	if ( Member.CompressedSize && ( 0 != ZipSeek( f, DataOffset, SEEK_SET ) || 1 != StatRead( Target.data(), Target.size(), 1, f ) ) )
+	{
+		fprintf( stderr, "%s/%s - Member data truncated\n", Path, Name );
+		return 4;
+	}
+
+	if ( Member.Method == ZipDeflated && 0 != Inflate( Reader.Compressed.data(), Reader.Compressed.size(), Reader.Data.data(), Reader.Data.size() ) )
+	{
+		fprintf( stderr, "%s/%s - Could not inflate member\n", Path, Name );
+		return 5;
+	}
+
+	if ( Crc32( Reader.Data.data(), Reader.Data.size() ) != Member.Crc )
+	{
+		fprintf( stderr, "%s/%s - Member crc mismatch\n", Path, Name );
+		return 6;
+	}
+
+	return 0;
+}
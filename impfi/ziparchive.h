@@ -0,0 +1,86 @@
+#pragma once
+
+// Zip archives scanned in place with --zip, members are inflated into a buffer kept by each worker and parsed from memory
+// Stored and deflated members are read, zip64 archives included, encrypted and other methods are skipped
+
+#include <Windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+enum ZipMethod
+{
+	ZipStored = 0,
+	ZipDeflated = 8
+};
+
+// A member from the central directory
+struct ZipEntry
+{
+	std::string Name;
+	WORD Method;
+	DWORD Crc;
+	ULONGLONG CompressedSize;
+	ULONGLONG UncompressedSize;
+	ULONGLONG LocalHeaderOffset;
+};
+
+struct ZipArchive
+{
+	std::string Path;
+	std::vector<ZipEntry> Entries;		// Only the members with one of the extensions
+};
+
+// The largest member inflated, far above any driver or dll, each worker keeps a buffer as large as the largest member it read
+const ULONGLONG ZipMaxEntrySize = 0x10000000;
+
+// Deflate writes at most 258 bytes for every 2 bits, a member claiming more than this per compressed byte is not deflate data
+const ULONGLONG ZipMaxDeflateRatio = 1032;
+
+// Kept per worker, the archive stays open while the worker reads members of the same archive
+struct ZipReader
+{
+	FILE *File = NULL;
+	const ZipArchive *Archive = NULL;
+	std::vector<uint8_t> Compressed;
+	std::vector<uint8_t> Data;			// The last member read
+};
+
+// Read the central directory of an archive, keeping the members whose name ends with one of the extensions
+// Returns 0, or the step that failed
+int
+ReadZipDirectory(
+	const std::string& Path,
+	const std::vector<std::string>& Extensions,
+	ZipArchive& Archive
+);
+
+// Read and inflate a member into Reader.Data, checking its crc
+// Returns 0, or the step that failed
+int
+ReadZipMember(
+	const ZipArchive& Archive,
+	size_t Entry,
+	ZipReader& Reader
+);
+
+void
+CloseZipReader(
+	ZipReader& Reader
+);
+
+// Inflate a raw deflate stream into exactly OutSize bytes, 0 on success
+int
+Inflate(
+	const uint8_t *In,
+	size_t InSize,
+	uint8_t *Out,
+	size_t OutSize
+);
+
+DWORD
+Crc32(
+	const uint8_t *Data,
+	size_t Size
+);
@@ -0,0 +1,483 @@
+// Benchmarks of the impfi reader, micro benchmarks of its steps and end to end scans
+// Run it over a tree written by impfigen, results are written to stdout as json so runs can be compared between releases
+#include <Windows.h>
+#include <iostream>
+#include <filesystem>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include "../impfi/peimage.h"
+#include "../impfi/scanstats.h"
+
+// Bumped whenever a field changes meaning, fields are only ever added
+const int BenchSchemaVersion = 1;
+
+struct BenchOptions
+{
+	std::vector<size_t> Sizes;
+	std::vector<unsigned> Threads;
+	bool bWarm = true;
+	bool bCold = true;
+	int Repeat = 3;
+};
+
+// Timings of one run, the median of the repeats is reported
+struct ScanResult
+{
+	double Seconds;
+	ULONGLONG Bytes;
+	ULONGLONG Thunks;
+	ULONGLONG Matched;
+};
+
+static double
+Median(
+	std::vector<double> Values
+)
+{
+	std::sort( Values.begin(), Values.end() );
+	return Values[Values.size() / 2];
+}
+
+// Drop a file from the file cache, so the next read of it goes to the disk
+static void
+EvictFile(
+	const std::string& Path
+)
+{
+	// Opening a file without buffering purges its cached pages
+	HANDLE File = CreateFileA( Path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL );
+
+	if ( File != INVALID_HANDLE_VALUE )
+		CloseHandle( File );
+}
+
+// Nanoseconds to open and read a whole file
+static ULONGLONG
+TimeFileRead(
+	const std::string& Path
+)
+{
+	ULONGLONG Start = StatClock();
+	char Buffer[0x10000];
+
+	FILE *f = NULL;
+	if ( 0 == fopen_s( &f, Path.c_str(), "rb" ) && f )
+	{
+		while ( fread( Buffer, 1, sizeof( Buffer ), f ) == sizeof( Buffer ) )
+			;
+
+		fclose( f );
+	}
+
+	return StatClock() - Start;
+}
+
+// Whether EvictFile drops a file from the cache, it only purges the pages no other handle holds and reports nothing
+// The probe is evicted and read twice, a first read that is not clearly slower than the second came from the cache
+static bool
+CheckEviction(
+	const std::string& Probe
+)
+{
+	EvictFile( Probe );
+
+	ULONGLONG First = TimeFileRead( Probe );
+	ULONGLONG Second = TimeFileRead( Probe );
+
+	EvictFile( Probe );
+
+	return First > 2 * Second;
+}
+
+// Translate every rva of the image's sections, Count times
+static double
+BenchSectionRvaFileOffset(
+	int numSections,
+	size_t Count
+)
+{
+	IMAGE_FILE_HEADER FileHeader = {};
+	PeSections Sections( numSections );
+
+	FileHeader.NumberOfSections = (WORD)numSections;
+
+	for ( int i = 0; i < numSections; i++ )
+	{
+		memset( &Sections[i], 0, sizeof( Sections[i] ) );
+		Sections[i].VirtualAddress = 0x1000 * ( i + 1 );
+		Sections[i].Misc.VirtualSize = 0x1000;
+		Sections[i].PointerToRawData = 0x200 * ( i + 1 );
+	}
+
+	// Spread the lookups over every section, and a few misses
+	DWORD Sum = 0;
+	ULONGLONG Start = StatClock();
+
+	for ( size_t i = 0; i < Count; i++ )
+		Sum += SectionRvaFileOffset( &FileHeader, Sections, (DWORD)( ( i * 0x9e5 ) % ( ( numSections + 2 ) * 0x1000 ) ) );
+
+	ULONGLONG Elapsed = StatClock() - Start;
+
+	// Keep the loop from being optimized away
+	if ( Sum == 1 )
+		fprintf( stderr, "\n" );
+
+	return (double)Elapsed / Count;
+}
+
+const int WalkPasses = 3;
+
+// Walk the imports of already open files, then match the import list against them
+static void
+BenchImportWalk(
+	const std::vector<std::string>& Paths,
+	int numImports,
+	const char *const *const ppszImports,
+	double& WalkNsPerThunk,
+	double& WalkNsPerFile,
+	std::vector<double>& MatchNsPerThunk
+)
+{
+	PeImage Image;
+	ULONGLONG WalkTime = 0;
+	ULONGLONG Thunks = 0;
+	size_t Files = 0;
+	std::vector<PeImage> Images;
+	std::vector<ImportHit> Hits;
+
+	for ( const std::string& Path : Paths )
+	{
+		FILE *f = OpenImage( Path, false, Image, NULL );
+
+		if ( !f )
+			continue;
+
+		PeSource Source = { f, NULL, 0, 0 };
+
+		// Repeat the walk alone, the first pass only warms the cache
+		for ( int Pass = 0; Pass <= WalkPasses; Pass++ )
+		{
+			ULONGLONG Start = StatClock();
+
+			ReadImportDescriptors( &Source, &Image.NtHeaders.FileHeader, &Image.NtHeaders.OptionalHeader, Image.Sections, Image.ImportDescriptors, Image.ImportDllNames, Image.ImportThunkNames );
+
+			if ( Pass )
+				WalkTime += StatClock() - Start;
+		}
+
+		for ( const auto& Names : Image.ImportThunkNames )
+			Thunks += Names.size() * WalkPasses;
+
+		Files += WalkPasses;
+		fclose( f );
+
+		Images.push_back( Image );
+	}
+
+	WalkNsPerThunk = Thunks ? (double)WalkTime / Thunks : 0;
+	WalkNsPerFile = Files ? (double)WalkTime / Files : 0;
+
+	// The matcher over every parsed image, with growing import lists
+	MatchNsPerThunk.clear();
+
+	for ( int n = 1; n <= numImports; n *= 4 )
+	{
+		ULONGLONG MatchThunks = 0;
+		ULONGLONG Start = StatClock();
+
+		for ( const PeImage& Parsed : Images )
+		{
+			Hits.clear();
+			MatchThunkNames( Parsed.ImportThunkNames, n, ppszImports, HitImport, Hits );
+
+			for ( const auto& Names : Parsed.ImportThunkNames )
+				MatchThunks += Names.size();
+		}
+
+		MatchNsPerThunk.push_back( MatchThunks ? (double)( StatClock() - Start ) / MatchThunks : 0 );
+	}
+}
+
+// Scan the first Count paths on numThreads threads, the same work as impfi does per file
+static ScanResult
+Scan(
+	const std::vector<std::string>& Paths,
+	size_t Count,
+	unsigned numThreads,
+	int numImports,
+	const char *const *const ppszImports
+)
+{
+	std::atomic<size_t> Next( 0 );
+	std::atomic<ULONGLONG> Bytes( 0 );
+	std::atomic<ULONGLONG> Thunks( 0 );
+	std::atomic<ULONGLONG> Matched( 0 );
+	std::vector<std::thread> Workers;
+
+	auto Work = [&]()
+	{
+		PeImage Image;
+		std::vector<ImportHit> Hits;
+		ULONGLONG WorkerBytes = 0;
+		ULONGLONG WorkerThunks = 0;
+		ULONGLONG WorkerMatched = 0;
+
+		for ( size_t Index; ( Index = Next.fetch_add( 1 ) ) < Count; )
+		{
+			FILE *f = OpenImage( Paths[Index], false, Image, NULL );
+
+			if ( !f )
+				continue;
+
+			Hits.clear();
+
+			if ( MatchThunkNames( Image.ImportThunkNames, numImports, ppszImports, HitImport, Hits ) +
+				MatchThunkNames( Image.DelayImportThunkNames, numImports, ppszImports, HitDelayLoad, Hits ) )
+				WorkerMatched++;
+
+			for ( const auto& Names : Image.ImportThunkNames )
+				WorkerThunks += Names.size();
+
+			for ( const auto& Names : Image.DelayImportThunkNames )
+				WorkerThunks += Names.size();
+
+			// Reported as impfi reports it, the size of the file
+			fseek( f, 0, SEEK_END );
+			WorkerBytes += (ULONGLONG)ftell( f );
+
+			fclose( f );
+		}
+
+		Bytes += WorkerBytes;
+		Thunks += WorkerThunks;
+		Matched += WorkerMatched;
+	};
+
+	ULONGLONG Start = StatClock();
+
+	for ( unsigned i = 1; i < numThreads; i++ )
+		Workers.emplace_back( Work );
+
+	Work();
+
+	for ( auto& Worker : Workers )
+		Worker.join();
+
+	return { ( StatClock() - Start ) / 1e9, Bytes, Thunks, Matched };
+}
+
+// Comma separated numbers, e.g. 1000,10000
+template <typename T>
+static bool
+ParseList(
+	const char *pszValue,
+	std::vector<T>& List
+)
+{
+	List.clear();
+
+	for ( char *End = (char *)pszValue; *End; )
+	{
+		List.push_back( (T)strtoull( End, &End, 10 ) );
+
+		if ( !List.back() || ( *End && *End++ != ',' ) )
+			return false;
+	}
+
+	return !List.empty();
+}
+
+int main( int argc, char **argv )
+{
+	BenchOptions Options;
+	int argi = 1;
+
+	for ( ; argi < argc && 0 == strncmp( argv[argi], "--", 2 ); argi++ )
+	{
+		const char *const pszOption = argv[argi];
+		const char *const pszValue = argi + 1 < argc ? argv[argi + 1] : NULL;
+		bool bValid = pszValue != NULL;
+
+		if ( !bValid )
+			;
+		else if ( 0 == strcmp( pszOption, "--sizes" ) )
+			bValid = ParseList( pszValue, Options.Sizes );
+		else if ( 0 == strcmp( pszOption, "--threads" ) )
+			bValid = ParseList( pszValue, Options.Threads );
+		else if ( 0 == strcmp( pszOption, "--repeat" ) )
+			bValid = ( Options.Repeat = atoi( pszValue ) ) > 0;
+		else if ( 0 == strcmp( pszOption, "--cache" ) )
+		{
+			Options.bWarm = 0 != strcmp( pszValue, "cold" );
+			Options.bCold = 0 != strcmp( pszValue, "warm" );
+		}
+		else
+			bValid = false;
+
+		if ( !bValid )
+		{
+			printf( "Invalid option %s\n", pszOption );
+			return 1;
+		}
+
+		argi++;
+	}
+
+	if ( argc - argi < 2 )
+	{
+		printf( "Import Finder Benchmark - Times the impfi reader over a tree written by impfigen\n" );
+		printf( "\timpfibench [options] <directory> <ext> [imports...]\n" );
+		printf( "\timpfibench --sizes 1000,10000 --threads 1,4 corpus .sys IoCreateDevice\n" );
+		printf( "Options\n" );
+		printf( "\t--sizes <n,n>\t\tFiles per end to end scan, the first n files of the directory, defaults to 1000, 10000 and all\n" );
+		printf( "\t--threads <n,n>\t\tThreads per end to end scan, defaults to 1, 2, 4... up to the number of processors\n" );
+		printf( "\t--cache <warm|cold|both>\tRead files from the file cache, from the disk, or both, both\n" );
+		printf( "\t--repeat <n>\t\tRuns of each scan, the median is reported, 3\n" );
+		return 0;
+	}
+
+	const char *pszDirectory = argv[argi];
+	const char *pszExtension = argv[argi + 1];
+
+	// Imports default to a name every impfigen tree has
+	static const char *const DefaultImports[] = { "IoCreateDevice", "ZwOpenProcess", "ExAllocatePoolWithTag", "RtlInitUnicodeString", "KeInitializeSpinLock",
+		"ObReferenceObjectByHandle", "MmGetSystemRoutineAddress", "IoAllocateMdl", "FltRegisterFilter", "ZwClose", "IoDeleteDevice", "KeStallExecutionProcessor",
+		"ExFreePoolWithTag", "PsSetCreateProcessNotifyRoutine", "IoCreateSymbolicLink", "KeInitializeThreadedDpc" };
+
+	int numImports = argc - argi - 2;
+	const char *const *ppszImports = (const char *const *)&argv[argi + 2];
+
+	if ( !numImports )
+	{
+		numImports = sizeof( DefaultImports ) / sizeof( DefaultImports[0] );
+		ppszImports = DefaultImports;
+	}
+
+	std::vector<std::string> Paths;
+	std::error_code Error;
+
+	for ( const auto& Entry : std::filesystem::directory_iterator( pszDirectory, Error ) )
+	{
+		if ( Entry.is_regular_file() && Entry.path().extension() == pszExtension )
+			Paths.push_back( Entry.path().string() );
+	}
+
+	if ( Paths.empty() )
+	{
+		fprintf( stderr, "%s - No %s files found\n", pszDirectory, pszExtension );
+		return 1;
+	}
+
+	// Directory order differs between file systems, sorted paths make the subsets the same everywhere
+	std::sort( Paths.begin(), Paths.end() );
+
+	if ( Options.Sizes.empty() )
+	{
+		for ( size_t Size = 1000; Size < Paths.size(); Size *= 10 )
+			Options.Sizes.push_back( Size );
+
+		Options.Sizes.push_back( Paths.size() );
+	}
+
+	if ( Options.Threads.empty() )
+	{
+		unsigned numProcessors = std::max( 1u, std::thread::hardware_concurrency() );
+
+		for ( unsigned Threads = 1; Threads < numProcessors; Threads *= 2 )
+			Options.Threads.push_back( Threads );
+
+		Options.Threads.push_back( numProcessors );
+	}
+
+	printf( "{\n\t\"schema\": %i,\n\t\"directory\": \"%s\",\n\t\"files\": %zu,\n\t\"imports\": %i,\n", BenchSchemaVersion,
+		std::filesystem::path( pszDirectory ).filename().string().c_str(), Paths.size(), numImports );
+
+	// Micro benchmarks
+	fprintf( stderr, "Micro benchmarks\n" );
+	printf( "\t\"micro\": [\n" );
+
+	static const int SectionCounts[] = { 4, 16, 96 };
+
+	for ( int numSections : SectionCounts )
+		printf( "\t\t{ \"name\": \"SectionRvaFileOffset\", \"sections\": %i, \"ns_per_call\": %.2f },\n", numSections, BenchSectionRvaFileOffset( numSections, 10000000 ) );
+
+	double WalkNsPerThunk, WalkNsPerFile;
+	std::vector<double> MatchNsPerThunk;
+	std::vector<std::string> Sample( Paths.begin(), Paths.begin() + std::min<size_t>( Paths.size(), 1000 ) );
+
+	BenchImportWalk( Sample, numImports, ppszImports, WalkNsPerThunk, WalkNsPerFile, MatchNsPerThunk );
+
+	printf( "\t\t{ \"name\": \"ReadImportDescriptors\", \"files\": %zu, \"ns_per_file\": %.1f, \"ns_per_thunk\": %.2f }", Sample.size(), WalkNsPerFile, WalkNsPerThunk );
+
+	for ( size_t i = 0, n = 1; i < MatchNsPerThunk.size(); i++, n *= 4 )
+		printf( ",\n\t\t{ \"name\": \"MatchThunkNames\", \"imports\": %zu, \"ns_per_thunk\": %.2f }", n, MatchNsPerThunk[i] );
+
+	printf( "\n\t],\n" );
+
+	// End to end scans
+	printf( "\t\"scan\": [\n" );
+
+	bool bFirst = true;
+
+	for ( int Cold = 0; Cold < 2; Cold++ )
+	{
+		if ( Cold ? !Options.bCold : !Options.bWarm )
+			continue;
+
+		for ( size_t Size : Options.Sizes )
+		{
+			Size = std::min( Size, Paths.size() );
+
+			// Load the files into the cache once, a warm run starts with every file cached
+			if ( !Cold )
+				Scan( Paths, Size, Options.Threads.back(), numImports, ppszImports );
+
+			for ( unsigned Threads : Options.Threads )
+			{
+				std::vector<double> Seconds;
+				ScanResult Result = {};
+				bool bEvicted = true;
+
+				for ( int i = 0; i < Options.Repeat; i++ )
+				{
+					if ( Cold )
+					{
+						for ( size_t k = 0; k < Size; k++ )
+							EvictFile( Paths[k] );
+
+						if ( Size )
+							bEvicted = CheckEviction( Paths[Size - 1] ) && bEvicted;
+					}
+
+					Result = Scan( Paths, Size, Threads, numImports, ppszImports );
+					Seconds.push_back( Result.Seconds );
+				}
+
+				double Time = std::max( Median( Seconds ), 1e-9 );
+
+				fprintf( stderr, "%s scan, %zu file(s), %u thread(s) - %.3f s%s\n", Cold ? "Cold" : "Warm", Size, Threads, Time,
+					Cold && !bEvicted ? ", the files may not have been evicted" : "" );
+
+				printf( "%s\t\t{ \"cache\": \"%s\", \"files\": %zu, \"threads\": %u, \"seconds\": %.6f, \"files_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"ns_per_thunk\": %.2f, \"thunks\": %llu, \"matched\": %llu",
+					bFirst ? "" : ",\n", Cold ? "cold" : "warm", Size, Threads, Time, Size / Time, Result.Bytes / 1048576.0 / Time,
+					Result.Thunks ? Time * 1e9 / Result.Thunks : 0.0, Result.Thunks, Result.Matched );
+
+				// A cold scan whose files could not be shown to be evicted is best effort, and should not be tracked
+				if ( Cold )
+					printf( ", \"cold_evicted\": %s }", bEvicted ? "true" : "false" );
+				else
+					printf( " }" );
+
+				bFirst = false;
+			}
+		}
+	}
+
+	printf( "\n\t]\n}\n" );
+
+	return 0;
+}
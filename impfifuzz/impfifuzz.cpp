@@ -0,0 +1,331 @@
+// Fuzzer of the impfi reader, checks that no input makes ReadImage do more than linear work in the size of the input
+// Each input is read from memory and through a file as impfi reads it, counting the iterations of the reader's loops, which the read budget does not bound
+// Runs on its own, mutating the files of a directory such as one written by impfigen --corrupt, or as a libFuzzer target
+// when built with IMPFIFUZZ_LIBFUZZER defined, clang++ -DIMPFIFUZZ_LIBFUZZER -fsanitize=fuzzer,address
+#include <Windows.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+
+#include "../impfi/peimage.h"
+#include "../impfi/scanstats.h"
+
+// Every read and seek costs at least ReadCost from a budget of ReadBudgetPerByte per byte plus ReadBudgetSlack
+static ULONGLONG
+OperationBound(
+	size_t Size
+)
+{
+	return ( Size * ReadBudgetPerByte + ReadBudgetSlack ) / ReadCost;
+}
+
+// Each pass of the reader's loops reads or seeks, and it searches the sections at most once per read or seek
+// So its loop iterations are bounded by a search of every section per operation the budget allows, a loop that spins without reading goes past it
+static ULONGLONG
+StepBound(
+	size_t Size
+)
+{
+	return OperationBound( Size ) * ( MaxSections + 1 );
+}
+
+static bool
+WriteInput(
+	const std::string& Path,
+	const uint8_t *Data,
+	size_t Size
+)
+{
+	std::ofstream File( Path, std::ios::binary );
+	File.write( (const char *)Data, (std::streamsize)Size );
+	return (bool)File;
+}
+
+// The names read from the same input, through a file and from memory
+static bool
+SameNames(
+	const PeImage& Image,
+	const PeImage& FileImage
+)
+{
+	if ( Image.ImportDllNames != FileImage.ImportDllNames || Image.ImportThunkNames != FileImage.ImportThunkNames )
+		return false;
+
+	// A file reads names a chunk at a time, so it can run out of budget on delay imports or exports that fit it from memory
+	if ( !Image.DelayImportError.Step && !FileImage.DelayImportError.Step
+		&& ( Image.DelayImportDllNames != FileImage.DelayImportDllNames || Image.DelayImportThunkNames != FileImage.DelayImportThunkNames ) )
+		return false;
+
+	if ( !Image.ExportError.Step && !FileImage.ExportError.Step
+		&& ( Image.ExportNames != FileImage.ExportNames || Image.ExportForwarders != FileImage.ExportForwarders ) )
+		return false;
+
+	return true;
+}
+
+// Parse one input with its exports, from memory and through a file written to FilePath, counting what each costs
+// Returns NULL, or why the input failed
+static const char *
+CheckInput(
+	const uint8_t *Data,
+	size_t Size,
+	const std::string& FilePath,
+	PeImage& Image,
+	PeImage& FileImage,
+	ScanStats& Stats,
+	ScanStats& FileStats
+)
+{
+	Stats = ScanStats();
+	FileStats = ScanStats();
+
+	if ( !WriteInput( FilePath, Data, Size ) )
+		return "Could not be written";
+
+	t_pStats = &Stats;
+	int Result = ParseImage( Data, Size, true, Image, NULL );
+
+	t_pStats = &FileStats;
+	FILE *f = OpenImage( FilePath, true, FileImage, NULL );
+
+	t_pStats = NULL;
+
+	if ( f )
+		fclose( f );
+
+	if ( Stats.Steps > StepBound( Size ) )
+		return "More loop iterations than the bound, read from memory";
+
+	if ( FileStats.Steps > StepBound( Size ) )
+		return "More loop iterations than the bound, read from a file";
+
+	if ( 0 == Result && f && !SameNames( Image, FileImage ) )
+		return "Read differently from a file and from memory";
+
+	return NULL;
+}
+
+#ifdef IMPFIFUZZ_LIBFUZZER
+extern "C" int
+LLVMFuzzerTestOneInput(
+	const uint8_t *Data,
+	size_t Size
+)
+{
+	static PeImage Image;
+	static PeImage FileImage;
+	static ScanStats Stats;
+	static ScanStats FileStats;
+	static const std::string FilePath = ( std::filesystem::temp_directory_path() / ( "impfifuzz-" + std::to_string( GetCurrentProcessId() ) + ".bin" ) ).string();
+
+	if ( CheckInput( Data, Size, FilePath, Image, FileImage, Stats, FileStats ) )
+		abort();
+
+	return 0;
+}
+#else
+
+// Values that sit on the edges of the checks, written over counts, sizes and addresses
+static const DWORD InterestingValues[] = { 0, 1, 0x7f, 0x80, 0xff, 0x100, 0x1000, 0x7fff, 0x8000, 0xffff, 0x10000, 0x7fffffff, 0x80000000, 0xfffffffe, 0xffffffff };
+
+// Change the input in place, most changes land in the headers and section table, where the counts and addresses are
+static void
+MutateInput(
+	std::vector<uint8_t>& Input,
+	std::mt19937_64& Random
+)
+{
+	if ( Input.empty() )
+	{
+		Input.push_back( 0 );
+		return;
+	}
+
+	int numChanges = 1 + (int)( Random() % 4 );
+
+	for ( int i = 0; i < numChanges; i++ )
+	{
+		size_t Hot = std::min<size_t>( Input.size(), 0x400 );
+		size_t Offset = Random() % 4 ? Random() % Hot : Random() % Input.size();
+
+		switch ( Random() % 6 )
+		{
+		case 0:
+			Input[Offset] ^= (uint8_t)( 1 << ( Random() % 8 ) );
+			break;
+
+		case 1:
+			Input[Offset] = (uint8_t)Random();
+			break;
+
+		case 2:
+		case 3:
+		{
+			DWORD Value = InterestingValues[Random() % std::size( InterestingValues )];
+
+			// An address or size near the end of the input gets past the simple checks
+			if ( Random() % 3 == 0 )
+				Value = (DWORD)( Input.size() - Random() % 64 );
+
+			memcpy( &Input[Offset], &Value, std::min<size_t>( sizeof( Value ), Input.size() - Offset ) );
+			break;
+		}
+
+		case 4:
+			Input.resize( Offset + 1 );
+			break;
+
+		case 5:
+		{
+			// Repeat a chunk, tables that point into themselves come from this
+			size_t Length = std::min<size_t>( 1 + Random() % 256, Input.size() - Offset );
+			std::vector<uint8_t> Chunk( Input.begin() + Offset, Input.begin() + Offset + Length );
+			size_t Target = Random() % Input.size();
+
+			Input.insert( Input.begin() + Target, Chunk.begin(), Chunk.end() );
+			break;
+		}
+		}
+	}
+}
+
+int main( int argc, char **argv )
+{
+	ULONGLONG numIterations = 100000;
+	ULONGLONG Seed = 1;
+	int argi = 1;
+
+	for ( ; argi < argc && 0 == strncmp( argv[argi], "--", 2 ); argi++ )
+	{
+		const char *const pszOption = argv[argi];
+		const char *const pszValue = argi + 1 < argc ? argv[argi + 1] : NULL;
+
+		if ( pszValue && 0 == strcmp( pszOption, "--iterations" ) )
+			numIterations = strtoull( pszValue, NULL, 10 );
+		else if ( pszValue && 0 == strcmp( pszOption, "--seed" ) )
+			Seed = strtoull( pszValue, NULL, 10 );
+		else
+		{
+			printf( "Invalid option %s\n", pszOption );
+			return 1;
+		}
+
+		argi++;
+	}
+
+	if ( argc - argi < 1 )
+	{
+		printf( "Import Finder Fuzzer - Checks that no input makes the impfi reader do more than linear work in its size\n" );
+		printf( "\timpfifuzz [options] <directory>\n" );
+		printf( "\timpfifuzz --iterations 1000000 corpus\n" );
+		printf( "Options\n" );
+		printf( "\t--iterations <n>\tInputs to try, 100000\n" );
+		printf( "\t--seed <n>\t\tSeed of the mutations, the same seed and files always try the same inputs, 1\n" );
+		printf( "Inputs whose loops run more than the bound, or that read differently from a file, are written to impfifuzz-<n>.bin\n" );
+		return 0;
+	}
+
+	std::vector<std::vector<uint8_t>> Seeds;
+	std::vector<std::string> Paths;
+
+	for ( const auto& dirEntry : std::filesystem::directory_iterator( argv[argi] ) )
+	{
+		if ( dirEntry.is_regular_file() )
+			Paths.push_back( dirEntry.path().string() );
+	}
+
+	// Sorted so a seed means the same inputs on every file system
+	std::sort( Paths.begin(), Paths.end() );
+
+	for ( const std::string& Path : Paths )
+	{
+		std::ifstream File( Path, std::ios::binary );
+		Seeds.emplace_back( std::istreambuf_iterator<char>( File ), std::istreambuf_iterator<char>() );
+	}
+
+	if ( Seeds.empty() )
+	{
+		fprintf( stderr, "%s - No files to start from\n", argv[argi] );
+		return 1;
+	}
+
+	std::mt19937_64 Random( Seed );
+	PeImage Image;
+	PeImage FileImage;
+	ScanStats Stats;
+	ScanStats FileStats;
+	std::string FilePath = ( std::filesystem::temp_directory_path() / ( "impfifuzz-" + std::to_string( Seed ) + ".bin" ) ).string();
+	std::vector<uint8_t> Input;
+	ULONGLONG Parsed = 0;
+	ULONGLONG Rejected[NumRejectFunctions] = {};
+	ULONGLONG Limited = 0;
+	double MaxRatio = 0.0;
+	ULONGLONG Start = StatClock();
+
+	for ( ULONGLONG i = 0; i < numIterations; i++ )
+	{
+		Input = Seeds[Random() % Seeds.size()];
+		MutateInput( Input, Random );
+
+		const char *pszFailure = CheckInput( Input.data(), Input.size(), FilePath, Image, FileImage, Stats, FileStats );
+
+		// How close the input came to the bound
+		MaxRatio = std::max( MaxRatio, (double)std::max( Stats.Steps, FileStats.Steps ) / StepBound( Input.size() ) );
+
+		if ( Stats.FilesParsed )
+			Parsed++;
+
+		// Delay imports and exports that can not be read leave the image parsed without them
+		for ( const PeError& Partial : { Image.DelayImportError, Image.ExportError } )
+		{
+			if ( !Stats.FilesParsed || !Partial.Step )
+				continue;
+
+			Rejected[Partial.Step - 1]++;
+
+			if ( Partial.Code == PeErrorLimit )
+				Limited++;
+		}
+
+		for ( int Function = 0; Function < NumRejectFunctions; Function++ )
+		{
+			for ( int Code = 0; Code < NumRejectCodes; Code++ )
+			{
+				Rejected[Function] += Stats.Rejected[Function][Code];
+
+				if ( Code == PeErrorLimit )
+					Limited += Stats.Rejected[Function][Code];
+			}
+		}
+
+		if ( pszFailure )
+		{
+			std::string Path = "impfifuzz-" + std::to_string( i ) + ".bin";
+			WriteInput( Path, Input.data(), Input.size() );
+
+			fprintf( stderr, "%s - %s, %llu loop iteration(s) from memory and %llu from a file on %zu bytes, the bound is %llu\n", Path.c_str(),
+				pszFailure, Stats.Steps, FileStats.Steps, Input.size(), StepBound( Input.size() ) );
+			std::filesystem::remove( FilePath );
+			return 1;
+		}
+
+		if ( ( i + 1 ) % 100000 == 0 )
+			fprintf( stderr, "%llu input(s)\n", i + 1 );
+	}
+
+	std::filesystem::remove( FilePath );
+
+	printf( "Inputs - %llu, %llu parsed, %llu over a per file limit, %.1f s\n", numIterations, Parsed, Limited, ( StatClock() - Start ) / 1e9 );
+
+	for ( int Function = 0; Function < NumRejectFunctions; Function++ )
+		printf( "\t%s - %llu rejected\n", RejectNames[Function], Rejected[Function] );
+
+	printf( "Most work - %.1f%% of the bound\n", MaxRatio * 100.0 );
+
+	return 0;
+}
+#endif
@@ -0,0 +1,671 @@
+// Synthetic PE generator for reproducible impfi benchmarks
+// Writes PE32 and PE32+ images with imports, delay imports and exports, optionally corrupted
+// Only the standard library is used, so corpora can be generated on any platform
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+
+struct GeneratorOptions
+{
+	size_t numFiles = 1000;
+	uint64_t Seed = 1;
+	int Machine = 64;					// 32, 64, or 0 for both
+	int numSections = 4;				// At least 2, .text and .rdata
+	int MinDlls = 2;
+	int MaxDlls = 8;
+	int MinThunks = 4;
+	int MaxThunks = 64;
+	int MinNameLength = 6;
+	int MaxNameLength = 32;
+	int OrdinalPercent = 5;
+	int DelayPercent = 20;				// Files with delay imports
+	int MaxDelayDlls = 2;
+	int ExportPercent = 10;				// Files with exports
+	int MaxExports = 64;
+	int CorruptPercent = 0;
+	const char *pszExtension = ".sys";
+	unsigned numThreads = 0;
+};
+
+// splitmix64, the same stream on every platform and standard library, unlike <random> distributions
+struct Random
+{
+	uint64_t State;
+
+	uint64_t
+	Next()
+	{
+		uint64_t z = ( State += 0x9e3779b97f4a7c15ull );
+		z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+		z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebull;
+		return z ^ ( z >> 31 );
+	}
+
+	// Uniform in [Min, Max]
+	int
+	Range(
+		int Min,
+		int Max
+	)
+	{
+		return Max <= Min ? Min : Min + (int)( Next() % (uint64_t)( Max - Min + 1 ) );
+	}
+
+	bool
+	Percent(
+		int Chance
+	)
+	{
+		return Range( 0, 99 ) < Chance;
+	}
+};
+
+// Real names first, so corpora have something to search for
+static const char *const KnownImports[] = {
+	"IoCreateDevice", "IoDeleteDevice", "IoCreateSymbolicLink", "ZwOpenProcess", "ZwClose", "ExAllocatePoolWithTag",
+	"ExFreePoolWithTag", "KeInitializeSpinLock", "KeStallExecutionProcessor", "ObReferenceObjectByHandle", "PsSetCreateProcessNotifyRoutine",
+	"MmGetSystemRoutineAddress", "RtlInitUnicodeString", "FltRegisterFilter", "KeInitializeThreadedDpc", "IoAllocateMdl",
+};
+
+static const char *const NamePrefixes[] = { "Io", "Ke", "Ex", "Zw", "Nt", "Rtl", "Ob", "Ps", "Mm", "Se", "Fs", "Flt", "Wdf", "Hal", "Ndis", "Cm" };
+static const char *const NameWords[] = {
+	"Create", "Open", "Query", "Set", "Allocate", "Free", "Device", "Process", "Thread", "Object", "Pool", "Lock", "Acquire",
+	"Release", "Initialize", "Register", "Callback", "Information", "Value", "Key", "Section", "Map", "Unmap", "Wait", "Event",
+	"Timer", "Dpc", "Irp", "Complete", "Request", "Buffer", "Memory", "Security", "Token", "Handle", "Reference", "Notify",
+};
+
+static const char *const DllNames[] = {
+	"ntoskrnl.exe", "HAL.dll", "FLTMGR.SYS", "NDIS.SYS", "WDFLDR.SYS", "cng.sys", "ksecdd.sys", "CLASSPNP.SYS",
+	"storport.sys", "NETIO.SYS", "ks.sys", "USBD.SYS", "msrpc.sys", "WMILIB.SYS", "kernel32.dll", "advapi32.dll",
+};
+
+const int numDllNames = sizeof( DllNames ) / sizeof( DllNames[0] );
+
+// A made up api name of about Length characters
+static std::string
+MakeName(
+	Random& Rng,
+	int Length
+)
+{
+	if ( Rng.Percent( 10 ) )
+		return KnownImports[Rng.Range( 0, sizeof( KnownImports ) / sizeof( KnownImports[0] ) - 1 )];
+
+	std::string Name = NamePrefixes[Rng.Range( 0, sizeof( NamePrefixes ) / sizeof( NamePrefixes[0] ) - 1 )];
+
+	while ( (int)Name.size() < Length )
+		Name += NameWords[Rng.Range( 0, sizeof( NameWords ) / sizeof( NameWords[0] ) - 1 )];
+
+	Name.resize( Length );
+	return Name;
+}
+
+// Little endian image writer
+struct ImageBuffer
+{
+	std::vector<uint8_t> Data;
+
+	void
+	Put16(
+		size_t Offset,
+		uint32_t Value
+	)
+	{
+		Data[Offset] = (uint8_t)Value;
+		Data[Offset + 1] = (uint8_t)( Value >> 8 );
+	}
+
+	void
+	Put32(
+		size_t Offset,
+		uint32_t Value
+	)
+	{
+		Put16( Offset, Value & 0xffff );
+		Put16( Offset + 2, Value >> 16 );
+	}
+
+	void
+	Put64(
+		size_t Offset,
+		uint64_t Value
+	)
+	{
+		Put32( Offset, (uint32_t)Value );
+		Put32( Offset + 4, (uint32_t)( Value >> 32 ) );
+	}
+};
+
+// Section contents are laid out as they are built, Rva is where they will be loaded
+struct SectionBuilder
+{
+	std::vector<uint8_t> Data;
+	uint32_t Rva;
+
+	uint32_t
+	Align(
+		size_t Alignment
+	)
+	{
+		while ( Data.size() % Alignment )
+			Data.push_back( 0 );
+
+		return Rva + (uint32_t)Data.size();
+	}
+
+	uint32_t
+	Reserve(
+		size_t Size,
+		size_t Alignment
+	)
+	{
+		uint32_t Result = Align( Alignment );
+		Data.resize( Data.size() + Size, 0 );
+		return Result;
+	}
+
+	uint32_t
+	String(
+		const std::string& Value
+	)
+	{
+		uint32_t Result = Rva + (uint32_t)Data.size();
+		Data.insert( Data.end(), Value.begin(), Value.end() );
+		Data.push_back( 0 );
+		return Result;
+	}
+
+	// IMAGE_IMPORT_BY_NAME, a hint then the name
+	uint32_t
+	ImportByName(
+		Random& Rng,
+		const std::string& Name
+	)
+	{
+		uint32_t Result = Align( 2 );
+		uint16_t Hint = (uint16_t)Rng.Next();
+		Data.push_back( (uint8_t)Hint );
+		Data.push_back( (uint8_t)( Hint >> 8 ) );
+		String( Name );
+		return Result;
+	}
+
+	void
+	Put32(
+		uint32_t AtRva,
+		uint32_t Value
+	)
+	{
+		for ( int i = 0; i < 4; i++ )
+			Data[AtRva - Rva + i] = (uint8_t)( Value >> ( i * 8 ) );
+	}
+
+	void
+	PutThunk(
+		uint32_t AtRva,
+		uint64_t Value,
+		bool b64
+	)
+	{
+		Put32( AtRva, (uint32_t)Value );
+
+		if ( b64 )
+			Put32( AtRva + 4, (uint32_t)( Value >> 32 ) );
+	}
+};
+
+const uint32_t SectionAlignment = 0x1000;
+const uint32_t FileAlignment = 0x200;
+
+enum Corruption
+{
+	CorruptNone,
+	CorruptTruncate,
+	CorruptNtHeaderOffset,
+	CorruptImportRva,
+	CorruptImportSize,
+	CorruptThunkRva,
+	CorruptNumberOfSections,
+	CorruptUnterminatedThunks,
+	CorruptHeaderBytes,
+	NumCorruptions
+};
+
+// Write a thunk table and the names it points to, returns the rva of the table
+static uint32_t
+BuildThunks(
+	Random& Rng,
+	const GeneratorOptions& Options,
+	SectionBuilder& Rdata,
+	bool b64,
+	int numThunks,
+	bool bTerminate
+)
+{
+	size_t ThunkSize = b64 ? 8 : 4;
+	uint32_t Table = Rdata.Reserve( ( numThunks + ( bTerminate ? 1 : 0 ) ) * ThunkSize, ThunkSize );
+
+	for ( int i = 0; i < numThunks; i++ )
+	{
+		uint64_t Thunk;
+
+		if ( Rng.Percent( Options.OrdinalPercent ) )
+			Thunk = ( b64 ? 0x8000000000000000ull : 0x80000000ull ) | (uint64_t)Rng.Range( 1, 0xffff );
+		else
+			Thunk = Rdata.ImportByName( Rng, MakeName( Rng, Rng.Range( Options.MinNameLength, Options.MaxNameLength ) ) );
+
+		Rdata.PutThunk( Table + (uint32_t)( i * ThunkSize ), Thunk, b64 );
+	}
+
+	return Table;
+}
+
+// Build one image into Image, deterministic for a seed and file index
+static void
+BuildImage(
+	const GeneratorOptions& Options,
+	size_t FileIndex,
+	ImageBuffer& Image
+)
+{
+	Random Rng = { Options.Seed * 0x100000001b3ull + FileIndex };
+
+	bool b64 = Options.Machine == 64 || ( Options.Machine == 0 && Rng.Percent( 50 ) );
+	Corruption Corrupt = Rng.Percent( Options.CorruptPercent ) ? (Corruption)Rng.Range( CorruptTruncate, NumCorruptions - 1 ) : CorruptNone;
+
+	int numSections = std::max( 2, Options.numSections );
+	uint32_t OptionalHeaderSize = b64 ? 240 : 224;
+	uint32_t NtOffset = 0x80;
+	uint32_t SectionTableOffset = NtOffset + 4 + 20 + OptionalHeaderSize;
+	uint32_t SizeOfHeaders = ( SectionTableOffset + numSections * 40 + FileAlignment - 1 ) & ~( FileAlignment - 1 );
+	uint64_t ImageBase = b64 ? 0x140000000ull : 0x10000;
+
+	// .text first, then .rdata holding the import, delay import and export data
+	std::vector<SectionBuilder> Sections( numSections );
+
+	for ( int i = 0; i < numSections; i++ )
+		Sections[i].Rva = SectionAlignment * ( i + 1 );
+
+	Sections[0].Data.resize( Rng.Range( 0x200, 0x1000 ), 0xcc );
+
+	SectionBuilder& Rdata = Sections[1];
+	size_t ThunkSize = b64 ? 8 : 4;
+
+	// Imports, descriptors first, then each dll's name, name table and address table
+	int numDlls = Rng.Range( Options.MinDlls, Options.MaxDlls );
+	uint32_t ImportRva = Rdata.Reserve( ( numDlls + 1 ) * 20, 4 );
+	uint32_t FirstThunkRva = 0;
+
+	for ( int i = 0; i < numDlls; i++ )
+	{
+		int numThunks = Rng.Range( Options.MinThunks, Options.MaxThunks );
+		bool bTerminate = !( Corrupt == CorruptUnterminatedThunks && i == numDlls - 1 );
+
+		uint32_t NameRva = Rdata.String( DllNames[( FileIndex + i ) % numDllNames] );
+		uint32_t NameTable = BuildThunks( Rng, Options, Rdata, b64, numThunks, bTerminate );
+
+		// The address table is a copy of the name table on disk, an unterminated table runs on into the names after it
+		uint32_t AddressTable = Rdata.Reserve( ( numThunks + 1 ) * ThunkSize, ThunkSize );
+		memcpy( &Rdata.Data[AddressTable - Rdata.Rva], &Rdata.Data[NameTable - Rdata.Rva], ( numThunks + 1 ) * ThunkSize );
+
+		if ( !FirstThunkRva )
+			FirstThunkRva = NameTable;
+
+		uint32_t Descriptor = ImportRva + i * 20;
+		Rdata.Put32( Descriptor, NameTable );
+		Rdata.Put32( Descriptor + 12, NameRva );
+		Rdata.Put32( Descriptor + 16, AddressTable );
+	}
+
+	// Delay imports, IMAGE_DELAYLOAD_DESCRIPTOR with rva based attributes
+	uint32_t DelayRva = 0;
+	int numDelayDlls = Rng.Percent( Options.DelayPercent ) ? Rng.Range( 1, std::max( 1, Options.MaxDelayDlls ) ) : 0;
+
+	if ( numDelayDlls )
+	{
+		DelayRva = Rdata.Reserve( ( numDelayDlls + 1 ) * 32, 4 );
+
+		for ( int i = 0; i < numDelayDlls; i++ )
+		{
+			uint32_t NameRva = Rdata.String( DllNames[( FileIndex + numDlls + i ) % numDllNames] );
+			uint32_t NameTable = BuildThunks( Rng, Options, Rdata, b64, Rng.Range( Options.MinThunks, Options.MaxThunks ), true );
+			uint32_t Descriptor = DelayRva + i * 32;
+
+			Rdata.Put32( Descriptor, 1 );
+			Rdata.Put32( Descriptor + 4, NameRva );
+			Rdata.Put32( Descriptor + 12, NameTable );
+			Rdata.Put32( Descriptor + 16, NameTable );
+		}
+	}
+
+	// Exports, sorted names as the loader expects, some forwarded
+	uint32_t ExportRva = 0;
+	uint32_t ExportSize = 0;
+	int numExports = Rng.Percent( Options.ExportPercent ) ? Rng.Range( 1, std::max( 1, Options.MaxExports ) ) : 0;
+
+	if ( numExports )
+	{
+		std::vector<std::string> Names;
+
+		for ( int i = 0; i < numExports; i++ )
+			Names.push_back( MakeName( Rng, Rng.Range( Options.MinNameLength, Options.MaxNameLength ) ) );
+
+		std::sort( Names.begin(), Names.end() );
+		Names.erase( std::unique( Names.begin(), Names.end() ), Names.end() );
+		numExports = (int)Names.size();
+
+		ExportRva = Rdata.Reserve( 40, 4 );
+		uint32_t Functions = Rdata.Reserve( numExports * 4, 4 );
+		uint32_t NameTable = Rdata.Reserve( numExports * 4, 4 );
+		uint32_t Ordinals = Rdata.Reserve( numExports * 2, 2 );
+		uint32_t ModuleName = Rdata.String( "generated" + std::to_string( FileIndex ) + ".dll" );
+
+		for ( int i = 0; i < numExports; i++ )
+		{
+			Rdata.Put32( NameTable + i * 4, Rdata.String( Names[i] ) );
+			Rdata.Data[Ordinals + i * 2 - Rdata.Rva] = (uint8_t)i;
+			Rdata.Data[Ordinals + i * 2 + 1 - Rdata.Rva] = (uint8_t)( i >> 8 );
+
+			// Forwarder strings live inside the export directory
+			if ( Rng.Percent( 20 ) )
+				Rdata.Put32( Functions + i * 4, Rdata.String( "NTOSKRNL." + MakeName( Rng, Rng.Range( Options.MinNameLength, Options.MaxNameLength ) ) ) );
+			else
+				Rdata.Put32( Functions + i * 4, Sections[0].Rva + (uint32_t)Rng.Range( 0, 0x1ff ) );
+		}
+
+		ExportSize = Rdata.Align( 4 ) - ExportRva;
+
+		Rdata.Put32( ExportRva + 12, ModuleName );
+		Rdata.Put32( ExportRva + 16, 1 );
+		Rdata.Put32( ExportRva + 20, numExports );
+		Rdata.Put32( ExportRva + 24, numExports );
+		Rdata.Put32( ExportRva + 28, Functions );
+		Rdata.Put32( ExportRva + 32, NameTable );
+		Rdata.Put32( ExportRva + 36, Ordinals );
+	}
+
+	for ( int i = 2; i < numSections; i++ )
+		Sections[i].Data.resize( Rng.Range( 0x100, 0x1000 ), (uint8_t)i );
+
+	// Sections never overlap, so give later sections room for the ones before them
+	for ( int i = 1; i < numSections; i++ )
+		Sections[i].Rva = std::max( Sections[i].Rva, ( Sections[i - 1].Rva + (uint32_t)Sections[i - 1].Data.size() + SectionAlignment - 1 ) & ~( SectionAlignment - 1 ) );
+
+	uint32_t FileSize = SizeOfHeaders;
+	std::vector<uint32_t> RawOffsets( numSections );
+
+	for ( int i = 0; i < numSections; i++ )
+	{
+		RawOffsets[i] = FileSize;
+		FileSize += ( (uint32_t)Sections[i].Data.size() + FileAlignment - 1 ) & ~( FileAlignment - 1 );
+	}
+
+	uint32_t SizeOfImage = ( Sections.back().Rva + (uint32_t)Sections.back().Data.size() + SectionAlignment - 1 ) & ~( SectionAlignment - 1 );
+
+	Image.Data.assign( FileSize, 0 );
+
+	// DOS header
+	Image.Put16( 0, 'M' | ( 'Z' << 8 ) );
+	Image.Put32( 0x3c, NtOffset );
+
+	// NT headers
+	size_t FileHeader = NtOffset + 4;
+	size_t OptionalHeader = FileHeader + 20;
+
+	Image.Put32( NtOffset, 'P' | ( 'E' << 8 ) );
+	Image.Put16( FileHeader, b64 ? 0x8664 : 0x14c );
+	Image.Put16( FileHeader + 2, numSections );
+	Image.Put32( FileHeader + 4, (uint32_t)Rng.Next() );
+	Image.Put16( FileHeader + 16, OptionalHeaderSize );
+	Image.Put16( FileHeader + 18, b64 ? 0x22 : 0x102 );
+
+	Image.Put16( OptionalHeader, b64 ? 0x20b : 0x10b );
+	Image.Put32( OptionalHeader + 16, Sections[0].Rva );
+	Image.Put32( OptionalHeader + 20, Sections[0].Rva );
+
+	if ( b64 )
+		Image.Put64( OptionalHeader + 24, ImageBase );
+	else
+		Image.Put32( OptionalHeader + 28, (uint32_t)ImageBase );
+
+	Image.Put32( OptionalHeader + 32, SectionAlignment );
+	Image.Put32( OptionalHeader + 36, FileAlignment );
+	Image.Put16( OptionalHeader + 40, 10 );
+	Image.Put16( OptionalHeader + 48, 10 );
+	Image.Put32( OptionalHeader + 56, SizeOfImage );
+	Image.Put32( OptionalHeader + 60, SizeOfHeaders );
+	Image.Put16( OptionalHeader + 68, 1 );
+
+	size_t DataDirectory = OptionalHeader + ( b64 ? 112 : 96 );
+	Image.Put32( DataDirectory - 4, 16 );
+
+	Image.Put32( DataDirectory + 0 * 8, ExportRva );
+	Image.Put32( DataDirectory + 0 * 8 + 4, ExportSize );
+	Image.Put32( DataDirectory + 1 * 8, ImportRva );
+	Image.Put32( DataDirectory + 1 * 8 + 4, ( numDlls + 1 ) * 20 );
+	Image.Put32( DataDirectory + 13 * 8, DelayRva );
+	Image.Put32( DataDirectory + 13 * 8 + 4, numDelayDlls ? ( numDelayDlls + 1 ) * 32 : 0 );
+
+	// Section table and contents
+	static const char *const SectionNames[] = { ".text", ".rdata", ".data", ".pdata", ".rsrc", ".reloc" };
+
+	for ( int i = 0; i < numSections; i++ )
+	{
+		size_t Header = SectionTableOffset + i * 40;
+		char Name[16] = {};
+
+		if ( i < 6 )
+			snprintf( Name, sizeof( Name ), "%s", SectionNames[i] );
+		else
+			snprintf( Name, sizeof( Name ), ".sec%i", i );
+
+		memcpy( &Image.Data[Header], Name, 8 );
+		Image.Put32( Header + 8, (uint32_t)Sections[i].Data.size() );
+		Image.Put32( Header + 12, Sections[i].Rva );
+		Image.Put32( Header + 16, ( (uint32_t)Sections[i].Data.size() + FileAlignment - 1 ) & ~( FileAlignment - 1 ) );
+		Image.Put32( Header + 20, RawOffsets[i] );
+		Image.Put32( Header + 36, i == 0 ? 0x60000020 : 0x40000040 );
+
+		if ( !Sections[i].Data.empty() )
+			memcpy( &Image.Data[RawOffsets[i]], Sections[i].Data.data(), Sections[i].Data.size() );
+	}
+
+	switch ( Corrupt )
+	{
+	case CorruptTruncate:
+		Image.Data.resize( Rng.Range( 2, (int)Image.Data.size() - 1 ) );
+		break;
+
+	case CorruptNtHeaderOffset:
+		Image.Put32( 0x3c, FileSize + (uint32_t)Rng.Range( 0, 0x10000 ) );
+		break;
+
+	case CorruptImportRva:
+		Image.Put32( DataDirectory + 1 * 8, SizeOfImage + (uint32_t)Rng.Range( 0, 0x100000 ) );
+		break;
+
+	case CorruptImportSize:
+		Image.Put32( DataDirectory + 1 * 8 + 4, (uint32_t)Rng.Next() | 0x80000000 );
+		break;
+
+	case CorruptThunkRva:
+		Image.Put32( RawOffsets[1] + FirstThunkRva - Rdata.Rva, (uint32_t)Rng.Next() & 0x7fffffff );
+		break;
+
+	case CorruptNumberOfSections:
+		Image.Put16( FileHeader + 2, 0xffff );
+		break;
+
+	case CorruptHeaderBytes:
+		for ( int i = 0; i < 16; i++ )
+			Image.Data[Rng.Range( 0, SizeOfHeaders - 1 )] = (uint8_t)Rng.Next();
+		break;
+
+	default:
+		break;
+	}
+}
+
+static bool
+ParseRange(
+	const char *pszValue,
+	int& Min,
+	int& Max
+)
+{
+	char *End;
+	Min = (int)strtol( pszValue, &End, 10 );
+	Max = *End == '-' ? (int)strtol( End + 1, &End, 10 ) : Min;
+	return *End == 0 && Min >= 0 && Max >= Min;
+}
+
+int main( int argc, char **argv )
+{
+	GeneratorOptions Options;
+	int argi = 1;
+
+	// Options come before the directory, like impfi
+	for ( ; argi < argc && 0 == strncmp( argv[argi], "--", 2 ); argi++ )
+	{
+		const char *const pszOption = argv[argi];
+		const char *const pszValue = argi + 1 < argc ? argv[argi + 1] : NULL;
+		bool bValid = pszValue != NULL;
+
+		if ( !bValid )
+			;
+		else if ( 0 == strcmp( pszOption, "--files" ) )
+			Options.numFiles = strtoull( pszValue, NULL, 10 );
+		else if ( 0 == strcmp( pszOption, "--seed" ) )
+			Options.Seed = strtoull( pszValue, NULL, 10 );
+		else if ( 0 == strcmp( pszOption, "--machine" ) )
+			Options.Machine = 0 == strcmp( pszValue, "mixed" ) ? 0 : atoi( pszValue );
+		else if ( 0 == strcmp( pszOption, "--sections" ) )
+			Options.numSections = std::min( 96, std::max( 2, atoi( pszValue ) ) );
+		else if ( 0 == strcmp( pszOption, "--dlls" ) )
+			bValid = ParseRange( pszValue, Options.MinDlls, Options.MaxDlls );
+		else if ( 0 == strcmp( pszOption, "--thunks" ) )
+			bValid = ParseRange( pszValue, Options.MinThunks, Options.MaxThunks );
+		else if ( 0 == strcmp( pszOption, "--name-length" ) )
+			bValid = ParseRange( pszValue, Options.MinNameLength, Options.MaxNameLength ) && Options.MinNameLength > 0;
+		else if ( 0 == strcmp( pszOption, "--ordinals" ) )
+			Options.OrdinalPercent = atoi( pszValue );
+		else if ( 0 == strcmp( pszOption, "--delay" ) )
+			Options.DelayPercent = atoi( pszValue );
+		else if ( 0 == strcmp( pszOption, "--delay-dlls" ) )
+			Options.MaxDelayDlls = atoi( pszValue );
+		else if ( 0 == strcmp( pszOption, "--exports" ) )
+			Options.ExportPercent = atoi( pszValue );
+		else if ( 0 == strcmp( pszOption, "--max-exports" ) )
+			Options.MaxExports = atoi( pszValue );
+		else if ( 0 == strcmp( pszOption, "--corrupt" ) )
+			Options.CorruptPercent = atoi( pszValue );
+		else if ( 0 == strcmp( pszOption, "--extension" ) )
+			Options.pszExtension = pszValue;
+		else if ( 0 == strcmp( pszOption, "--threads" ) )
+			Options.numThreads = (unsigned)atoi( pszValue );
+		else
+			bValid = false;
+
+		if ( !bValid )
+		{
+			printf( "Invalid option %s\n", pszOption );
+			return 1;
+		}
+
+		argi++;
+	}
+
+	if ( argc - argi < 1 )
+	{
+		printf( "Import Finder Generator - Writes synthetic PE files for benchmarking impfi\n" );
+		printf( "\timpfigen [options] <directory>\n" );
+		printf( "\timpfigen --files 100000 --corrupt 2 corpus\n" );
+		printf( "Options, ranges are min-max or a single value\n" );
+		printf( "\t--files <n>\t\tNumber of files, 1000\n" );
+		printf( "\t--seed <n>\t\tThe same seed always writes the same files, 1\n" );
+		printf( "\t--machine <32|64|mixed>\tPE32 (i386) or PE32+ (amd64) images, 64\n" );
+		printf( "\t--sections <n>\t\tSections per image, 4\n" );
+		printf( "\t--dlls <range>\t\tImport descriptors per image, 2-8\n" );
+		printf( "\t--thunks <range>\tImports per descriptor, 4-64\n" );
+		printf( "\t--name-length <range>\tLength of made up import names, 6-32\n" );
+		printf( "\t--ordinals <percent>\tImports by ordinal, 5\n" );
+		printf( "\t--delay <percent>\tImages with delay imports, 20\n" );
+		printf( "\t--delay-dlls <n>\tMost delay import descriptors per image, 2\n" );
+		printf( "\t--exports <percent>\tImages with exports, 10\n" );
+		printf( "\t--max-exports <n>\tMost exports per image, 64\n" );
+		printf( "\t--corrupt <percent>\tImages corrupted in one of several ways, 0\n" );
+		printf( "\t--extension <ext>\tExtension of the files, .sys\n" );
+		printf( "\t--threads <n>\t\tFiles built at once, defaults to the number of processors\n" );
+		return 0;
+	}
+
+	std::filesystem::path Directory( argv[argi] );
+	std::error_code Error;
+	std::filesystem::create_directories( Directory, Error );
+
+	if ( Error )
+	{
+		printf( "%s - Could not create directory\n", argv[argi] );
+		return 1;
+	}
+
+	unsigned numThreads = Options.numThreads ? Options.numThreads : std::max( 1u, std::thread::hardware_concurrency() );
+	std::atomic<size_t> Next( 0 );
+	std::atomic<size_t> numFailed( 0 );
+	std::atomic<uint64_t> numBytes( 0 );
+	std::vector<std::thread> Workers;
+
+	auto Start = std::chrono::steady_clock::now();
+
+	auto Work = [&]()
+	{
+		ImageBuffer Image;
+		char Name[64];
+
+		for ( size_t Index; ( Index = Next.fetch_add( 1 ) ) < Options.numFiles; )
+		{
+			BuildImage( Options, Index, Image );
+
+			snprintf( Name, sizeof( Name ), "%08zu%s", Index, Options.pszExtension );
+
+			// One write per file
+			FILE *f = fopen( ( Directory / Name ).string().c_str(), "wb" );
+
+			if ( !f || 1 != fwrite( Image.Data.data(), Image.Data.size(), 1, f ) )
+				numFailed++;
+			else
+				numBytes += Image.Data.size();
+
+			if ( f )
+				fclose( f );
+		}
+	};
+
+	for ( unsigned i = 1; i < numThreads; i++ )
+		Workers.emplace_back( Work );
+
+	Work();
+
+	for ( auto& Worker : Workers )
+		Worker.join();
+
+	double Seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - Start ).count();
+
+	printf( "%zu file(s), %.1f MB in %.2f s\n", Options.numFiles - numFailed, numBytes / 1048576.0, Seconds );
+
+	if ( numFailed )
+	{
+		printf( "%zu file(s) could not be written\n", numFailed.load() );
+		return 1;
+	}
+
+	return 0;
+}